@@ -0,0 +1,202 @@
+// SoundAnalysis - silence and level measurement of 16-bit samples
+
+#include <math.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SOUND_ANALYSIS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SOUND_ANALYSIS_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "SoundAnalysis.h"
+
+double SoundBlockInfo::rms(size_t count) const
+{
+	return (count != 0) ? sqrt((double)square_sum / count) : 0.0;
+}
+
+static inline uint16_t SaturatedAbs(int16_t sample)
+{
+	return (sample >= 0) ? sample : ((sample == INT16_MIN) ? INT16_MAX : -sample);
+}
+
+// Scans samples [start, count) one by one, adding to what info has so far
+static void AnalyzeSoundBlockScalar(const int16_t * samples, size_t start, size_t count, uint16_t threshold, SoundBlockInfo * info)
+{
+	for (size_t i = start; i < count; i++)
+	{
+		uint16_t level = SaturatedAbs(samples[i]);
+		if (level > threshold)
+		{
+			if (info->first_audible == count)
+			{
+				info->first_audible = i;
+			}
+			info->last_audible = i;
+		}
+
+		if (level > info->peak)
+		{
+			info->peak = level;
+		}
+		info->abs_sum += level;
+		info->square_sum += (uint32_t)level * level;
+	}
+}
+
+#if defined(SOUND_ANALYSIS_SSE2) || defined(SOUND_ANALYSIS_AVX2)
+static inline unsigned int LowestBitIndex(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+static inline unsigned int HighestBitIndex(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, mask);
+	return index;
+#else
+	return 31 - __builtin_clz(mask);
+#endif
+}
+#endif
+
+void AnalyzeSoundBlock(const int16_t * samples, size_t count, uint16_t threshold, SoundBlockInfo * info)
+{
+	info->first_audible = count;
+	info->last_audible = count;
+	info->peak = 0;
+	info->abs_sum = 0;
+	info->square_sum = 0;
+
+	// a threshold above every level can not be compared as a signed value
+	if (threshold > INT16_MAX)
+	{
+		threshold = INT16_MAX;
+	}
+
+	size_t i = 0;
+
+#if defined(SOUND_ANALYSIS_AVX2)
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i limit = _mm256_set1_epi16((int16_t)threshold);
+	__m256i peak = zero;
+	__m256i abs_sum = zero;
+	__m256i square_sum = zero;
+	for (; i + 16 <= count; i += 16)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(samples + i));
+		__m256i level = _mm256_max_epi16(x, _mm256_subs_epi16(zero, x));
+
+		// two mask bits per sample
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi16(level, limit));
+		if (mask != 0)
+		{
+			if (info->first_audible == count)
+			{
+				info->first_audible = i + LowestBitIndex(mask) / 2;
+			}
+			info->last_audible = i + HighestBitIndex(mask) / 2;
+		}
+
+		// the pair sums are below 2^31, and can be widened as unsigned
+		peak = _mm256_max_epi16(peak, level);
+		__m256i pairs = _mm256_madd_epi16(level, ones);
+		abs_sum = _mm256_add_epi64(abs_sum, _mm256_unpacklo_epi32(pairs, zero));
+		abs_sum = _mm256_add_epi64(abs_sum, _mm256_unpackhi_epi32(pairs, zero));
+		__m256i squares = _mm256_madd_epi16(level, level);
+		square_sum = _mm256_add_epi64(square_sum, _mm256_unpacklo_epi32(squares, zero));
+		square_sum = _mm256_add_epi64(square_sum, _mm256_unpackhi_epi32(squares, zero));
+	}
+
+	uint16_t peaks[16];
+	uint64_t sums[4];
+	_mm256_storeu_si256((__m256i *)peaks, peak);
+	for (int j = 0; j < 16; j++)
+	{
+		if (peaks[j] > info->peak)
+		{
+			info->peak = peaks[j];
+		}
+	}
+	_mm256_storeu_si256((__m256i *)sums, abs_sum);
+	info->abs_sum = sums[0] + sums[1] + sums[2] + sums[3];
+	_mm256_storeu_si256((__m256i *)sums, square_sum);
+	info->square_sum = sums[0] + sums[1] + sums[2] + sums[3];
+#elif defined(SOUND_ANALYSIS_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16(1);
+	const __m128i limit = _mm_set1_epi16((int16_t)threshold);
+	__m128i peak = zero;
+	__m128i abs_sum = zero;
+	__m128i square_sum = zero;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i *)(samples + i));
+		__m128i level = _mm_max_epi16(x, _mm_subs_epi16(zero, x));
+
+		// two mask bits per sample
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi16(level, limit));
+		if (mask != 0)
+		{
+			if (info->first_audible == count)
+			{
+				info->first_audible = i + LowestBitIndex(mask) / 2;
+			}
+			info->last_audible = i + HighestBitIndex(mask) / 2;
+		}
+
+		// the pair sums are below 2^31, and can be widened as unsigned
+		peak = _mm_max_epi16(peak, level);
+		__m128i pairs = _mm_madd_epi16(level, ones);
+		abs_sum = _mm_add_epi64(abs_sum, _mm_unpacklo_epi32(pairs, zero));
+		abs_sum = _mm_add_epi64(abs_sum, _mm_unpackhi_epi32(pairs, zero));
+		__m128i squares = _mm_madd_epi16(level, level);
+		square_sum = _mm_add_epi64(square_sum, _mm_unpacklo_epi32(squares, zero));
+		square_sum = _mm_add_epi64(square_sum, _mm_unpackhi_epi32(squares, zero));
+	}
+
+	uint16_t peaks[8];
+	uint64_t sums[2];
+	_mm_storeu_si128((__m128i *)peaks, peak);
+	for (int j = 0; j < 8; j++)
+	{
+		if (peaks[j] > info->peak)
+		{
+			info->peak = peaks[j];
+		}
+	}
+	_mm_storeu_si128((__m128i *)sums, abs_sum);
+	info->abs_sum = sums[0] + sums[1];
+	_mm_storeu_si128((__m128i *)sums, square_sum);
+	info->square_sum = sums[0] + sums[1];
+#endif
+
+	// the rest that does not fill a vector, or everything without one
+	AnalyzeSoundBlockScalar(samples, i, count, threshold, info);
+}
+
+const char * GetSoundAnalyzerName(void)
+{
+#if defined(SOUND_ANALYSIS_AVX2)
+	return "AVX2";
+#elif defined(SOUND_ANALYSIS_SSE2)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
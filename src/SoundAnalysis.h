@@ -0,0 +1,27 @@
+// SoundAnalysis - silence and level measurement of 16-bit samples
+
+#ifndef SOUNDANALYSIS_H_INCLUDED
+#define SOUNDANALYSIS_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct SoundBlockInfo
+{
+	size_t first_audible;   // index of the first audible sample, or the count if there is none
+	size_t last_audible;    // index of the last audible sample, or the count if there is none
+	uint16_t peak;          // largest absolute value
+	uint64_t abs_sum;       // sum of absolute values
+	uint64_t square_sum;    // sum of squares, for RMS
+
+	double rms(size_t count) const;
+};
+
+// Measures count samples at once. A sample is audible if its absolute value is
+// greater than the threshold. Absolute values saturate, -32768 counts as 32767.
+void AnalyzeSoundBlock(const int16_t * samples, size_t count, uint16_t threshold, SoundBlockInfo * info);
+
+// Name of the instruction set AnalyzeSoundBlock has been built for
+const char * GetSoundAnalyzerName(void);
+
+#endif
@@ -0,0 +1,139 @@
+// SoundPipe - passes the sound of the emulator to another thread
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "SoundPipe.h"
+
+SoundPipe::SoundPipe(GBASoundOut * target) :
+	target(target),
+	chunks(CHUNK_COUNT),
+	head(0),
+	tail(0),
+	consumer_waiting(false),
+	producer_waiting(false),
+	quit(false)
+{
+	consumer = std::thread(&SoundPipe::run, this);
+}
+
+SoundPipe::~SoundPipe()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+		readable.notify_one();
+	}
+	consumer.join();
+}
+
+void SoundPipe::write(const void * samples, unsigned long bytes)
+{
+	const s16 * p = (const s16 *)samples;
+	unsigned long count = bytes / 2;
+	while (count != 0)
+	{
+		wait_for_consumer(CHUNK_COUNT - 1);
+
+		Chunk & chunk = chunks[head.load(std::memory_order_relaxed) % CHUNK_COUNT];
+		chunk.count = std::min<unsigned long>(count, CHUNK_SAMPLES);
+		chunk.skipped = 0;
+		memcpy(chunk.samples, p, chunk.count * 2);
+		publish();
+
+		p += chunk.count;
+		count -= chunk.count;
+	}
+}
+
+void SoundPipe::skip(unsigned long samples)
+{
+	if (samples == 0)
+	{
+		return;
+	}
+
+	wait_for_consumer(CHUNK_COUNT - 1);
+
+	Chunk & chunk = chunks[head.load(std::memory_order_relaxed) % CHUNK_COUNT];
+	chunk.count = 0;
+	chunk.skipped = samples;
+	publish();
+}
+
+void SoundPipe::flush(void)
+{
+	wait_for_consumer(0);
+}
+
+void SoundPipe::wait_for_consumer(size_t max_pending)
+{
+	if (head.load(std::memory_order_relaxed) - tail.load() <= max_pending)
+	{
+		return;
+	}
+
+	// the consumer checks the flag after it moves the tail, so one of the two sees the other
+	std::unique_lock<std::mutex> lock(mutex);
+	producer_waiting = true;
+	while (head.load(std::memory_order_relaxed) - tail.load() > max_pending)
+	{
+		writable.wait(lock);
+	}
+	producer_waiting = false;
+}
+
+void SoundPipe::publish(void)
+{
+	head.store(head.load(std::memory_order_relaxed) + 1);
+
+	if (consumer_waiting.load())
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		readable.notify_one();
+	}
+}
+
+void SoundPipe::run(void)
+{
+	size_t next = tail.load(std::memory_order_relaxed);
+	while (true)
+	{
+		if (head.load() == next)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			consumer_waiting = true;
+			while (head.load() == next && !quit)
+			{
+				readable.wait(lock);
+			}
+			consumer_waiting = false;
+
+			// everything that has been written is passed before leaving
+			if (head.load() == next)
+			{
+				break;
+			}
+		}
+
+		const Chunk & chunk = chunks[next % CHUNK_COUNT];
+		if (chunk.count != 0)
+		{
+			target->write(chunk.samples, chunk.count * 2);
+		}
+		else
+		{
+			target->skip(chunk.skipped);
+		}
+
+		next++;
+		tail.store(next);
+
+		if (producer_waiting.load())
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			writable.notify_one();
+		}
+	}
+}
@@ -0,0 +1,63 @@
+// SoundPipe - passes the sound of the emulator to another thread
+
+#ifndef SOUNDPIPE_H_INCLUDED
+#define SOUNDPIPE_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vbam/gba/GBA.h"
+
+// Sound output that queues the samples in a single-producer/single-consumer ring,
+// and hands them to the target output on a thread of its own, in the same order.
+// The emulator thread only waits when the ring is full, or when flush() is called.
+class SoundPipe : public GBASoundOut
+{
+public:
+	SoundPipe(GBASoundOut * target);
+	virtual ~SoundPipe();
+
+	virtual void write(const void * samples, unsigned long bytes);
+	virtual void skip(unsigned long samples);
+
+	// Waits until the target has received everything written so far,
+	// after which the target can be used by the calling thread
+	void flush(void);
+
+private:
+	enum { CHUNK_COUNT = 64, CHUNK_SAMPLES = 2048 };
+
+	// a run of samples, or a count of skipped samples if count is 0
+	struct Chunk
+	{
+		unsigned long count;
+		unsigned long skipped;
+		s16 samples[CHUNK_SAMPLES];
+	};
+
+	GBASoundOut * target;
+	std::vector<Chunk> chunks;
+
+	// chunks are numbered from the start, head is written only by the producer,
+	// tail only by the consumer
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+
+	std::mutex mutex;
+	std::condition_variable readable;
+	std::condition_variable writable;
+	std::atomic<bool> consumer_waiting;
+	std::atomic<bool> producer_waiting;
+	bool quit;
+
+	std::thread consumer;
+
+	void wait_for_consumer(size_t max_pending);
+	void publish(void);
+	void run(void);
+};
+
+#endif
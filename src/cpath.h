@@ -106,6 +106,15 @@ static INLINE const char *path_findext(const char *path)
 #endif
 }
 
+static INLINE bool path_isabsolute(const char *path)
+{
+#ifdef _WIN32
+	return !PathIsRelativeA(path);
+#else
+	return path != NULL && path[0] == PATH_SEPARATOR_CHAR;
+#endif
+}
+
 static INLINE void path_basename(char *path)
 {
 #ifdef _WIN32
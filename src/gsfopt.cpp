@@ -3,16 +3,23 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
 
 #include <string>
 #include <map>
+#include <list>
 #include <vector>
 #include <iterator>
 #include <limits>
 #include <algorithm>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
 
 #include "gsfopt.h"
 #include "cpath.h"
@@ -20,10 +27,7 @@
 #include "PSFFile.h"
 
 #ifdef WIN32
-#include <direct.h>
 #include <float.h>
-#define getcwd _getcwd
-#define chdir _chdir
 #define isnan _isnan
 #define strcasecmp _stricmp
 #else
@@ -41,6 +45,68 @@
 #define MAX_GBA_ROM_SIZE	0x02000000
 #define MAX_GSF_EXE_SIZE	(MAX_GBA_ROM_SIZE + GSF_EXE_HEADER_SIZE)
 
+// Decoded EXE of a gsflib. A set of minigsfs loads the same gsflib
+// for every song, so the inflated image is kept and copied instead.
+struct GSFLibImage
+{
+	u32 compressed_crc32;
+	u32 entrypoint;
+	u32 rom_address;
+	std::vector<u8> data;
+};
+
+// keyed by absolute path, shared by all worker threads, the most recently used
+// first. A few images cover the sets in progress, the others are dropped.
+static const size_t GSFLIB_CACHE_SIZE = 4;
+static std::list<std::pair<std::string, std::shared_ptr<const GSFLibImage> > > gsflib_cache;
+static std::mutex gsflib_cache_mutex;
+
+static std::shared_ptr<const GSFLibImage> FindGSFLibImage(const std::string& path, u32 compressed_crc32)
+{
+	std::lock_guard<std::mutex> lock(gsflib_cache_mutex);
+
+	for (auto it = gsflib_cache.begin(); it != gsflib_cache.end(); ++it)
+	{
+		if (it->first == path)
+		{
+			if (it->second->compressed_crc32 != compressed_crc32)
+			{
+				return std::shared_ptr<const GSFLibImage>();
+			}
+			gsflib_cache.splice(gsflib_cache.begin(), gsflib_cache, it);
+			return it->second;
+		}
+	}
+	return std::shared_ptr<const GSFLibImage>();
+}
+
+static void StoreGSFLibImage(const std::string& path, u32 compressed_crc32, u32 entrypoint, u32 rom_address, const u8 * data, u32 size)
+{
+	std::shared_ptr<GSFLibImage> image = std::make_shared<GSFLibImage>();
+	image->compressed_crc32 = compressed_crc32;
+	image->entrypoint = entrypoint;
+	image->rom_address = rom_address;
+	image->data.assign(data, data + size);
+
+	// a modified file replaces the previous image of the same path
+	std::lock_guard<std::mutex> lock(gsflib_cache_mutex);
+	for (auto it = gsflib_cache.begin(); it != gsflib_cache.end(); ++it)
+	{
+		if (it->first == path)
+		{
+			gsflib_cache.erase(it);
+			break;
+		}
+	}
+	gsflib_cache.push_front(std::make_pair(path, std::shared_ptr<const GSFLibImage>(image)));
+
+	// the images in use are kept alive by their loaders
+	if (gsflib_cache.size() > GSFLIB_CACHE_SIZE)
+	{
+		gsflib_cache.pop_back();
+	}
+}
+
 GsfOpt::GsfOpt() :
 	bytes_used(0),
 	optimize_timeout(300.0),
@@ -49,13 +115,19 @@ GsfOpt::GsfOpt() :
 	target_loop_count(2),
 	loop_verify_length(20.0),
 	oneshot_verify_length(15),
+	state_loop_verify_length(0.0),
+	loop_match_length(0.0),
+	sound_sample_rate(8000),
+	sound_analysis_threaded(false),
+	optimize_finished(false),
 	paranoid_closed_area_fill_size(3),
 	paranoid_post_fill_size(0),
 	paranoid_filled_size(0),
-	covered_size(0)
+	covered_size(0),
+	console_log(NULL),
+	checkpoint_interval(0.0)
 {
 	m_system = new GBASystem;
-	rom_refs = new u8[MAX_GBA_ROM_SIZE];
 
 	ResetOptimizer();
 }
@@ -67,10 +139,6 @@ GsfOpt::~GsfOpt()
 		CPUCleanUp(m_system);
 		delete m_system;
 	}
-	if (rom_refs != NULL)
-	{
-		delete [] rom_refs;
-	}
 }
 
 std::string GsfOpt::ToTimeString(double t, bool padding)
@@ -205,22 +273,86 @@ double GsfOpt::ToTimeValue(const std::string& str)
 	return tv;
 }
 
+void GsfOpt::ConsolePrint(std::string * log, FILE * stream, const char * format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	if (log == NULL)
+	{
+		vfprintf(stream, format, args);
+	}
+	else
+	{
+		va_list args_copy;
+		va_copy(args_copy, args);
+		int len = vsnprintf(NULL, 0, format, args_copy);
+		va_end(args_copy);
+
+		if (len > 0)
+		{
+			std::vector<char> str(len + 1);
+			vsnprintf(&str[0], str.size(), format, args);
+			log->append(&str[0], len);
+		}
+	}
+	va_end(args);
+}
+
+void GsfOpt::CopySettings(const GsfOpt& other)
+{
+	optimize_timeout = other.optimize_timeout;
+	optimize_progress_frequency = other.optimize_progress_frequency;
+	time_loop_based = other.time_loop_based;
+	target_loop_count = other.target_loop_count;
+	loop_verify_length = other.loop_verify_length;
+	oneshot_verify_length = other.oneshot_verify_length;
+	state_loop_verify_length = other.state_loop_verify_length;
+	loop_match_length = other.loop_match_length;
+	sound_sample_rate = other.sound_sample_rate;
+	sound_analysis_threaded = other.sound_analysis_threaded;
+	paranoid_closed_area_fill_size = other.paranoid_closed_area_fill_size;
+	paranoid_post_fill_size = other.paranoid_post_fill_size;
+}
+
+void GsfOpt::MergeCoverage(const GsfOpt& other)
+{
+	if (m_system->rom == NULL || other.m_system->rom == NULL)
+	{
+		return;
+	}
+
+	u32 size = std::min(GetROMSize(), other.GetROMSize());
+	rom_refs.merge(other.rom_refs, size);
+	MergeSystemRefs(rom_refs, other.m_system, size);
+}
+
 bool GsfOpt::LoadROM(const void *rom, u32 size, bool multiboot)
 {
 	rom_path = "";
 	rom_filename = "";
 	if (m_system->rom != NULL)
 	{
-		MergeRefs(rom_refs, m_system->rom_refs, GetROMSize());
-		CPUCleanUp(m_system);
+		// the emulator memory is reused by the new ROM
+		MergeSystemRefs(rom_refs, m_system, GetROMSize());
 	}
 
 	m_system->cpuIsMultiBoot = multiboot;
 
-	m_system->soundSampleRate = 44100;
+	// the loop detector needs reference counts, others only need to know what has been read
+	m_system->romRefsCounted = time_loop_based;
+
+	// the sound is only analyzed for silence, a low rate is enough
+	m_system->soundSampleRate = sound_sample_rate;
+	m_output.sample_rate = sound_sample_rate;
 	m_system->soundDeclicking = false;
 	m_system->soundInterpolation = false;
 
+	// only the timer needs the sound output, coverage only needs the game to run,
+	// and the silence detection only needs the sound that is not known to be silent
+	m_system->soundSynthesis = time_loop_based;
+	m_system->soundSilenceSkipping = time_loop_based;
+
 	CPULoadRom(m_system, rom, size);
 	if (m_system->cpuIsMultiBoot)
 	{
@@ -231,7 +363,20 @@ bool GsfOpt::LoadROM(const void *rom, u32 size, bool multiboot)
 		rom_size = m_system->romSize;
 	}
 
-	soundInit(m_system, &m_output);
+	// the analysis can only run alongside the emulation if there is a sound to analyze
+	if (time_loop_based && sound_analysis_threaded)
+	{
+		if (!m_sound_pipe)
+		{
+			m_sound_pipe.reset(new SoundPipe(&m_output));
+		}
+		soundInit(m_system, m_sound_pipe.get());
+	}
+	else
+	{
+		m_sound_pipe.reset();
+		soundInit(m_system, &m_output);
+	}
 	soundReset(m_system);
 	m_output.reset_timer();
 
@@ -249,14 +394,17 @@ bool GsfOpt::LoadROMFile(const std::string& filename)
 
 	if (PSFFile::IsPSFFile(filename))
 	{
-		u8 * rom_buf = new u8[MAX_GBA_ROM_SIZE];
 		u32 entrypoint;
 
-		load_result = ReadGSFFile(filename, 0, rom_buf, &entrypoint, &rom_size);
+		// the buffer is kept across loads, and grows to the largest image;
+		// the bytes that no file covers must read as zero
+		std::fill(rom_load_buffer.begin(), rom_load_buffer.end(), 0);
+
+		load_result = ReadGSFFile(filename, 0, rom_load_buffer, &entrypoint, &rom_size);
 		if (load_result)
 		{
 			bool multiboot = ((entrypoint >> 24) == 0x02);
-			load_result = LoadROM(rom_buf, rom_size, multiboot);
+			load_result = LoadROM(rom_load_buffer.data(), rom_size, multiboot);
 			if (load_result)
 			{
 				char tmppath[PATH_MAX];
@@ -268,8 +416,6 @@ bool GsfOpt::LoadROMFile(const std::string& filename)
 				rom_filename = tmppath;
 			}
 		}
-
-		delete [] rom_buf;
 	}
 	else
 	{
@@ -351,7 +497,27 @@ void GsfOpt::PatchROM(u32 offset, const void * data, u32 size)
 		size = max_rom_size - offset;
 	}
 
+	// open bus past the image is not in the buffer until it is patched
+	if (!m_system->cpuIsMultiBoot)
+	{
+		CPUExpandRom(m_system, offset + size);
+	}
 	memcpy(&gba_rom[offset], data, size);
+
+	// the decoded code may have been read from the overwritten bytes
+	CPUFlushCodeCache(m_system);
+
+	// the CPU may have prefetched the overwritten opcodes already (after RestoreState)
+	u32 pc = m_system->armNextPC;
+	bool pc_in_rom = m_system->cpuIsMultiBoot ? ((pc >> 24) == 0x02) : ((pc >> 24) >= 0x08 && (pc >> 24) <= 0x0d);
+	if (pc_in_rom)
+	{
+		u32 pc_offset = pc & (max_rom_size - 1);
+		if (pc_offset < offset + size && offset < pc_offset + 8)
+		{
+			CPUFlushPrefetch(m_system);
+		}
+	}
 }
 
 void GsfOpt::ResetGame()
@@ -361,12 +527,127 @@ void GsfOpt::ResetGame()
 		return;
 	}
 
-	MergeRefs(rom_refs, m_system->rom_refs, GetROMSize());
+	MergeSystemRefs(rom_refs, m_system, GetROMSize());
 	CPUReset(m_system);
 	m_output.reset_timer();
 }
 
-bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level, u8 * rom_buf, u32 * ptr_entrypoint, u32 * ptr_rom_size)
+bool GsfOpt::SaveState(std::vector<u8>& state)
+{
+	if (m_system->rom == NULL)
+	{
+		m_message = "No ROM is loaded";
+		return false;
+	}
+
+	state.clear();
+	StateStream stream(state);
+	CPUWriteState(m_system, stream);
+	SyncState(stream);
+	return true;
+}
+
+bool GsfOpt::RestoreState(const std::vector<u8>& state)
+{
+	if (m_system->rom == NULL)
+	{
+		m_message = "No ROM is loaded";
+		return false;
+	}
+
+	MergeSystemRefs(rom_refs, m_system, GetROMSize());
+
+	StateStream stream(state.data(), state.size());
+	bool succeeded = CPUReadState(m_system, stream);
+	if (succeeded)
+	{
+		SyncState(stream);
+		succeeded = stream.ok();
+	}
+
+	if (!succeeded)
+	{
+		// do not leave a half-restored emulator behind
+		CPUReset(m_system);
+		m_output.reset_timer();
+
+		m_message = "Emulator state does not match the loaded ROM";
+		return false;
+	}
+	return true;
+}
+
+GsfOpt * GsfOpt::Clone(void)
+{
+	GsfOpt * clone = new GsfOpt;
+	clone->CopySettings(*this);
+
+	if (m_system->rom != NULL)
+	{
+		// the state does not carry the ROM, copy the current (possibly patched) image
+		const u8 * image = m_system->cpuIsMultiBoot ? m_system->workRAM : m_system->rom;
+		clone->LoadROM(image, rom_size, m_system->cpuIsMultiBoot);
+		if (!m_system->cpuIsMultiBoot)
+		{
+			// including patches made beyond the end of the image
+			CPUExpandRom(clone->m_system, m_system->romOpenBusStart);
+			memcpy(clone->m_system->rom, m_system->rom, m_system->romOpenBusStart);
+		}
+		clone->rom_path = rom_path;
+		clone->rom_filename = rom_filename;
+
+		std::vector<u8> state;
+		SaveState(state);
+		clone->RestoreState(state);
+	}
+	return clone;
+}
+
+void GsfOpt::SaveCoverage(std::vector<u8>& coverage)
+{
+	coverage.clear();
+	StateStream state(coverage);
+	rom_refs.sync(state, MAX_GBA_ROM_SIZE);
+}
+
+bool GsfOpt::RestoreCoverage(const std::vector<u8>& coverage)
+{
+	StateStream state(coverage.data(), coverage.size());
+	rom_refs.sync(state, MAX_GBA_ROM_SIZE);
+	if (!state.ok())
+	{
+		rom_refs.clear();
+		m_message = "Coverage data is broken";
+		return false;
+	}
+	return true;
+}
+
+void GsfOpt::SyncState(StateStream& state)
+{
+	state.sync(m_output.sample_rate);
+	state.sync(m_output.samples_received);
+	state.sync(m_output.silent_samples_received);
+	state.sync(m_output.silence_threshold);
+	state.sync(m_output.silence_start);
+	state.sync(m_output.initial_silence_captured);
+	state.sync(m_output.initial_silence_samples);
+
+	state.sync(rom_refs_histogram, sizeof(rom_refs_histogram));
+	state.sync(song_endpoint);
+	state.sync(optimize_endpoint);
+	state.sync(time_last_new_data);
+	state.sync(loop_point, sizeof(loop_point));
+	state.sync(loop_point_updated, sizeof(loop_point_updated));
+	state.sync(loop_count);
+	state.sync(oneshot_endpoint);
+	state.sync(oneshot);
+	state.sync(initial_silence_length);
+	state.sync(optimize_finished);
+	state.sync(bytes_used_old);
+}
+
+bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level, std::vector<u8>& rom_buf, u32 * ptr_entrypoint, u32 * ptr_rom_size)
 {
 	bool result;
 	char str[256];
@@ -378,23 +659,14 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 		return false;
 	}
 
-	// change base directory
-	char savedcwd[PATH_MAX];
-	getcwd(savedcwd, PATH_MAX);
-	char gsf_dir[PATH_MAX];
-	strcpy(gsf_dir, filename.c_str());
-	path_dirname(gsf_dir);
-	if (gsf_dir[0] != '\0')
-	{
-		chdir(gsf_dir);
-	}
+	// gsflibs are relative to the directory of this file
+	std::string gsf_dir(filename.c_str(), path_findbase(filename.c_str()) - filename.c_str());
 
 	// open GSF file
 	PSFFile * gsf = PSFFile::load(filename);
 	if (gsf == NULL)
 	{
 		m_message = filename + " - " + "PSF load error";
-		chdir(savedcwd);
 		return false;
 	}
 
@@ -402,7 +674,6 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 	if (gsf->version != GSF_PSF_VERSION)
 	{
 		m_message = filename + " - " + "Mismatch PSF version";
-		chdir(savedcwd);
 		return false;
 	}
 
@@ -421,28 +692,49 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 	u32 lib_entrypoint;
 	if (has_lib)
 	{
-		if (!ReadGSFFile(it_lib->second, nesting_level + 1, rom_buf, &lib_entrypoint, ptr_rom_size))
+		std::string lib_path = path_isabsolute(it_lib->second.c_str()) ? it_lib->second : gsf_dir + it_lib->second;
+		if (!ReadGSFFile(lib_path, nesting_level + 1, rom_buf, &lib_entrypoint, ptr_rom_size))
 		{
 			delete gsf;
-			chdir(savedcwd);
 			return false;
 		}
 	}
 
+	// gsflib decoded by a previous load?
+	std::string lib_image_path;
+	std::shared_ptr<const GSFLibImage> lib_image;
+	if (nesting_level > 0)
+	{
+		char abspath[PATH_MAX];
+		if (path_getabspath(filename.c_str(), abspath) != NULL)
+		{
+			lib_image_path = abspath;
+			lib_image = FindGSFLibImage(lib_image_path, gsf->compressed_exe.compressed_crc32());
+		}
+	}
+
 	// GSF EXE header
-	u32 entrypoint;
-	u32 rom_address;
-	u32 rom_size;
-	result = true;
-	result &= gsf->compressed_exe.readInt(entrypoint);
-	result &= gsf->compressed_exe.readInt(rom_address);
-	result &= gsf->compressed_exe.readInt(rom_size);
-	if (!result)
+	u32 entrypoint = 0;
+	u32 rom_address = 0;
+	u32 rom_size = 0;
+	if (lib_image)
 	{
-		m_message = filename + " - " + "Read error at GSF EXE header";
-		delete gsf;
-		chdir(savedcwd);
-		return false;
+		entrypoint = lib_image->entrypoint;
+		rom_address = lib_image->rom_address;
+		rom_size = (u32) lib_image->data.size();
+	}
+	else
+	{
+		result = true;
+		result &= gsf->compressed_exe.readInt(entrypoint);
+		result &= gsf->compressed_exe.readInt(rom_address);
+		result &= gsf->compressed_exe.readInt(rom_size);
+		if (!result)
+		{
+			m_message = filename + " - " + "Read error at GSF EXE header";
+			delete gsf;
+			return false;
+		}
 	}
 
 	// valid entrypoint?
@@ -453,7 +745,6 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 
 		// not supported
 		delete gsf;
-		chdir(savedcwd);
 		return false;
 	}
 	bool multiboot = ((entrypoint >> 24) == 0x02);
@@ -468,7 +759,6 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 
 			// inconsistent entrypoint
 			delete gsf;
-			chdir(savedcwd);
 			return false;
 		}
 		entrypoint = lib_entrypoint;
@@ -492,7 +782,6 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 
 		// unsupported address
 		delete gsf;
-		chdir(savedcwd);
 		return false;
 	}
 
@@ -502,7 +791,6 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 		m_message = filename + " - " + "ROM size error";
 
 		delete gsf;
-		chdir(savedcwd);
 		return false;
 	}
 
@@ -516,13 +804,28 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 	}
 
 	// load ROM data
-	if (gsf->compressed_exe.read(&rom_buf[rom_offset], rom_size) != rom_size)
+	if (rom_buf.size() < rom_offset + rom_size)
+	{
+		rom_buf.resize(rom_offset + rom_size);
+	}
+	if (lib_image)
 	{
-		m_message = filename + " - " + "Unable to load ROM data";
+		memcpy(&rom_buf[rom_offset], lib_image->data.data(), rom_size);
+	}
+	else
+	{
+		if (gsf->compressed_exe.read(&rom_buf[rom_offset], rom_size) != rom_size)
+		{
+			m_message = filename + " - " + "Unable to load ROM data";
 
-		delete gsf;
-		chdir(savedcwd);
-		return false;
+			delete gsf;
+			return false;
+		}
+
+		if (!lib_image_path.empty())
+		{
+			StoreGSFLibImage(lib_image_path, gsf->compressed_exe.compressed_crc32(), entrypoint, rom_address, &rom_buf[rom_offset], rom_size);
+		}
 	}
 
 	// handle _libN files
@@ -539,10 +842,10 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 		}
 
 		u32 libN_entrypoint;
-		if (!ReadGSFFile(it_libN->second, nesting_level + 1, rom_buf, &libN_entrypoint, ptr_rom_size))
+		std::string libN_path = path_isabsolute(it_libN->second.c_str()) ? it_libN->second : gsf_dir + it_libN->second;
+		if (!ReadGSFFile(libN_path, nesting_level + 1, rom_buf, &libN_entrypoint, ptr_rom_size))
 		{
 			delete gsf;
-			chdir(savedcwd);
 			return false;
 		}
 
@@ -553,7 +856,6 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 
 			// inconsistent entrypoint
 			delete gsf;
-			chdir(savedcwd);
 			return false;
 		}
 
@@ -562,23 +864,26 @@ bool GsfOpt::ReadGSFFile(const std::string& filename, unsigned int nesting_level
 
 	m_message = filename + " - " + "Loaded successfully";
 	delete gsf;
-	chdir(savedcwd);
 	return true;
 }
 
 void GsfOpt::ResetOptimizer(void)
 {
-	memset(rom_refs, 0, MAX_GBA_ROM_SIZE);
+	rom_refs.clear();
 	memset(rom_refs_histogram, 0, sizeof(rom_refs_histogram));
 	bytes_used = 0;
 }
 
 void GsfOpt::Optimize(void)
 {
-	timer_init();
+	StartOptimize();
+	ResumeOptimize();
+}
 
+void GsfOpt::StartOptimize(void)
+{
 	bytes_used_old = m_system->bytes_used;
-	time_last_new_data = m_output.get_timer();
+	time_last_new_data = GetTime();
 
 	for (int i = 0; i < 256; i++)
 	{
@@ -589,46 +894,83 @@ void GsfOpt::Optimize(void)
 	oneshot_endpoint = 0.0;
 	oneshot = false;
 	initial_silence_length = 0.0;
+	optimize_finished = false;
+
+	state_hashes.clear();
+	state_first_frame_ticks = 0;
+	state_hash_frames.clear();
+	state_loop_start = 0;
+	state_loop_length = 0;
+	state_loop_verify_end = 0;
+	state_loop_verified = false;
+	m_system->stateHashes.clear();
+}
 
-	double time_last_prog = 0.0;
-	bool finished = false;
+bool GsfOpt::StepOptimize(void)
+{
+	if (optimize_finished)
+	{
+		return true;
+	}
 
-	do
+	bytes_used_old = m_system->bytes_used;
+	m_system->stateHashEnabled = time_loop_based && state_loop_verify_length > 0.0;
+	CPULoop(m_system, 250000);
+
+	// the detectors below see the sound of the whole slice, however it has been analyzed
+	if (m_sound_pipe)
 	{
-		bytes_used_old = m_system->bytes_used;
-		CPULoop(m_system, 250000);
+		m_sound_pipe->flush();
+	}
 
-		initial_silence_length = m_output.get_initial_silence_length();
+	initial_silence_length = m_output.get_initial_silence_length();
 
-		// any updates?
-		if (m_system->bytes_used != bytes_used_old)
-		{
-			time_last_new_data = m_output.get_timer();
-		}
+	// any updates?
+	if (m_system->bytes_used != bytes_used_old)
+	{
+		time_last_new_data = TicksToTime(m_system->newDataTicks);
+	}
 
-		// loop detection
-		DetectLoop();
+	// loop detection
+	DetectLoop();
+	DetectStateLoop();
 
-		// oneshot detection
-		DetectOneShot();
+	// oneshot detection
+	DetectOneShot();
 
-		// adjust endpoint
-		AdjustOptimizationEndPoint();
+	// adjust endpoint
+	AdjustOptimizationEndPoint();
 
-		// is optimization (or loop detection) finished?
-		if (m_output.get_timer() >= optimize_endpoint)
-		{
-			finished = true;
-		}
+	// is optimization (or loop detection) finished?
+	if (GetTime() >= optimize_endpoint)
+	{
+		optimize_finished = true;
+	}
+	return optimize_finished;
+}
 
-		// show progress
+void GsfOpt::ResumeOptimize(void)
+{
+	timer_init();
+
+	double time_last_prog = 0.0;
+	double time_last_checkpoint = timer_get();
+	while (!StepOptimize())
+	{
+		// show progress (unless the output is being collected for later)
 		double time_current = timer_get();
-		if (time_current >= time_last_prog + optimize_progress_frequency)
+		if (console_log == NULL && time_current >= time_last_prog + optimize_progress_frequency)
 		{
 			ShowOptimizeProgress();
 			time_last_prog = time_current;
 		}
-	} while(!finished);
+
+		if (checkpoint_handler && time_current >= time_last_checkpoint + checkpoint_interval)
+		{
+			checkpoint_handler(*this);
+			time_last_checkpoint = timer_get();
+		}
+	}
 
 	initial_silence_length = std::min(initial_silence_length, song_endpoint);
 
@@ -637,6 +979,46 @@ void GsfOpt::Optimize(void)
 	ShowOptimizeResult();
 }
 
+void GsfOpt::StartOptimizeUntilRead(u32 offset, u32 size)
+{
+	StartOptimize();
+
+	// find the first time slice that reads the area with a throwaway copy,
+	// since the slice can not be undone once it has been emulated
+	unsigned int steps = 0;
+	{
+		std::unique_ptr<GsfOpt> probe(Clone());
+		while (!probe->StepOptimize() && !probe->IsROMRead(offset, size))
+		{
+			steps++;
+		}
+
+		// the area is never read, any point is fine to start from
+		if (!probe->IsROMRead(offset, size))
+		{
+			steps = 0;
+		}
+	}
+
+	for (unsigned int i = 0; i < steps; i++)
+	{
+		StepOptimize();
+	}
+}
+
+bool GsfOpt::IsROMRead(u32 offset, u32 size) const
+{
+	u32 max_rom_size = m_system->cpuIsMultiBoot ? 0x40000 : 0x2000000;
+	for (u32 i = 0; i < size && offset + i < max_rom_size; i++)
+	{
+		if (CPUIsRomRefd(m_system, offset + i))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 void GsfOpt::DetectLoop()
 {
 	// detect possible maximum value of loop count at the moment
@@ -655,7 +1037,7 @@ void GsfOpt::DetectLoop()
 	{
 		if (loop_point_updated[count])
 		{
-			loop_point[count] = m_output.get_timer();
+			loop_point[count] = GetTime();
 			loop_point_updated[count] = false;
 		}
 	}
@@ -663,7 +1045,7 @@ void GsfOpt::DetectLoop()
 	// verify the loop
 	for (int count = loop_count_expected_upper; count > 0; count--)
 	{
-		if (m_output.get_timer() - loop_point[count] >= loop_verify_length)
+		if (GetTime() - loop_point[count] >= loop_verify_length || IsLoopSoundRepeated(count))
 		{
 			loop_count = count;
 			break;
@@ -673,7 +1055,7 @@ void GsfOpt::DetectLoop()
 	// update invalid loop points
 	for (int count = loop_count_expected_upper + 1; count < 256; count++)
 	{
-		loop_point[count] = m_output.get_timer();
+		loop_point[count] = GetTime();
 		loop_point_updated[count] = true;
 	}
 
@@ -681,6 +1063,112 @@ void GsfOpt::DetectLoop()
 	memcpy(rom_refs_histogram, m_system->rom_refs_histogram, sizeof(rom_refs_histogram));
 }
 
+double GsfOpt::FrameToTime(u32 frame) const
+{
+	return TicksToTime(state_first_frame_ticks + (u64)frame * CYCLES_PER_FRAME);
+}
+
+void GsfOpt::DetectStateLoop()
+{
+	for (size_t i = 0; i < m_system->stateHashes.size(); i++)
+	{
+		u32 frame = (u32)state_hashes.size();
+		u64 hash = m_system->stateHashes[i].hash;
+		if (frame == 0)
+		{
+			state_first_frame_ticks = m_system->stateHashes[i].ticks;
+		}
+		state_hashes.push_back(hash);
+
+		// the candidate must keep repeating itself until the verify end
+		if (state_loop_length != 0)
+		{
+			if (hash != state_hashes[frame - state_loop_length])
+			{
+				state_loop_length = 0;
+				state_loop_verified = false;
+			}
+			else if (frame >= state_loop_verify_end)
+			{
+				state_loop_verified = true;
+			}
+		}
+
+		// the same driver state means the same music from now on,
+		// but nothing before the sound starts can be a loop
+		if (state_loop_length == 0 && m_output.initial_silence_captured)
+		{
+			auto it = state_hash_frames.find(hash);
+			if (it != state_hash_frames.end())
+			{
+				state_loop_start = it->second;
+				state_loop_length = frame - it->second;
+				state_loop_verify_end = frame + (u32)ceil((double)TimeToTicks(state_loop_verify_length) / CYCLES_PER_FRAME);
+			}
+		}
+
+		// remember the latest frame, a false candidate is retried with a shorter period
+		state_hash_frames[hash] = frame;
+	}
+	m_system->stateHashes.clear();
+}
+
+bool GsfOpt::IsLoopSoundRepeated(int count) const
+{
+	// the sound after the loop point must be the same as a loop before
+	if (loop_match_length <= 0.0 || count < 2 || count > target_loop_count || loop_point_updated[count] || loop_point_updated[count - 1])
+	{
+		return false;
+	}
+
+	const std::vector<u16>& levels = m_output.levels;
+	double block_length = m_output.get_level_block_length();
+	size_t start = (size_t)(loop_point[count] / block_length);
+	size_t end = levels.size();
+	if (end < start + (size_t)ceil(loop_match_length / block_length))
+	{
+		return false;
+	}
+
+	// the loop points are only known to a time slice, try the nearby alignments
+	long period = lround((loop_point[count] - loop_point[count - 1]) / block_length);
+	for (long distance = period - 3; distance <= period + 3; distance++)
+	{
+		if (distance <= 1 || (size_t)distance + 1 > start)
+		{
+			continue;
+		}
+
+		bool audible = false;
+		size_t i;
+		for (i = start; i < end; i++)
+		{
+			// the blocks do not line up with the loop exactly,
+			// the level may be anything between the neighbors a loop before
+			u16 level = levels[i];
+			u16 low = std::min(std::min(levels[i - distance - 1], levels[i - distance]), levels[i - distance + 1]);
+			u16 high = std::max(std::max(levels[i - distance - 1], levels[i - distance]), levels[i - distance + 1]);
+			u16 tolerance = std::max<u16>(m_output.silence_threshold, high / 8);
+			if (level + tolerance < low || level > high + tolerance)
+			{
+				break;
+			}
+
+			if (level > m_output.silence_threshold)
+			{
+				audible = true;
+			}
+		}
+
+		// a repeated silence is left to the one shot detection
+		if (i == end && audible)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 void GsfOpt::DetectOneShot()
 {
 	if (m_output.get_silence_length() >= oneshot_verify_length && loop_count != 0) {
@@ -699,12 +1187,29 @@ void GsfOpt::AdjustOptimizationEndPoint()
 		if (oneshot)
 		{
 			song_endpoint = oneshot_endpoint;
-			optimize_endpoint = m_output.get_timer();
+			optimize_endpoint = GetTime();
+		}
+		else if (state_loop_verified && m_output.get_silence_length() < FrameToTime(state_loop_verify_end) - FrameToTime(state_loop_start))
+		{
+			// a repeating state that makes sound somewhere in the verified span is a loop,
+			// a silent one is left to the one shot detection
+			for (int count = 1; count < 256; count++)
+			{
+				loop_point[count] = FrameToTime(state_loop_start + count * state_loop_length);
+			}
+			song_endpoint = loop_point[target_loop_count];
+			optimize_endpoint = GetTime();
 		}
 		else
 		{
 			song_endpoint = loop_point[target_loop_count];
 			optimize_endpoint = loop_point[target_loop_count] + std::max<double>(loop_verify_length, oneshot_verify_length);
+
+			// the sound has been found to repeat, no need to wait any longer
+			if (loop_match_length > 0.0 && loop_count >= target_loop_count && loop_count >= 2)
+			{
+				optimize_endpoint = GetTime();
+			}
 		}
 	}
 	else
@@ -718,7 +1223,7 @@ void GsfOpt::ShowOptimizeProgress() const
 {
 	printf("%s: ", rom_filename.substr(0, 24).c_str());
 	printf("Time = %s", ToTimeString(song_endpoint).c_str());
-	printf(", Remaining = %s", ToTimeString(std::max(0.0, optimize_endpoint - m_output.get_timer())).c_str());
+	printf(", Remaining = %s", ToTimeString(std::max(0.0, optimize_endpoint - GetTime())).c_str());
 	if (!time_loop_based)
 	{
 		printf(", %d bytes", m_system->bytes_used);
@@ -737,33 +1242,38 @@ void GsfOpt::ShowOptimizeProgress() const
 
 void GsfOpt::ShowOptimizeResult() const
 {
-	printf("%s: ", rom_filename.c_str());
+	ConsolePrint(console_log, stdout, "%s: ", rom_filename.c_str());
 
 	if (!time_loop_based)
 	{
-		printf("Time = %s", ToTimeString(song_endpoint).c_str());
-		printf(", %d bytes", m_system->bytes_used);
+		ConsolePrint(console_log, stdout, "Time = %s", ToTimeString(song_endpoint).c_str());
+		ConsolePrint(console_log, stdout, ", %d bytes", m_system->bytes_used);
 	}
 	else
 	{
-		printf("Time = %s, Silence = %s",
+		ConsolePrint(console_log, stdout, "Time = %s, Silence = %s",
 			ToTimeString(song_endpoint - initial_silence_length).c_str(),
 			ToTimeString(initial_silence_length).c_str());
 
 		if (oneshot)
 		{
-			printf(" (One Shot)");
+			ConsolePrint(console_log, stdout, " (One Shot)");
 		}
 		else
 		{
-			printf(" (%d Loops)", target_loop_count);
+			ConsolePrint(console_log, stdout, " (%d Loops)", target_loop_count);
 		}
 	}
-	printf("                                            ");
-	printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
-	printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
-	printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
-	printf("\n");
+
+	if (console_log == NULL)
+	{
+		// erase the rest of progress line
+		printf("                                            ");
+		printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+		printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+		printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+	}
+	ConsolePrint(console_log, stdout, "\n");
 	fflush(stdout);
 }
 
@@ -771,26 +1281,32 @@ void GsfOpt::ResetOptimizerVariables()
 {
 }
 
-u32 GsfOpt::MergeRefs(u8 * dst_refs, const u8 * src_refs, u32 size)
+void GsfOpt::MergeSystemRefs(RomRefs& dst_refs, GBASystem * system, u32 size)
 {
-	u32 bytes_used = 0;
-	for (u32 i = 0; i < size; i++)
+	if (system->romRefsCounted)
 	{
-		if ((unsigned int)dst_refs[i] + src_refs[i] <= 0xff)
-		{
-			dst_refs[i] += src_refs[i];
-		}
-		else
+		dst_refs.merge(system->rom_refs, size);
+		return;
+	}
+
+	// a byte that has been read counts as one reference
+	const u8 * bits = system->rom_refs_bits;
+	for (u32 offset = 0; offset < size; offset += 8)
+	{
+		if (bits[offset >> 3] == 0)
 		{
-			dst_refs[i] = 0xff;
+			continue;
 		}
 
-		if (dst_refs[i] != 0)
+		u8 * refs = dst_refs.touch(offset);
+		for (u32 i = 0; i < 8 && offset + i < size; i++)
 		{
-			bytes_used++;
+			if (((bits[offset >> 3] >> i) & 1) != 0 && refs[i] != 0xff)
+			{
+				refs[i]++;
+			}
 		}
 	}
-	return bytes_used;
 }
 
 bool GsfOpt::GetROM(void * rom, u32 size, bool wipe_unused_data)
@@ -819,9 +1335,9 @@ bool GsfOpt::GetROM(void * rom, u32 size, bool wipe_unused_data)
 
 	if (wipe_unused_data)
 	{
-		u8 * rom_refs = new u8[size];
-		memcpy(rom_refs, this->rom_refs, size);
-		MergeRefs(rom_refs, m_system->rom_refs, size);
+		RomRefs rom_refs;
+		rom_refs.merge(this->rom_refs, size);
+		MergeSystemRefs(rom_refs, m_system, size);
 
 		u32 paranoid_unused_area_size = 0;
 		u32 paranoid_post_fill_count = 0;
@@ -832,49 +1348,63 @@ bool GsfOpt::GetROM(void * rom, u32 size, bool wipe_unused_data)
 		this->paranoid_filled_size = 0;
 
 		auto is_preserved = [] (u32 offset) -> bool { return offset < 0xC0; };
-		for (u32 offset = 0; offset < size; offset++) {
-			bool is_offset_used = rom_refs[offset] != 0 || is_preserved(offset);
+		for (u32 base = 0; base < size; base += RomRefs::PAGE_SIZE) {
+			u32 page_size = (size - base < RomRefs::PAGE_SIZE) ? size - base : RomRefs::PAGE_SIZE;
+			const u8 * page_refs = rom_refs.page(base >> RomRefs::PAGE_BITS);
+
+			// nothing in the page is used, only the bytes that follow a used byte are kept
+			if (page_refs == NULL && !is_preserved(base)) {
+				u32 fill_size = (paranoid_post_fill_count < page_size) ? paranoid_post_fill_count : page_size;
+				memcpy(&((u8 *)rom)[base], &gba_rom[base], fill_size);
+				memset(&((u8 *)rom)[base + fill_size], 0, page_size - fill_size);
+				paranoid_filled += fill_size;
+				paranoid_post_fill_count -= fill_size;
+				paranoid_unused_area_size += page_size;
+				continue;
+			}
 
-			if (is_offset_used || paranoid_post_fill_count > 0) {
-				((u8 *)rom)[offset] = gba_rom[offset];
+			for (u32 offset = base; offset < base + page_size; offset++) {
+				bool is_offset_used = (page_refs != NULL && page_refs[offset - base] != 0) || is_preserved(offset);
 
-				if (is_offset_used) {
-					covered_size++;
-				} else {
-					paranoid_filled++;
-				}
+				if (is_offset_used || paranoid_post_fill_count > 0) {
+					((u8 *)rom)[offset] = gba_rom[offset];
 
-				if (paranoid_post_fill_count > 0) {
-					paranoid_post_fill_count--;
+					if (is_offset_used) {
+						covered_size++;
+					} else {
+						paranoid_filled++;
+					}
+
+					if (paranoid_post_fill_count > 0) {
+						paranoid_post_fill_count--;
+					}
+				} else {
+					((u8 *)rom)[offset] = 0;
 				}
-			} else {
-				((u8 *)rom)[offset] = 0;
-			}
 
-			if (is_offset_used) {
-				paranoid_post_fill_count = paranoid_post_fill_size;
+				if (is_offset_used) {
+					paranoid_post_fill_count = paranoid_post_fill_size;
 
-				if (paranoid_unused_area_size <= paranoid_closed_area_fill_size) {
-					while (paranoid_unused_area_size > 0) {
-						u32 fill_offset = offset - paranoid_unused_area_size;
-						((u8 *)rom)[fill_offset] = gba_rom[fill_offset];
-						paranoid_unused_area_size--;
+					if (paranoid_unused_area_size <= paranoid_closed_area_fill_size) {
+						while (paranoid_unused_area_size > 0) {
+							u32 fill_offset = offset - paranoid_unused_area_size;
+							((u8 *)rom)[fill_offset] = gba_rom[fill_offset];
+							paranoid_unused_area_size--;
 
-						if (rom_refs[fill_offset] == 0 && !is_preserved(fill_offset)) {
-							paranoid_filled++;
+							if (rom_refs[fill_offset] == 0 && !is_preserved(fill_offset)) {
+								paranoid_filled++;
+							}
 						}
 					}
+					paranoid_unused_area_size = 0;
+				} else {
+					paranoid_unused_area_size++;
 				}
-				paranoid_unused_area_size = 0;
-			} else {
-				paranoid_unused_area_size++;
 			}
 		}
 
 		this->covered_size = covered_size;
 		this->paranoid_filled_size = paranoid_filled;
-
-		delete [] rom_refs;
 	}
 	else
 	{
@@ -916,52 +1446,315 @@ bool GsfOpt::SaveROM(const std::string& filename, bool wipe_unused_data)
 	return result;
 }
 
-bool GsfOpt::SaveGSF(const std::string& filename, bool wipe_unused_data, std::map<std::string, std::string>& tags)
+bool GsfOpt::SaveGSF(const std::string& filename, bool wipe_unused_data, std::map<std::string, std::string>& tags)
+{
+	u32 size = GetROMSize();
+	u8 * rom = new u8[size];
+	bool result = false;
+
+	if (!GetROM(rom, size, wipe_unused_data))
+	{
+		delete [] rom;
+		return false;
+	}
+
+	ZlibWriter exe(Z_BEST_COMPRESSION);
+
+	result = true;
+	result &= exe.writeInt(m_system->cpuIsMultiBoot ? 0x02000000 : 0x08000000);
+	result &= exe.writeInt(m_system->cpuIsMultiBoot ? 0x02000000 : 0x08000000);
+	result &= exe.writeInt(size);
+	if (!result)
+	{
+		delete [] rom;
+		return false;
+	}
+
+	if (exe.write(rom, size) != size)
+	{
+		delete [] rom;
+		return false;
+	}
+
+	result = PSFFile::save(filename, GSF_PSF_VERSION, NULL, 0, exe, tags);
+
+	delete [] rom;
+	return result;
+}
+
+enum GsfOptProcMode
+{
+	GSFOPT_PROC_NONE = 0,
+	GSFOPT_PROC_F,
+	GSFOPT_PROC_L,
+	GSFOPT_PROC_R,
+	GSFOPT_PROC_S,
+	GSFOPT_PROC_T,
+};
+
+// Processes the file at the index with the optimizer, and prints its results to out/err
+// (or directly to stdout/stderr, if they are NULL). Returns false on error.
+typedef std::function<bool(GsfOpt& opt, int index, std::string * out, std::string * err)> GsfOptJob;
+
+// Collects the results of a parallel worker into the main optimizer, after its last job.
+typedef std::function<void(GsfOpt& worker_opt)> GsfOptJobMerge;
+
+// Runs the job for every index in [0, count) on num_threads workers, each with its own emulator
+// cloned from the main optimizer. Indices are handed out one at a time, so that long files do not
+// leave the other workers idle.
+// The outputs are printed in index order, regardless of the order in which the workers finish.
+static bool RunJobs(GsfOpt& opt, unsigned int num_threads, int count, const GsfOptJob& job, const GsfOptJobMerge& merge = GsfOptJobMerge())
+{
+	if (num_threads <= 1 || count <= 1)
+	{
+		for (int index = 0; index < count; index++)
+		{
+			if (!job(opt, index, NULL, NULL))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	if (num_threads > (unsigned int)count)
+	{
+		num_threads = (unsigned int)count;
+	}
+
+	struct JobResult
+	{
+		bool done;
+		bool succeeded;
+		std::string out;
+		std::string err;
+
+		JobResult() : done(false), succeeded(false)
+		{
+		}
+	};
+
+	std::vector<JobResult> results(count);
+	std::atomic<int> next_index(0);
+	std::atomic<bool> failed(false);
+	std::mutex report_mutex;
+	int next_report = 0;
+	bool result = true;
+
+	// cloned here, as saving the state of opt updates it
+	std::vector<std::unique_ptr<GsfOpt>> clones;
+	for (unsigned int i = 0; i < num_threads; i++)
+	{
+		clones.push_back(std::unique_ptr<GsfOpt>(opt.Clone()));
+	}
+
+	auto worker = [&](GsfOpt& worker_opt)
+	{
+
+		// stop handing out files after an error, as the serial run does
+		while (!failed)
+		{
+			int index = next_index++;
+			if (index >= count)
+			{
+				break;
+			}
+
+			std::string out;
+			std::string err;
+			worker_opt.SetConsoleLog(&out);
+			bool succeeded = job(worker_opt, index, &out, &err);
+			worker_opt.SetConsoleLog(NULL);
+			if (!succeeded)
+			{
+				failed = true;
+			}
+
+			std::lock_guard<std::mutex> lock(report_mutex);
+			results[index].done = true;
+			results[index].succeeded = succeeded;
+			results[index].out.swap(out);
+			results[index].err.swap(err);
+
+			// print every finished result that has no unfinished predecessor
+			while (result && next_report < count && results[next_report].done)
+			{
+				JobResult& report = results[next_report];
+				fputs(report.out.c_str(), stdout);
+				fflush(stdout);
+				fputs(report.err.c_str(), stderr);
+				fflush(stderr);
+
+				if (!report.succeeded)
+				{
+					result = false;
+				}
+				next_report++;
+			}
+		}
+
+		if (merge)
+		{
+			std::lock_guard<std::mutex> lock(report_mutex);
+			merge(worker_opt);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < num_threads; i++)
+	{
+		threads.push_back(std::thread(worker, std::ref(*clones[i])));
+	}
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+
+	return result && !failed;
+}
+
+// Progress of a -l or -s run, saved by --checkpoint and loaded by --resume
+struct GsfOptCheckpoint
+{
+	std::string signature;      // command line of the run, without the options that do not change its result
+	u32 index;                  // file (-l) or song (-s) in progress
+	std::vector<u8> coverage;   // coverage accumulated by the optimizer
+	std::vector<u8> boot_state; // state every song starts from (-s)
+	std::vector<u8> state;      // state of the file or song in progress
+
+	GsfOptCheckpoint() : index(0)
+	{
+	}
+
+	bool Save(const std::string& filename);
+	bool Load(const std::string& filename);
+
+private:
+	static const char * const MAGIC;
+	static const size_t HEADER_SIZE = 12;
+
+	void Sync(StateStream& stream);
+	static void SyncBytes(StateStream& stream, std::vector<u8>& bytes);
+};
+
+const char * const GsfOptCheckpoint::MAGIC = "GSFOPTCP";
+
+void GsfOptCheckpoint::SyncBytes(StateStream& stream, std::vector<u8>& bytes)
+{
+	u32 size = (u32)bytes.size();
+	stream.sync(size);
+	if (!stream.saving())
+	{
+		// a broken size must not allocate more than the checkpoint holds
+		if (size > stream.remaining())
+		{
+			stream.fail();
+			return;
+		}
+		bytes.resize(size);
+	}
+	stream.sync(bytes.data(), size);
+}
+
+void GsfOptCheckpoint::Sync(StateStream& stream)
+{
+	std::vector<u8> signature_bytes(signature.begin(), signature.end());
+	SyncBytes(stream, signature_bytes);
+	signature.assign(signature_bytes.begin(), signature_bytes.end());
+
+	stream.sync(index);
+	SyncBytes(stream, coverage);
+	SyncBytes(stream, boot_state);
+	SyncBytes(stream, state);
+}
+
+bool GsfOptCheckpoint::Save(const std::string& filename)
+{
+	std::vector<u8> data;
+	StateStream stream(data);
+	Sync(stream);
+
+	ZlibWriter zdata(Z_BEST_SPEED);
+	if (zdata.write(data.data(), data.size()) != (int)data.size())
+	{
+		return false;
+	}
+
+	u8 header[HEADER_SIZE];
+	memcpy(header, MAGIC, 8);
+	header[8] = (u8)(data.size() & 0xff);
+	header[9] = (u8)((data.size() >> 8) & 0xff);
+	header[10] = (u8)((data.size() >> 16) & 0xff);
+	header[11] = (u8)((data.size() >> 24) & 0xff);
+
+	// write to a temporary file first, so that an interruption does not destroy the previous checkpoint
+	std::string tmp_filename = filename + ".tmp";
+	FILE * fp = fopen(tmp_filename.c_str(), "wb");
+	if (fp == NULL)
+	{
+		return false;
+	}
+
+	bool result = (fwrite(header, sizeof(header), 1, fp) == 1);
+	result = result && (fwrite(zdata.data(), 1, zdata.size(), fp) == zdata.size());
+	result = (fclose(fp) == 0) && result;
+	if (!result)
+	{
+		remove(tmp_filename.c_str());
+		return false;
+	}
+
+#ifdef WIN32
+	remove(filename.c_str());
+#endif
+	return rename(tmp_filename.c_str(), filename.c_str()) == 0;
+}
+
+bool GsfOptCheckpoint::Load(const std::string& filename)
 {
-	u32 size = GetROMSize();
-	u8 * rom = new u8[size];
-	bool result = false;
-
-	if (!GetROM(rom, size, wipe_unused_data))
+	off_t filesize = path_getfilesize(filename.c_str());
+	if (filesize < (off_t)HEADER_SIZE)
 	{
-		delete [] rom;
 		return false;
 	}
 
-	ZlibWriter exe(Z_BEST_COMPRESSION);
-
-	result = true;
-	result &= exe.writeInt(m_system->cpuIsMultiBoot ? 0x02000000 : 0x08000000);
-	result &= exe.writeInt(m_system->cpuIsMultiBoot ? 0x02000000 : 0x08000000);
-	result &= exe.writeInt(size);
-	if (!result)
+	FILE * fp = fopen(filename.c_str(), "rb");
+	if (fp == NULL)
 	{
-		delete [] rom;
 		return false;
 	}
 
-	if (exe.write(rom, size) != size)
+	std::vector<u8> file((size_t)filesize);
+	bool result = (fread(file.data(), 1, file.size(), fp) == file.size());
+	fclose(fp);
+	if (!result || memcmp(file.data(), MAGIC, 8) != 0)
 	{
-		delete [] rom;
 		return false;
 	}
 
-	result = PSFFile::save(filename, GSF_PSF_VERSION, NULL, 0, exe, tags);
+	// deflate expands the data 1032 times at most
+	u32 size = file[8] | (file[9] << 8) | (file[10] << 16) | (file[11] << 24);
+	if ((u64)size > (u64)(file.size() - HEADER_SIZE) * 1032)
+	{
+		return false;
+	}
+	std::vector<u8> data(size);
+	ZlibReader zdata(&file[HEADER_SIZE], file.size() - HEADER_SIZE);
+	for (u32 pos = 0; pos < size; )
+	{
+		int bytes_read = zdata.read(&data[pos], size - pos);
+		if (bytes_read <= 0)
+		{
+			return false;
+		}
+		pos += bytes_read;
+	}
 
-	delete [] rom;
-	return result;
+	StateStream stream(data.data(), data.size());
+	Sync(stream);
+	return stream.ok();
 }
 
-enum GsfOptProcMode
-{
-	GSFOPT_PROC_NONE = 0,
-	GSFOPT_PROC_F,
-	GSFOPT_PROC_L,
-	GSFOPT_PROC_R,
-	GSFOPT_PROC_S,
-	GSFOPT_PROC_T,
-};
-
 static void usage(const char * progname, bool extended)
 {
 	printf("%s %s\n", APP_NAME, APP_VER);
@@ -994,6 +1787,20 @@ static void usage(const char * progname, bool extended)
 		printf("  : I am paranoid, and wish to assume that any trailing data \n");
 		printf("    within [bytes] bytes of a used byte, is also used\n");
 		printf("\n");
+		printf("`-j [count]` (default=1)\n");
+		printf("  : Process [count] files at a time in parallel (0 = number of CPUs)\n");
+		printf("    Applies to -f, -r, -s and -t. Results are shown in the order of the files\n");
+		printf("\n");
+		printf("`--checkpoint [file]`\n");
+		printf("  : Saves the progress of -l and -s to [file] from time to time, and deletes it on completion\n");
+		printf("\n");
+		printf("`--checkpoint-interval [time]` (default=1:00)\n");
+		printf("  : Real time between two checkpoints\n");
+		printf("\n");
+		printf("`--resume [file]`\n");
+		printf("  : Continues an interrupted -l or -s run from the checkpoint [file].\n");
+		printf("    The other arguments must be the same as the interrupted run (except -j and the checkpoint options)\n");
+		printf("\n");
 		printf("#### File Processing Modes (-s) (-l) (-f) (-r) (-t)\n");
 		printf("\n");
 		printf("`-f [gsf files]`\n");
@@ -1037,6 +1844,22 @@ static void usage(const char * progname, bool extended)
 		printf("  : Time in seconds for silence detection (default 15 seconds)\n");
 		printf("    Max (2*Verify loop count) seconds.\n");
 		printf("\n");
+		printf("`-A [time]`\n");
+		printf("  : Verify a loop as soon as [time] of sound after it is the same as the loop before.\n");
+		printf("    Needs at least 2 loops. (default 0 = off, wait for -V)\n");
+		printf("\n");
+		printf("`-R [rate]`\n");
+		printf("  : Sample rate of the sound used for silence detection in Hz. (default 8000, 4000-48000)\n");
+		printf("\n");
+		printf("`--analysis-thread`\n");
+		printf("  : Analyze the sound on another thread while the emulation goes on.\n");
+		printf("    The result is the same, it only takes less time if a CPU core is free.\n");
+		printf("\n");
+		printf("`-H [time]`\n");
+		printf("  : Detect loops by the repetition of the sound driver state (RAM and sound registers)\n");
+		printf("    at each frame, confirmed for [time]. Much quicker than waiting for -V to pass.\n");
+		printf("    Songs without a repeating state are timed as usual. (default 0 = off)\n");
+		printf("\n");
 	}
 }
 
@@ -1057,6 +1880,12 @@ int main(int argc, char *argv[])
 
 	char *psfby = NULL;
 
+	unsigned int num_threads = 1;
+
+	std::string checkpoint_path;
+	double checkpoint_interval = 60.0;
+	std::string resume_path;
+
 	if (argc >= 2 && (strcmp(argv[1], "-?") == 0 || strcmp(argv[1], "--help") == 0))
 	{
 		usage(argv[0], true);
@@ -1177,6 +2006,61 @@ int main(int argc, char *argv[])
 			opt.SetParanoidPostFillSize(l);
 			argi++;
 		}
+		else if (strcmp(argv[argi], "-j") == 0) // number of worker threads
+		{
+			if (argc <= (argi + 1))
+			{
+				fprintf(stderr, "Error: Too few arguments for \"%s\"\n", argv[argi]);
+				return 1;
+			}
+
+			l = strtol(argv[argi + 1], &endptr, 0);
+			if (*endptr != '\0' || errno == ERANGE || l < 0)
+			{
+				fprintf(stderr, "Error: Number format error \"%s\"\n", argv[argi + 1]);
+				return 1;
+			}
+			num_threads = (l != 0) ? (unsigned int)l : std::max(1u, std::thread::hardware_concurrency());
+			argi++;
+		}
+		else if (strcmp(argv[argi], "--checkpoint") == 0)
+		{
+			if (argc <= (argi + 1))
+			{
+				fprintf(stderr, "Error: Too few arguments for \"%s\"\n", argv[argi]);
+				return 1;
+			}
+
+			checkpoint_path = argv[argi + 1];
+			argi++;
+		}
+		else if (strcmp(argv[argi], "--checkpoint-interval") == 0)
+		{
+			if (argc <= (argi + 1))
+			{
+				fprintf(stderr, "Error: Too few arguments for \"%s\"\n", argv[argi]);
+				return 1;
+			}
+
+			checkpoint_interval = GsfOpt::ToTimeValue(argv[argi + 1]);
+			if (isnan(checkpoint_interval))
+			{
+				fprintf(stderr, "Error: Time format error \"%s\"\n", argv[argi + 1]);
+				return 1;
+			}
+			argi++;
+		}
+		else if (strcmp(argv[argi], "--resume") == 0)
+		{
+			if (argc <= (argi + 1))
+			{
+				fprintf(stderr, "Error: Too few arguments for \"%s\"\n", argv[argi]);
+				return 1;
+			}
+
+			resume_path = argv[argi + 1];
+			argi++;
+		}
 		else if (strcmp(argv[argi], "-o") == 0) // output name
 		{
 			if (argc <= (argi + 1))
@@ -1285,6 +2169,54 @@ int main(int argc, char *argv[])
 						opt.SetOneShotVerifyLength(GsfOpt::ToTimeValue(argv[argi + 1]));
 						argi++;
 					}
+					else if (strcmp(argv[argi], "-A") == 0)
+					{
+						if (argc <= (argi + 1))
+						{
+							fprintf(stderr, "Error: Too few arguments for \"%s\"\n", argv[argi]);
+							return 1;
+						}
+
+						opt.SetLoopMatchLength(GsfOpt::ToTimeValue(argv[argi + 1]));
+						argi++;
+					}
+					else if (strcmp(argv[argi], "-R") == 0)
+					{
+						if (argc <= (argi + 1))
+						{
+							fprintf(stderr, "Error: Too few arguments for \"%s\"\n", argv[argi]);
+							return 1;
+						}
+
+						l = strtol(argv[argi + 1], &endptr, 0);
+						if (*endptr != '\0' || errno == ERANGE || l < 0)
+						{
+							fprintf(stderr, "Error: Number format error \"%s\"\n", argv[argi + 1]);
+							return 1;
+						}
+						if (l < 4000 || l > 48000)
+						{
+							fprintf(stderr, "Error: Sample rate must be in range (4000..48000)\n");
+							return 1;
+						}
+						opt.SetSoundSampleRate((u32)l);
+						argi++;
+					}
+					else if (strcmp(argv[argi], "--analysis-thread") == 0)
+					{
+						opt.SetSoundAnalysisThreaded(true);
+					}
+					else if (strcmp(argv[argi], "-H") == 0)
+					{
+						if (argc <= (argi + 1))
+						{
+							fprintf(stderr, "Error: Too few arguments for \"%s\"\n", argv[argi]);
+							return 1;
+						}
+
+						opt.SetStateLoopVerifyLength(GsfOpt::ToTimeValue(argv[argi + 1]));
+						argi++;
+					}
 					else
 					{
 						fprintf(stderr, "Error: Unknown option \"%s\"\n", argv[argi]);
@@ -1309,6 +2241,52 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	// a checkpoint can only be resumed by the same command line,
+	// apart from the options that do not change the result
+	std::string signature;
+	GsfOptCheckpoint checkpoint;
+	if (!checkpoint_path.empty() || !resume_path.empty())
+	{
+		if (mode != GSFOPT_PROC_L && mode != GSFOPT_PROC_S)
+		{
+			fprintf(stderr, "Error: --checkpoint and --resume are only available for -l and -s\n");
+			return 1;
+		}
+
+		if (mode == GSFOPT_PROC_S && num_threads > 1)
+		{
+			fprintf(stderr, "Error: --checkpoint and --resume can not be used with -j\n");
+			return 1;
+		}
+
+		for (int i = 1; i < argc; i++)
+		{
+			if (strcmp(argv[i], "--checkpoint") == 0 || strcmp(argv[i], "--checkpoint-interval") == 0 ||
+				strcmp(argv[i], "--resume") == 0 || strcmp(argv[i], "-j") == 0)
+			{
+				i++;
+				continue;
+			}
+			signature += argv[i];
+			signature += '\n';
+		}
+
+		if (!resume_path.empty())
+		{
+			if (!checkpoint.Load(resume_path))
+			{
+				fprintf(stderr, "Error: %s - Unable to load the checkpoint\n", resume_path.c_str());
+				return 1;
+			}
+
+			if (checkpoint.signature != signature)
+			{
+				fprintf(stderr, "Error: %s - The checkpoint was made with different arguments\n", resume_path.c_str());
+				return 1;
+			}
+		}
+	}
+
 	switch (mode)
 	{
 		case GSFOPT_PROC_S:
@@ -1369,9 +2347,67 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "Error: %s\n", opt.message().c_str());
 				return 1;
 			}
-			for (u32 song = 0; song < minigsf_count; song++)
+
+			// boot once, up to the point where the song value is read for the first time,
+			// and start every song from there. Nothing has depended on the value before
+			// that point, so this gives the same result as booting every song from reset.
+			std::vector<u8> boot_state;
+			u32 first_song = 0;
+			if (!resume_path.empty())
+			{
+				if (!opt.RestoreCoverage(checkpoint.coverage))
+				{
+					fprintf(stderr, "Error: %s\n", opt.message().c_str());
+					return 1;
+				}
+				boot_state.swap(checkpoint.boot_state);
+				first_song = checkpoint.index;
+			}
+			else
+			{
+				opt.StartOptimizeUntilRead(minigsf_offset, minigsf_size);
+				if (!opt.SaveState(boot_state))
+				{
+					fprintf(stderr, "Error: %s\n", opt.message().c_str());
+					return 1;
+				}
+			}
+
+			u32 current_song = first_song;
+			if (!checkpoint_path.empty())
+			{
+				opt.SetCheckpointHandler([&](GsfOpt& opt)
+				{
+					GsfOptCheckpoint checkpoint;
+					checkpoint.signature = signature;
+					checkpoint.index = current_song;
+					opt.SaveCoverage(checkpoint.coverage);
+					checkpoint.boot_state = boot_state;
+					if (!opt.SaveState(checkpoint.state) || !checkpoint.Save(checkpoint_path))
+					{
+						fprintf(stderr, "Warning: %s - Unable to save the checkpoint\n", checkpoint_path.c_str());
+					}
+				}, checkpoint_interval);
+			}
+
+			GsfOptJob job = [&](GsfOpt& opt, int index, std::string * out, std::string * err) -> bool
 			{
-				printf("Optimizing %s  Song value %X\n", argv[argi], song);
+				u32 song = first_song + (u32)index;
+				if (!checkpoint_path.empty())
+				{
+					// only read by the checkpoints, which are taken by a serial run
+					current_song = song;
+				}
+
+				// the song in progress at the checkpoint continues from its own state
+				bool resumed = (!resume_path.empty() && song == checkpoint.index);
+				GsfOpt::ConsolePrint(out, stdout, "%s %s  Song value %X\n", resumed ? "Resuming" : "Optimizing", argv[argi], song);
+
+				if (!opt.RestoreState(resumed ? checkpoint.state : boot_state))
+				{
+					GsfOpt::ConsolePrint(err, stderr, "Error: %s\n", opt.message().c_str());
+					return false;
+				}
 
 				u8 patch[4] = {
 					static_cast<uint8_t>(song & 0xff),
@@ -1380,9 +2416,32 @@ int main(int argc, char *argv[])
 					static_cast<uint8_t>((song >> 24) & 0xff),
 				};
 				opt.PatchROM(minigsf_offset, patch, minigsf_size);
-				opt.ResetGame();
 
-				opt.Optimize();
+				opt.ResumeOptimize();
+				return true;
+			};
+
+			GsfOptJobMerge merge = [&](GsfOpt& worker_opt)
+			{
+				opt.MergeCoverage(worker_opt);
+			};
+
+			if (!RunJobs(opt, num_threads, (int)(minigsf_count - first_song), job, merge))
+			{
+				return 1;
+			}
+
+			// the serial run leaves the value of the last song in the gsflib
+			if (minigsf_count != 0)
+			{
+				u32 song = minigsf_count - 1;
+				u8 patch[4] = {
+					static_cast<uint8_t>(song & 0xff),
+					static_cast<uint8_t>((song >> 8) & 0xff),
+					static_cast<uint8_t>((song >> 16) & 0xff),
+					static_cast<uint8_t>((song >> 24) & 0xff),
+				};
+				opt.PatchROM(minigsf_offset, patch, minigsf_size);
 			}
 
 			std::map<std::string, std::string> tags;
@@ -1392,6 +2451,12 @@ int main(int argc, char *argv[])
 
 			opt.SaveGSF(out_path, true, tags);
 
+			// the run is complete, its checkpoint is no longer needed
+			if (!checkpoint_path.empty())
+			{
+				remove(checkpoint_path.c_str());
+			}
+
 			if (opt.GetParanoidClosedAreaFillSize() > 0) {
 				printf("Preserved any data within %d bytes between two used bytes.\n",
 					opt.GetParanoidClosedAreaFillSize());
@@ -1438,16 +2503,56 @@ int main(int argc, char *argv[])
 
 			// optimize
 			opt.ResetOptimizer();
-			for (; argi < argc; argi++)
+
+			int first_file = 0;
+			if (!resume_path.empty())
 			{
-				printf("Optimizing %s\n", argv[argi]);
+				first_file = (int)checkpoint.index;
+			}
+
+			int current_file = first_file;
+			if (!checkpoint_path.empty())
+			{
+				opt.SetCheckpointHandler([&](GsfOpt& opt)
+				{
+					GsfOptCheckpoint checkpoint;
+					checkpoint.signature = signature;
+					checkpoint.index = (u32)current_file;
+					opt.SaveCoverage(checkpoint.coverage);
+					if (!opt.SaveState(checkpoint.state) || !checkpoint.Save(checkpoint_path))
+					{
+						fprintf(stderr, "Warning: %s - Unable to save the checkpoint\n", checkpoint_path.c_str());
+					}
+				}, checkpoint_interval);
+			}
+
+			for (current_file = first_file; argi + current_file < argc; current_file++)
+			{
+				const char * filename = argv[argi + current_file];
+
+				// the file in progress at the checkpoint continues from its own state
+				bool resumed = (!resume_path.empty() && current_file == first_file);
+				printf("%s %s\n", resumed ? "Resuming" : "Optimizing", filename);
 
-				if (!opt.LoadROMFile(argv[argi]))
+				if (!opt.LoadROMFile(filename))
 				{
 					fprintf(stderr, "Error: %s\n", opt.message().c_str());
 					return 1;
 				}
-				opt.Optimize();
+
+				if (resumed)
+				{
+					if (!opt.RestoreCoverage(checkpoint.coverage) || !opt.RestoreState(checkpoint.state))
+					{
+						fprintf(stderr, "Error: %s\n", opt.message().c_str());
+						return 1;
+					}
+					opt.ResumeOptimize();
+				}
+				else
+				{
+					opt.Optimize();
+				}
 			}
 
 			std::map<std::string, std::string> tags;
@@ -1457,6 +2562,12 @@ int main(int argc, char *argv[])
 
 			opt.SaveGSF(out_path, true, tags);
 
+			// the run is complete, its checkpoint is no longer needed
+			if (!checkpoint_path.empty())
+			{
+				remove(checkpoint_path.c_str());
+			}
+
 			if (opt.GetParanoidClosedAreaFillSize() > 0) {
 				printf("Preserved any data within %d bytes between two used bytes.\n",
 					opt.GetParanoidClosedAreaFillSize());
@@ -1481,21 +2592,23 @@ int main(int argc, char *argv[])
 			}
 
 			// optimize
-			for (; argi < argc; argi++)
+			GsfOptJob job = [&](GsfOpt& opt, int index, std::string * out, std::string * err) -> bool
 			{
+				const char * filename = argv[argi + index];
+
 				// determine output filename
 				std::string out_path = out_name;
 				if (out_name.empty())
 				{
-					const char *ext = path_findext(argv[argi]);
+					const char *ext = path_findext(filename);
 					if (*ext == '\0')
 					{
-						out_path = argv[argi];
+						out_path = filename;
 						out_path += ".gsf";
 					}
 					else
 					{
-						out_path = std::string(argv[argi], ext - argv[argi]);
+						out_path = std::string(filename, ext - filename);
 						out_path += ".gsf";
 					}
 				}
@@ -1510,14 +2623,17 @@ int main(int argc, char *argv[])
 					}
 				}
 
-				printf("Optimizing %s\n", argv[argi]);
+				GsfOpt::ConsolePrint(out, stdout, "Optimizing %s\n", filename);
 
-				opt.ResetOptimizer();
-				if (!opt.LoadROMFile(argv[argi]))
+				if (!opt.LoadROMFile(filename))
 				{
-					fprintf(stderr, "Error: %s\n", opt.message().c_str());
-					return 1;
+					GsfOpt::ConsolePrint(err, stderr, "Error: %s\n", opt.message().c_str());
+					return false;
 				}
+
+				// reset after loading, since loading merges the coverage of the previous file,
+				// which must not leak into this one (workers process different sets of files)
+				opt.ResetOptimizer();
 				opt.Optimize();
 
 				std::map<std::string, std::string> tags;
@@ -1528,16 +2644,22 @@ int main(int argc, char *argv[])
 				opt.SaveGSF(out_path, true, tags);
 
 				if (opt.GetParanoidClosedAreaFillSize() > 0) {
-					printf("Preserved any data within %d bytes between two used bytes.\n",
+					GsfOpt::ConsolePrint(out, stdout, "Preserved any data within %d bytes between two used bytes.\n",
 						opt.GetParanoidClosedAreaFillSize());
 				}
 
 				if (opt.GetParanoidPostFillSize() > 0) {
-					printf("Preserved any data within %d trailing bytes of a used byte.\n",
+					GsfOpt::ConsolePrint(out, stdout, "Preserved any data within %d trailing bytes of a used byte.\n",
 						opt.GetParanoidPostFillSize());
 				}
 
-				printf("Covered %u bytes. Preserved %d extra bytes.\n", opt.GetCoveredSize(), opt.GetParanoidFilledSize());
+				GsfOpt::ConsolePrint(out, stdout, "Covered %u bytes. Preserved %d extra bytes.\n", opt.GetCoveredSize(), opt.GetParanoidFilledSize());
+				return true;
+			};
+
+			if (!RunJobs(opt, num_threads, argc - argi, job))
+			{
+				return 1;
 			}
 			break;
 		}
@@ -1550,20 +2672,22 @@ int main(int argc, char *argv[])
 				return 1;
 			}
 
-			for (int i = argi; i < argc; i++)
+			GsfOptJob job = [&](GsfOpt& opt, int index, std::string * /*out*/, std::string * err) -> bool
 			{
+				const char * filename = argv[argi + index];
+
 				std::string out_path;
 				if (out_name.empty())
 				{
-					const char *ext = path_findext(argv[i]);
+					const char *ext = path_findext(filename);
 					if (*ext == '\0')
 					{
-						out_path = argv[i];
+						out_path = filename;
 						out_path += ".gba";
 					}
 					else
 					{
-						out_path = std::string(argv[i], ext - argv[i]);
+						out_path = std::string(filename, ext - filename);
 						out_path += ".gba";
 					}
 				}
@@ -1578,12 +2702,18 @@ int main(int argc, char *argv[])
 					}
 				}
 
-				if (!opt.LoadROMFile(argv[i]))
+				if (!opt.LoadROMFile(filename))
 				{
-					fprintf(stderr, "Error: %s\n", opt.message().c_str());
-					return 1;
+					GsfOpt::ConsolePrint(err, stderr, "Error: %s\n", opt.message().c_str());
+					return false;
 				}
 				opt.SaveROM(out_path, false);
+				return true;
+			};
+
+			if (!RunJobs(opt, num_threads, argc - argi, job))
+			{
+				return 1;
 			}
 			break;
 		}
@@ -1597,33 +2727,38 @@ int main(int argc, char *argv[])
 			}
 
 			// optimize
-			for (; argi < argc; argi++)
+			GsfOptJob job = [&](GsfOpt& opt, int index, std::string * /*out*/, std::string * err) -> bool
 			{
+				const char * filename = argv[argi + index];
+
 				// determine output filename
-				std::string out_path = argv[argi];
+				std::string out_path = filename;
 
-				opt.ResetOptimizer();
-				if (!opt.LoadROMFile(argv[argi]))
+				if (!opt.LoadROMFile(filename))
 				{
-					fprintf(stderr, "Error: %s\n", opt.message().c_str());
-					return 1;
+					GsfOpt::ConsolePrint(err, stderr, "Error: %s\n", opt.message().c_str());
+					return false;
 				}
+
+				// reset after loading, since loading merges the coverage of the previous file,
+				// which must not leak into this one (workers process different sets of files)
+				opt.ResetOptimizer();
 				opt.Optimize();
 
 #ifdef _DEBUG
 				for (int count = 1; count <= opt.GetTargetLoopCount(); count++)
 				{
-					printf("Loop Point %d = %s\n", count, opt.GetLoopPointString(count).c_str());
+					GsfOpt::ConsolePrint(out, stdout, "Loop Point %d = %s\n", count, opt.GetLoopPointString(count).c_str());
 				}
 #endif
 
 				if (addGSFTags)
 				{
-					PSFFile * gsf = PSFFile::load(argv[argi]);
+					PSFFile * gsf = PSFFile::load(filename);
 					if (gsf == NULL)
 					{
-						fprintf(stderr, "Error: Invalid PSF file %s (file operation error)\n", argv[argi]);
-						return 1;
+						GsfOpt::ConsolePrint(err, stderr, "Error: Invalid PSF file %s (file operation error)\n", filename);
+						return false;
 					}
 
 					if (opt.IsOneShot())
@@ -1655,6 +2790,12 @@ int main(int argc, char *argv[])
 					gsf->save(out_path);
 					delete gsf;
 				}
+				return true;
+			};
+
+			if (!RunJobs(opt, num_threads, argc - argi, job))
+			{
+				return 1;
 			}
 			break;
 		}
@@ -2,10 +2,20 @@
 #ifndef GSFOPT_H
 #define GSFOPT_H
 
+#include <stdio.h>
+#include <math.h>
+
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <functional>
+#include <memory>
 
 #include "vbam/gba/GBA.h"
+#include "SoundAnalysis.h"
+#include "SoundPipe.h"
 
 class GsfOpt
 {
@@ -21,10 +31,53 @@ public:
 	void ResetOptimizer(void);
 	void Optimize(void);
 
+	// Optimize() in parts: StartOptimize() resets the detectors, StepOptimize() emulates
+	// a single time slice (returns true once the optimization is finished), and
+	// ResumeOptimize() runs the remaining slices with progress display and shows the result.
+	void StartOptimize(void);
+	bool StepOptimize(void);
+	void ResumeOptimize(void);
+
+	// Starts the optimization and runs it up to the last time slice that does not read
+	// the specified ROM area, so that the area can still be patched afterwards.
+	void StartOptimizeUntilRead(u32 offset, u32 size);
+
+	// Saves/restores the emulator and the progress of the current optimization.
+	// The accumulated coverage is not a part of the state, and a state can only
+	// be restored while the same ROM is loaded. Saving brings the timers, the
+	// deferred flags and the sound buffer of the emulator up to date, so it
+	// modifies the instance as restoring does.
+	bool SaveState(std::vector<u8>& state);
+	bool RestoreState(const std::vector<u8>& state);
+
+	// Creates another instance with the same settings, ROM and state (without the accumulated coverage).
+	// It saves the state of this instance, which must not be used by another thread meanwhile.
+	GsfOpt * Clone(void);
+
+	// Saves/restores the accumulated coverage
+	void SaveCoverage(std::vector<u8>& coverage);
+	bool RestoreCoverage(const std::vector<u8>& coverage);
+
+	typedef std::function<void(GsfOpt& opt)> CheckpointHandler;
+
+	// Calls the handler every interval seconds (in real time) between the time slices of
+	// ResumeOptimize(), so that it can save the progress of a long run
+	inline void SetCheckpointHandler(const CheckpointHandler& handler, double interval)
+	{
+		checkpoint_handler = handler;
+		checkpoint_interval = interval;
+	}
+
 	bool GetROM(void * rom, u32 size, bool wipe_unused_data);
 	bool SaveROM(const std::string& filename, bool wipe_unused_data);
 	bool SaveGSF(const std::string& filename, bool wipe_unused_data, std::map<std::string, std::string>& tags);
 
+	// Copies the optimizer/timer settings (not the ROM or its coverage) from another instance
+	void CopySettings(const GsfOpt& other);
+
+	// Adds the coverage of another instance, which has loaded the same ROM
+	void MergeCoverage(const GsfOpt& other);
+
 	inline u32 GetROMSize(void) const
 	{
 		return rom_size;
@@ -115,6 +168,47 @@ public:
 		oneshot_verify_length = length;
 	}
 
+	inline double GetLoopMatchLength(void) const
+	{
+		return loop_match_length;
+	}
+
+	inline void SetLoopMatchLength(double length)
+	{
+		loop_match_length = length;
+	}
+
+	inline u32 GetSoundSampleRate(void) const
+	{
+		return sound_sample_rate;
+	}
+
+	inline void SetSoundSampleRate(u32 rate)
+	{
+		sound_sample_rate = rate;
+	}
+
+	inline bool IsSoundAnalysisThreaded(void) const
+	{
+		return sound_analysis_threaded;
+	}
+
+	// Analyzes the sound on a thread of its own while the emulation goes on (takes effect on the next ROM)
+	inline void SetSoundAnalysisThreaded(bool sw)
+	{
+		sound_analysis_threaded = sw;
+	}
+
+	inline double GetStateLoopVerifyLength(void) const
+	{
+		return state_loop_verify_length;
+	}
+
+	inline void SetStateLoopVerifyLength(double length)
+	{
+		state_loop_verify_length = length;
+	}
+
 	inline u32 GetParanoidClosedAreaFillSize(void) const
 	{
 		return paranoid_closed_area_fill_size;
@@ -145,6 +239,23 @@ public:
 		return covered_size;
 	}
 
+	inline bool IsOptimizeFinished(void) const
+	{
+		return optimize_finished;
+	}
+
+	inline std::string * GetConsoleLog(void) const
+	{
+		return console_log;
+	}
+
+	// Redirects the console output of the optimizer to a string (NULL for stdout).
+	// The progress display is disabled while the output is redirected.
+	inline void SetConsoleLog(std::string * log)
+	{
+		console_log = log;
+	}
+
 	inline const std::string& message(void) const
 	{
 		return m_message;
@@ -153,6 +264,9 @@ public:
 	static std::string ToTimeString(double t, bool padding = true);
 	static double ToTimeValue(const std::string& str);
 
+	// Prints a formatted message to the stream, or appends it to the log if it is not NULL
+	static void ConsolePrint(std::string * log, FILE * stream, const char * format, ...);
+
 protected:
 	GBASystem * m_system;
 	u32 rom_size;
@@ -168,6 +282,11 @@ protected:
 		bool initial_silence_captured;
 		uint32_t initial_silence_samples;
 
+		// mean absolute level of every block of 10 ms, to compare passages
+		std::vector<u16> levels;
+		u32 level_sum;
+		u32 level_samples;
+
 		gsf_sound_out() :
 			sample_rate(44100),
 			silence_threshold(9),
@@ -184,31 +303,55 @@ protected:
 		// Receives signed 16-bit stereo audio and a byte count
 		virtual void write(const void * samples, unsigned long bytes)
 		{
-			samples_received += (bytes / 2);
-
-			for (unsigned int i = 0; i < (bytes / 2); i++)
+			const s16 * p = (const s16 *)samples;
+			unsigned long count = bytes / 2;
+			samples_received += count;
+
+			// measure every part of a level block at once
+			size_t first_audible = count;
+			size_t last_audible = count;
+			unsigned long offset = 0;
+			while (offset < count)
 			{
-				s16 samp = ((s16 *)samples)[i];
-				if ((samp + silence_threshold) >= 0 && (samp + silence_threshold) <= (silence_threshold * 2))
-				{
-					if (silent_samples_received == 0)
-					{
-						silence_start = samples_received;
-					}
-					silent_samples_received++;
+				unsigned long n = std::min<unsigned long>(count - offset, get_level_block_samples() - level_samples);
 
-					if (!initial_silence_captured)
+				SoundBlockInfo info;
+				AnalyzeSoundBlock(p + offset, n, silence_threshold, &info);
+				if (info.first_audible != n)
+				{
+					if (first_audible == count)
 					{
-						initial_silence_samples = silent_samples_received;
+						first_audible = offset + info.first_audible;
 					}
+					last_audible = offset + info.last_audible;
 				}
-				else
-				{
-					initial_silence_captured = true;
-					silence_start = samples_received;
-					silent_samples_received = 0;
-				}
+
+				level_sum += (u32)info.abs_sum;
+				add_level_samples(n);
+				offset += n;
 			}
+
+			if (first_audible == count)
+			{
+				add_silent_samples(count);
+				return;
+			}
+
+			if (!initial_silence_captured && first_audible != 0)
+			{
+				initial_silence_samples = silent_samples_received + (u32)first_audible;
+			}
+			initial_silence_captured = true;
+			silence_start = samples_received;
+			silent_samples_received = (u32)(count - 1 - last_audible);
+		}
+
+		// Receives a count of silent samples that were not synthesized
+		virtual void skip(unsigned long samples)
+		{
+			samples_received += samples;
+			add_level_samples(samples);
+			add_silent_samples(samples);
 		}
 
 		void reset_timer(void)
@@ -218,11 +361,59 @@ protected:
 			silent_samples_received = 0;
 			initial_silence_samples = 0;
 			initial_silence_captured = false;
+
+			levels.clear();
+			level_sum = 0;
+			level_samples = 0;
+		}
+
+		// counts samples whose levels have been added to level_sum
+		void add_level_samples(unsigned long count)
+		{
+			u32 block_samples = get_level_block_samples();
+			while (count != 0)
+			{
+				u32 n = (u32)std::min<unsigned long>(count, block_samples - level_samples);
+				level_samples += n;
+				count -= n;
+
+				if (level_samples == block_samples)
+				{
+					levels.push_back((u16)(level_sum / block_samples));
+					level_sum = 0;
+					level_samples = 0;
+				}
+			}
+		}
+
+		u32 get_level_block_samples(void) const
+		{
+			return std::max<u32>(sample_rate / 50, 2);
+		}
+
+		// continues the silence by count samples, after samples_received includes them
+		void add_silent_samples(unsigned long count)
+		{
+			if (count == 0)
+			{
+				return;
+			}
+
+			if (silent_samples_received == 0)
+			{
+				silence_start = samples_received;
+			}
+			silent_samples_received += count;
+
+			if (!initial_silence_captured)
+			{
+				initial_silence_samples = silent_samples_received;
+			}
 		}
 
-		double get_timer(void) const
+		double get_level_block_length(void) const
 		{
-			return (double) samples_received / 2 / sample_rate;
+			return (double)get_level_block_samples() / 2 / sample_rate;
 		}
 
 		double get_silence_start(void) const
@@ -242,7 +433,10 @@ protected:
 	};
 	gsf_sound_out m_output;
 
-	u8 * rom_refs;
+	// passes the sound to m_output on another thread, if the analysis is threaded
+	std::unique_ptr<SoundPipe> m_sound_pipe;
+
+	RomRefs rom_refs;
 	u32 rom_refs_histogram[256];
 	u32 bytes_used;
 	double song_endpoint;
@@ -254,6 +448,10 @@ protected:
 	u8 target_loop_count;
 	double loop_verify_length;
 	double oneshot_verify_length;
+	double state_loop_verify_length;
+	double loop_match_length;
+	u32 sound_sample_rate;
+	bool sound_analysis_threaded;
 
 	double time_last_new_data;
 	double loop_point[256];
@@ -262,17 +460,59 @@ protected:
 	double oneshot_endpoint;
 	bool oneshot;
 	double initial_silence_length;
+	bool optimize_finished;
+
+	std::vector<u64> state_hashes;
+	u64 state_first_frame_ticks;
+	std::unordered_map<u64, u32> state_hash_frames;
+	u32 state_loop_start;
+	u32 state_loop_length;
+	u32 state_loop_verify_end;
+	bool state_loop_verified;
 
 	u32 paranoid_closed_area_fill_size;
 	u32 paranoid_post_fill_size;
 	u32 paranoid_filled_size;
 	u32 covered_size;
 
-	bool ReadGSFFile(const std::string& filename, unsigned int nesting_level, u8 * rom_buf, u32 * ptr_entrypoint, u32 * ptr_rom_size);
+	std::string * console_log;
+
+	CheckpointHandler checkpoint_handler;
+	double checkpoint_interval;
+
+	// ROM image of the GSF set being loaded, reused by the next load
+	std::vector<u8> rom_load_buffer;
 
-	static u32 MergeRefs(u8 * dst_refs, const u8 * src_refs, u32 size);
+	bool ReadGSFFile(const std::string& filename, unsigned int nesting_level, std::vector<u8>& rom_buf, u32 * ptr_entrypoint, u32 * ptr_rom_size);
+
+	static void MergeSystemRefs(RomRefs& dst_refs, GBASystem * system, u32 size);
+
+	// a frame lasts 228 lines of 1232 cycles
+	static const u32 CYCLES_PER_FRAME = 228 * 1232;
+
+	bool IsROMRead(u32 offset, u32 size) const;
+	double FrameToTime(u32 frame) const;
+
+	// emulated time since the start of the song, exact to the CPU cycle
+	inline double GetTime(void) const
+	{
+		return TicksToTime(CPUGetTicks(m_system));
+	}
+
+	static inline double TicksToTime(u64 ticks)
+	{
+		return (double)ticks / CPU_CLOCK_RATE;
+	}
+
+	static inline u64 TimeToTicks(double time)
+	{
+		return (u64)ceil(time * CPU_CLOCK_RATE);
+	}
+	void SyncState(StateStream& state);
 
 	virtual void DetectLoop(void);
+	bool IsLoopSoundRepeated(int count) const;
+	virtual void DetectStateLoop(void);
 	virtual void DetectOneShot(void);
 	virtual void AdjustOptimizationEndPoint(void);
 	virtual void ResetOptimizerVariables(void);
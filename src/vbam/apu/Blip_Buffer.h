@@ -83,6 +83,12 @@ public:
 	// Clears buffer before loading state.
 	void load_state( blip_buffer_state_t const& in );
 
+	// Saves or restores complete state, including samples and deltas not read yet,
+	// through io.sync( void*, size ). State must be restored into a buffer with
+	// same settings.
+	template<class Io>
+	void sync_state( Io& io );
+
 	// Number of samples delay from synthesis to samples read out
 	int output_latency() const;
 
@@ -552,6 +558,18 @@ inline blip_ulong Blip_Buffer::unsettled() const
 	return reader_accum_ >> (blip_sample_bits - 16);
 }
 
+template<class Io>
+void Blip_Buffer::sync_state( Io& io )
+{
+	io.sync( &offset_, sizeof offset_ );
+	io.sync( &reader_accum_, sizeof reader_accum_ );
+	io.sync( buffer_, (buffer_size_ + blip_buffer_extra_) * sizeof *buffer_ );
+
+	bool modified = (modified_ != 0);
+	io.sync( &modified, sizeof modified );
+	modified_ = modified ? this : 0;
+}
+
 int const blip_max_length = 0;
 int const blip_default_length = 250; // 1/4 second
 
@@ -37,6 +37,14 @@ inline int Gb_Apu::calc_output( int osc ) const
 	return (bits >> 3 & 2) | (bits & 1);
 }
 
+bool Gb_Apu::silent() const
+{
+	return (!calc_output( 0 ) || square1.silent()) &&
+			(!calc_output( 1 ) || square2.silent()) &&
+			(!calc_output( 2 ) || wave   .silent()) &&
+			(!calc_output( 3 ) || noise  .silent());
+}
+
 void Gb_Apu::set_output( Blip_Buffer* center, Blip_Buffer* left, Blip_Buffer* right, int osc )
 {
 	// Must be silent (all NULL), mono (left and right NULL), or stereo (none NULL)
@@ -52,6 +52,10 @@ public:
 	// starts a new frame at time 0.
 	void end_frame( blip_time_t frame_length );
 
+	// True if no oscillator can make sound until a register is written, since
+	// each is disabled, not sent to any output, or at a volume that can't rise.
+	bool silent() const;
+
 // Sound adjustments
 
 	// Sets overall volume, where 1.0 is normal.
@@ -178,7 +182,11 @@ struct gb_apu_state_t
 	val_t env_volume  [3];
 	val_t env_enabled [3];
 
-	val_t unused  [13]; // for future expansion
+	// version 1: allows restoring in the middle of a time frame
+	val_t last_time;
+	val_t last_amp [4];
+
+	val_t unused  [8]; // for future expansion
 };
 
 }
@@ -59,6 +59,9 @@ public:
 	void clock_envelope();
 	bool write_register( int frame_phase, int reg, int old_data, int data );
 
+	// True if output can't change until a register is written
+	bool silent() const { return !enabled || !dac_enabled() || (!volume && !(regs [2] & 0x08)); }
+
 	void reset()
 	{
 		env_delay = 0;
@@ -147,6 +150,9 @@ public:
 	int read( unsigned addr ) const;
 	void write( unsigned addr, int data );
 
+	// True if output can't change until a register is written
+	bool silent() const { return !enabled || !dac_enabled() || !(regs [2] >> 5 & (agb_mask | 3)); }
+
 	void reset()
 	{
 		sample_buf = 0;
@@ -198,6 +198,15 @@ long Stereo_Buffer::read_samples( blip_sample_t* out, long out_size )
 	return out_size;
 }
 
+long Stereo_Buffer::remove_silence()
+{
+	long count = samples_avail();
+	for ( int i = bufs_size; --i >= 0; )
+		bufs [i].remove_all_samples();
+	mixer.samples_read = 0;
+	return count;
+}
+
 
 // Stereo_Mixer
 
@@ -115,6 +115,13 @@ public:
 		Tracked_Blip_Buffer();
 		void clear();
 		void end_frame( blip_time_t );
+
+		template<class Io>
+		void sync_state( Io& io )
+		{
+			Blip_Buffer::sync_state( io );
+			io.sync( &last_non_silence, sizeof last_non_silence );
+		}
 	private:
 		blip_long last_non_silence;
 		void remove_( long );
@@ -154,6 +161,19 @@ public:
 	long samples_avail() const { return (bufs [0].samples_avail() - mixer.samples_read) * 2; }
 	long read_samples( blip_sample_t*, long );
 
+	// Removes all available samples without mixing them, and returns their count.
+	// For use when nothing audible has been added to the buffers.
+	long remove_silence();
+
+	// Saves or restores complete state of all buffers; see Blip_Buffer::sync_state()
+	template<class Io>
+	void sync_state( Io& io )
+	{
+		for ( int i = 0; i < bufs_size; i++ )
+			bufs [i].sync_state( io );
+		io.sync( &mixer.samples_read, sizeof mixer.samples_read );
+	}
+
 private:
 	enum { bufs_size = 3 };
 	typedef Tracked_Blip_Buffer buf_t;
@@ -0,0 +1,126 @@
+#ifndef __VBA_ROMREFS_H__
+#define __VBA_ROMREFS_H__
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "StateStream.h"
+#include "Types.h"
+
+// Saturating reference count of each byte of the 32 MB ROM space.
+// Most of the space is never referenced, so the counts are kept in pages
+// that are allocated when one of their bytes is referenced for the first
+// time. A missing page reads as all zero.
+class RomRefs
+{
+public:
+  enum { PAGE_BITS = 12 };
+  static const u32 PAGE_SIZE = 1 << PAGE_BITS;
+  enum { MAX_SIZE = 0x2000000 };
+  enum { PAGE_COUNT = MAX_SIZE >> PAGE_BITS };
+
+  RomRefs()
+    : pages(new u8 *[PAGE_COUNT]())
+  {
+  }
+
+  ~RomRefs()
+  {
+    clear();
+    delete[] pages;
+  }
+
+  u8 operator[](u32 offset) const
+  {
+    const u8 *p = pages[offset >> PAGE_BITS];
+    return p != NULL ? p[offset & (PAGE_SIZE - 1)] : 0;
+  }
+
+  // Page of the given index, NULL if nothing in it has been referenced
+  const u8 *page(u32 index) const
+  {
+    return pages[index];
+  }
+
+  // Counts from offset to the end of its page, allocated if necessary
+  u8 *touch(u32 offset)
+  {
+    u8 *&p = pages[offset >> PAGE_BITS];
+    if (p == NULL)
+      p = (u8 *)calloc(1, PAGE_SIZE);
+    return &p[offset & (PAGE_SIZE - 1)];
+  }
+
+  // Releases all pages, all counts become zero
+  void clear()
+  {
+    for (u32 i = 0; i < PAGE_COUNT; i++) {
+      if (pages[i] != NULL) {
+        free(pages[i]);
+        pages[i] = NULL;
+      }
+    }
+  }
+
+  // Adds the counts of the first size bytes of src
+  void merge(const RomRefs &src, u32 size)
+  {
+    for (u32 i = 0; i < pageCount(size); i++) {
+      const u8 *s = src.pages[i];
+      if (s == NULL)
+        continue;
+
+      u32 base = i << PAGE_BITS;
+      u32 n = (size - base < PAGE_SIZE) ? size - base : PAGE_SIZE;
+      u8 *d = touch(base);
+      for (u32 j = 0; j < n; j++) {
+        unsigned int sum = (unsigned int)d[j] + s[j];
+        d[j] = (sum <= 0xff) ? (u8)sum : 0xff;
+      }
+    }
+  }
+
+  // Saves or restores the counts of the first size bytes,
+  // only the allocated pages are stored
+  void sync(StateStream &state, u32 size)
+  {
+    u32 count = 0;
+    if (state.saving()) {
+      for (u32 i = 0; i < pageCount(size); i++) {
+        if (pages[i] != NULL)
+          count++;
+      }
+    } else {
+      clear();
+    }
+    state.sync(count);
+
+    u32 index = 0;
+    for (u32 n = 0; n < count && state.ok(); n++, index++) {
+      if (state.saving()) {
+        while (pages[index] == NULL)
+          index++;
+      }
+      state.sync(index);
+      if (!state.saving() && index >= pageCount(size)) {
+        state.fail();
+        break;
+      }
+      state.sync(touch(index << PAGE_BITS), PAGE_SIZE);
+    }
+  }
+
+  static u32 pageCount(u32 size)
+  {
+    return (size + PAGE_SIZE - 1) >> PAGE_BITS;
+  }
+
+private:
+  // noncopyable
+  RomRefs(const RomRefs &);
+  RomRefs &operator=(const RomRefs &);
+
+  u8 **pages;
+};
+
+#endif // __VBA_ROMREFS_H__
@@ -0,0 +1,80 @@
+#ifndef __VBA_STATESTREAM_H__
+#define __VBA_STATESTREAM_H__
+
+#include <string.h>
+
+#include <vector>
+
+#include "Types.h"
+
+// Serializes emulator state into a byte buffer, or restores it from one.
+// The same sync() calls are used for both directions, so that the layout
+// of saved and restored state can not diverge. The data is in host format,
+// it is meant for snapshots taken and restored by the same executable.
+class StateStream
+{
+public:
+  // Appends state to out
+  StateStream(std::vector<u8> &out)
+    : out(&out), in(NULL), inSize(0), inPos(0), error(false)
+  {
+  }
+
+  // Reads state from the first size bytes of in
+  StateStream(const u8 *in, size_t size)
+    : out(NULL), in(in), inSize(size), inPos(0), error(false)
+  {
+  }
+
+  bool saving() const
+  {
+    return out != NULL;
+  }
+
+  // False once a read ran past the end of the state
+  bool ok() const
+  {
+    return !error;
+  }
+
+  void sync(void *data, size_t size)
+  {
+    if (out != NULL) {
+      const u8 *p = (const u8 *)data;
+      out->insert(out->end(), p, p + size);
+    } else {
+      if (error || size > inSize - inPos) {
+        error = true;
+        return;
+      }
+      memcpy(data, in + inPos, size);
+      inPos += size;
+    }
+  }
+
+  template <typename T> void sync(T &value)
+  {
+    sync(&value, sizeof(value));
+  }
+
+  // Bytes left to read
+  size_t remaining() const
+  {
+    return error ? 0 : inSize - inPos;
+  }
+
+  // Marks restored state as invalid
+  void fail()
+  {
+    error = true;
+  }
+
+private:
+  std::vector<u8> *out;
+  const u8 *in;
+  size_t inSize;
+  size_t inPos;
+  bool error;
+};
+
+#endif // __VBA_STATESTREAM_H__
@@ -65,28 +65,20 @@ static INSN_REGPARM void armUnknownInsn(GBASystem *gba, u32 opcode)
 #define C_SETCOND_LOGICAL \
     gba->N_FLAG = ((s32)res < 0) ? true : false;             \
     gba->Z_FLAG = (res == 0) ? true : false;                 \
-    gba->C_FLAG = C_OUT;
+    CPUSetCFlag(gba, C_OUT);
 #define C_SETCOND_ADD \
     gba->N_FLAG = ((s32)res < 0) ? true : false;             \
     gba->Z_FLAG = (res == 0) ? true : false;                 \
-    gba->V_FLAG = ((NEG(lhs) & NEG(rhs) & POS(res)) |        \
-              (POS(lhs) & POS(rhs) & NEG(res))) ? true : false;\
-    gba->C_FLAG = ((NEG(lhs) & NEG(rhs)) |                   \
-              (NEG(lhs) & POS(res)) |                   \
-              (NEG(rhs) & POS(res))) ? true : false;
+    CPUDeferAddFlags(gba, lhs, rhs, res);
 #define C_SETCOND_SUB \
     gba->N_FLAG = ((s32)res < 0) ? true : false;             \
     gba->Z_FLAG = (res == 0) ? true : false;                 \
-    gba->V_FLAG = ((NEG(lhs) & POS(rhs) & POS(res)) |        \
-              (POS(lhs) & NEG(rhs) & NEG(res))) ? true : false;\
-    gba->C_FLAG = ((NEG(lhs) & POS(rhs)) |                   \
-              (NEG(lhs) & POS(res)) |                   \
-              (POS(rhs) & POS(res))) ? true : false;
+    CPUDeferSubFlags(gba, lhs, rhs, res);
 
 #ifndef ALU_INIT_C
  #define ALU_INIT_C \
     int dest = (opcode>>12) & 15;                       \
-    bool C_OUT = gba->C_FLAG;                                \
+    bool C_OUT = CPUGetCFlag(gba);                           \
     u32 value;
 #endif
 // OP Rd,Rb,Rm LSL #
@@ -217,7 +209,7 @@ static INSN_REGPARM void armUnknownInsn(GBASystem *gba, u32 opcode)
         u32 v = gba->reg[opcode & 0x0F].I;                   \
         C_OUT = (v & 1) ? true : false;                 \
         value = ((v >> 1) |                             \
-                 (gba->C_FLAG << 31));                       \
+                 ((u32)CPUGetCFlag(gba) << 31));            \
     }
 #endif
 // OP Rd,Rb,Rm ROR Rs
@@ -336,7 +328,7 @@ static INSN_REGPARM void armUnknownInsn(GBASystem *gba, u32 opcode)
  #define OP_ADC \
     u32 lhs = gba->reg[(opcode>>16)&15].I;                   \
     u32 rhs = value;                                    \
-    u32 res = lhs + rhs + (u32)gba->C_FLAG;                  \
+    u32 res = lhs + rhs + (u32)CPUGetCFlag(gba);             \
     gba->reg[dest].I = res;
 #endif
 #ifndef OP_ADCS
@@ -346,7 +338,7 @@ static INSN_REGPARM void armUnknownInsn(GBASystem *gba, u32 opcode)
  #define OP_SBC \
     u32 lhs = gba->reg[(opcode>>16)&15].I;                   \
     u32 rhs = value;                                    \
-    u32 res = lhs - rhs - !((u32)gba->C_FLAG);               \
+    u32 res = lhs - rhs - !((u32)CPUGetCFlag(gba));          \
     gba->reg[dest].I = res;
 #endif
 #ifndef OP_SBCS
@@ -356,7 +348,7 @@ static INSN_REGPARM void armUnknownInsn(GBASystem *gba, u32 opcode)
  #define OP_RSC \
     u32 lhs = gba->reg[(opcode>>16)&15].I;                   \
     u32 rhs = value;                                    \
-    u32 res = rhs - lhs - !((u32)gba->C_FLAG);               \
+    u32 res = rhs - lhs - !((u32)CPUGetCFlag(gba));          \
     gba->reg[dest].I = res;
 #endif
 #ifndef OP_RSCS
@@ -452,7 +444,7 @@ static INSN_REGPARM void armUnknownInsn(GBASystem *gba, u32 opcode)
 #endif
 #ifndef RRX_OFFSET
  #define RRX_OFFSET \
-    offset = ((offset >> 1) | ((int)gba->C_FLAG << 31));
+    offset = ((offset >> 1) | ((int)CPUGetCFlag(gba) << 31));
 #endif
 
 // ALU ops (except multiply) //////////////////////////////////////////////
@@ -1998,7 +1990,6 @@ static INSN_REGPARM void armF00(GBASystem *gba, u32 opcode)
 
 // Instruction table //////////////////////////////////////////////////////
 
-typedef INSN_REGPARM void (*insnfunc_t)(GBASystem *, u32 opcode);
 #define REP16(insn) \
     insn,insn,insn,insn,insn,insn,insn,insn,\
     insn,insn,insn,insn,insn,insn,insn,insn
@@ -2189,9 +2180,391 @@ static insnfunc_t armInsnTable[4096] = {
 
 // Wrapper routine (execution loop) ///////////////////////////////////////
 
+static inline bool armCheckCondition(GBASystem *gba, u32 opcode)
+{
+    int cond = opcode >> 28;
+    bool cond_res = true;
+    if (UNLIKELY(cond != 0x0E)) {  // most opcodes are AL (always)
+        switch(cond) {
+          case 0x00: // EQ
+            cond_res = gba->Z_FLAG;
+            break;
+          case 0x01: // NE
+            cond_res = !gba->Z_FLAG;
+            break;
+          case 0x02: // CS
+            cond_res = CPUGetCFlag(gba);
+            break;
+          case 0x03: // CC
+            cond_res = !CPUGetCFlag(gba);
+            break;
+          case 0x04: // MI
+            cond_res = gba->N_FLAG;
+            break;
+          case 0x05: // PL
+            cond_res = !gba->N_FLAG;
+            break;
+          case 0x06: // VS
+            cond_res = CPUGetVFlag(gba);
+            break;
+          case 0x07: // VC
+            cond_res = !CPUGetVFlag(gba);
+            break;
+          case 0x08: // HI
+            cond_res = CPUGetCFlag(gba) && !gba->Z_FLAG;
+            break;
+          case 0x09: // LS
+            cond_res = !CPUGetCFlag(gba) || gba->Z_FLAG;
+            break;
+          case 0x0A: // GE
+            cond_res = gba->N_FLAG == CPUGetVFlag(gba);
+            break;
+          case 0x0B: // LT
+            cond_res = gba->N_FLAG != CPUGetVFlag(gba);
+            break;
+          case 0x0C: // GT
+            cond_res = !gba->Z_FLAG &&(gba->N_FLAG == CPUGetVFlag(gba));
+            break;
+          case 0x0D: // LE
+            cond_res = gba->Z_FLAG || (gba->N_FLAG != CPUGetVFlag(gba));
+            break;
+          case 0x0E: // AL (impossible, checked above)
+            cond_res = true;
+            break;
+          case 0x0F:
+          default:
+            // ???
+            cond_res = false;
+            break;
+        }
+    }
+    return cond_res;
+}
+
+static insnfunc_t armDecode(u32 opcode, bool &jump)
+{
+    // B, BL, BX and SWI that are always executed
+    jump = (opcode >> 28) == 0x0E &&
+           ((opcode & 0x0E000000) == 0x0A000000 ||
+            (opcode & 0x0FFFFFF0) == 0x012FFF10 ||
+            (opcode & 0x0F000000) == 0x0F000000);
+    return armInsnTable[((opcode>>16)&0xFF0) | ((opcode>>4)&0x0F)];
+}
+
+#ifdef THREADED_DISPATCH
+// The instructions that the threaded block executor runs itself: the data
+// processing ones that neither read nor write the PC, with an immediate or
+// a register shifted by an immediate (but for ROR and RRX). They are labelled
+// by their opcode and S bits and the operand, the other ones are called.
+enum { ARM_CALL, ARM_ALU_LSL, ARM_ALU_LSR, ARM_ALU_ASR, ARM_ALU_IMM };
+
+static int armThreadedInsn(u32 opcode)
+{
+    int operand;
+    if ((opcode & 0x0E000000) == 0x02000000)
+        operand = ARM_ALU_IMM;
+    else if ((opcode & 0x0E000070) == 0 && (opcode & 0x0F) != 15)
+        operand = ARM_ALU_LSL;
+    else if ((opcode & 0x0E000070) == 0x20 && (opcode & 0x0F) != 15)
+        operand = ARM_ALU_LSR;
+    else if ((opcode & 0x0E000070) == 0x40 && (opcode & 0x0F) != 15)
+        operand = ARM_ALU_ASR;
+    else
+        return ARM_CALL;
+
+    if (((opcode >> 16) & 15) == 15 || ((opcode >> 12) & 15) == 15)
+        return ARM_CALL;
+    return ((opcode >> 20) & 31) * 4 + operand;
+}
+
+// Only the logical instructions that set the flags need them, to keep V, and
+// C if the operand does not change it
+#define ARM_THREADED_INIT_NONE \
+    int dest = (opcode >> 12) & 15;                     \
+    bool C_OUT = false;                                 \
+    u32 value;
+#define ARM_THREADED_INIT_LOGICAL \
+    CPU_THREADED_FLAGS(gba)                             \
+    int dest = (opcode >> 12) & 15;                     \
+    bool C_OUT = C;                                     \
+    u32 value;
+#define ARM_THREADED_INIT_ADD ARM_THREADED_INIT_NONE
+#define ARM_THREADED_INIT_SUB ARM_THREADED_INIT_NONE
+
+#define ARM_THREADED_OP_TST \
+    u32 res = gba->reg[(opcode >> 16) & 0x0F].I & value;     \
+    (void)dest;
+#define ARM_THREADED_OP_TEQ \
+    u32 res = gba->reg[(opcode >> 16) & 0x0F].I ^ value;     \
+    (void)dest;
+#define ARM_THREADED_OP_CMP \
+    u32 lhs = gba->reg[(opcode>>16)&15].I;                   \
+    u32 rhs = value;                                    \
+    u32 res = lhs - rhs;                                \
+    (void)dest;
+#define ARM_THREADED_OP_CMN \
+    u32 lhs = gba->reg[(opcode>>16)&15].I;                   \
+    u32 rhs = value;                                    \
+    u32 res = lhs + rhs;                                \
+    (void)dest;
+
+#define ARM_THREADED_SETCOND_NONE \
+    (void)C_OUT;
+#define ARM_THREADED_SETCOND_LOGICAL \
+    N = (s32)res < 0;                                   \
+    Z = res == 0;                                       \
+    C = C_OUT;
+#define ARM_THREADED_SETCOND_ADD \
+    N = (s32)res < 0;                                   \
+    Z = res == 0;                                       \
+    C = CPUAddCFlag(lhs, rhs, res);                     \
+    V = CPUAddVFlag(lhs, rhs, res);                     \
+    flags = true;                                       \
+    (void)C_OUT;
+#define ARM_THREADED_SETCOND_SUB \
+    N = (s32)res < 0;                                   \
+    Z = res == 0;                                       \
+    C = CPUSubCFlag(lhs, rhs, res);                     \
+    V = CPUSubVFlag(lhs, rhs, res);                     \
+    flags = true;                                       \
+    (void)C_OUT;
+
+// The labels of an ALU instruction, as in DEFINE_ALU_INSN_C with the flags
+// in locals, and the entries of the label table
+#define ARM_THREADED_ALU(NAME, OP, SETCOND) \
+  NAME##_lsl: { ARM_THREADED_INIT_##SETCOND VALUE_LSL_IMM_C OP ARM_THREADED_SETCOND_##SETCOND } goto alu; \
+  NAME##_lsr: { ARM_THREADED_INIT_##SETCOND VALUE_LSR_IMM_C OP ARM_THREADED_SETCOND_##SETCOND } goto alu; \
+  NAME##_asr: { ARM_THREADED_INIT_##SETCOND VALUE_ASR_IMM_C OP ARM_THREADED_SETCOND_##SETCOND } goto alu; \
+  NAME##_imm: { ARM_THREADED_INIT_##SETCOND VALUE_IMM_C     OP ARM_THREADED_SETCOND_##SETCOND } goto alu;
+#define ARM_THREADED_LABELS(NAME) &&NAME##_lsl, &&NAME##_lsr, &&NAME##_asr, &&NAME##_imm,
+#define ARM_THREADED_CALLS &&call, &&call, &&call, &&call,
+
+// Runs the instructions of a block that starts at armNextPC, as the loop
+// below does, by jumping to a label for each of them. The conditions and the
+// ALU instructions above are run with the PC, the ticks and the flags in
+// locals. Those are stored for the other instructions, which are called at
+// the label "call", and when the block is left.
+static int armInterpretBlock(GBASystem *gba, CodeBlock *block)
+{
+    // (opcode >> 20) & 31, then the operand
+    static const void *const labels[] = {
+        &&call,
+        ARM_THREADED_LABELS(and_) ARM_THREADED_LABELS(ands)
+        ARM_THREADED_LABELS(eor)  ARM_THREADED_LABELS(eors)
+        ARM_THREADED_LABELS(sub)  ARM_THREADED_LABELS(subs)
+        ARM_THREADED_LABELS(rsb)  ARM_THREADED_LABELS(rsbs)
+        ARM_THREADED_LABELS(add)  ARM_THREADED_LABELS(adds)
+        ARM_THREADED_CALLS        ARM_THREADED_CALLS          // ADC
+        ARM_THREADED_CALLS        ARM_THREADED_CALLS          // SBC
+        ARM_THREADED_CALLS        ARM_THREADED_CALLS          // RSC
+        ARM_THREADED_CALLS        ARM_THREADED_LABELS(tst)    // MRS CPSR, TST
+        ARM_THREADED_CALLS        ARM_THREADED_LABELS(teq)    // MSR CPSR, TEQ
+        ARM_THREADED_CALLS        ARM_THREADED_LABELS(cmp)    // MRS SPSR, CMP
+        ARM_THREADED_CALLS        ARM_THREADED_LABELS(cmn)    // MSR SPSR, CMN
+        ARM_THREADED_LABELS(orr)  ARM_THREADED_LABELS(orrs)
+        ARM_THREADED_LABELS(mov)  ARM_THREADED_LABELS(movs)
+        ARM_THREADED_LABELS(bic)  ARM_THREADED_LABELS(bics)
+        ARM_THREADED_LABELS(mvn)  ARM_THREADED_LABELS(mvns)
+    };
+    if (!block->labelled) {
+        for (int k = 0; k < block->count; k++)
+            block->insns[k].label = (u8)armThreadedInsn(block->insns[k].opcode);
+        block->labelled = true;
+    }
+
+    u32 pc = block->address; // of the instruction i
+    int ticks = gba->cpuTotalTicks;
+    int nextEvent = gba->cpuNextEvent;
+    int clockTicks = 0;
+    bool N = false, Z = false, C = false, V = false;
+    bool flags = false; // whether they are in the locals
+#ifdef GSFOPT
+    int covered = block->covered;
+#endif
+    int i = 0;
+    u32 opcode;
+
+next:
+    if ((pc & 0x0803FFFF) == 0x08020000)
+        gba->busPrefetchCount = 0x100;
+
+    opcode = block->insns[i].opcode;
+    gba->busPrefetch = false;
+    if (gba->busPrefetchCount & 0xFFFFFE00)
+        gba->busPrefetchCount = 0x100 | (gba->busPrefetchCount & 0xFF);
+
+    if (UNLIKELY((opcode >> 28) != 0x0E)) {
+        CPU_THREADED_FLAGS(gba)
+        if (!CPUCheckCondition(opcode >> 28, N, Z, C, V))
+            goto sequential;
+    }
+    goto *labels[block->insns[i].label];
+
+    ARM_THREADED_ALU(and_, OP_AND, NONE)
+    ARM_THREADED_ALU(ands, OP_AND, LOGICAL)
+    ARM_THREADED_ALU(eor,  OP_EOR, NONE)
+    ARM_THREADED_ALU(eors, OP_EOR, LOGICAL)
+    ARM_THREADED_ALU(sub,  OP_SUB, NONE)
+    ARM_THREADED_ALU(subs, OP_SUB, SUB)
+    ARM_THREADED_ALU(rsb,  OP_RSB, NONE)
+    ARM_THREADED_ALU(rsbs, OP_RSB, SUB)
+    ARM_THREADED_ALU(add,  OP_ADD, NONE)
+    ARM_THREADED_ALU(adds, OP_ADD, ADD)
+    ARM_THREADED_ALU(tst,  ARM_THREADED_OP_TST, LOGICAL)
+    ARM_THREADED_ALU(teq,  ARM_THREADED_OP_TEQ, LOGICAL)
+    ARM_THREADED_ALU(cmp,  ARM_THREADED_OP_CMP, SUB)
+    ARM_THREADED_ALU(cmn,  ARM_THREADED_OP_CMN, ADD)
+    ARM_THREADED_ALU(orr,  OP_ORR, NONE)
+    ARM_THREADED_ALU(orrs, OP_ORR, LOGICAL)
+    ARM_THREADED_ALU(mov,  OP_MOV, NONE)
+    ARM_THREADED_ALU(movs, OP_MOV, LOGICAL)
+    ARM_THREADED_ALU(bic,  OP_BIC, NONE)
+    ARM_THREADED_ALU(bics, OP_BIC, LOGICAL)
+    ARM_THREADED_ALU(mvn,  OP_MVN, NONE)
+    ARM_THREADED_ALU(mvns, OP_MVN, LOGICAL)
+
+alu:
+    clockTicks = 1 + codeTicksAccessSeq32(gba, pc + 4);
+    goto counted;
+
+sequential:
+    clockTicks = 1 + codeTicksAccessSeq32(gba, pc);
+counted:
+    ticks += clockTicks;
+#ifdef GSFOPT
+    if (i >= covered) {
+        gba->cpuTotalTicks = ticks;
+        CPUMarkMemoryAsRead(gba, pc, 4);
+    }
+#endif
+    pc += 4;
+    if (++i < block->count && ticks < nextEvent)
+        goto next;
+
+    // left after the last instruction, or for an event
+    gba->armNextPC = pc;
+    gba->reg[15].I = pc + 4;
+    gba->cpuPrefetch[0] = block->insns[i].opcode;
+    gba->cpuPrefetch[1] = block->insns[i + 1].opcode;
+    gba->clockTicks = clockTicks;
+    gba->cpuTotalTicks = ticks;
+    if (flags)
+        CPUStoreFlags(gba, N, Z, C, V);
+    return 1;
+
+call:
+    gba->armNextPC = pc + 4;
+    gba->reg[15].I = pc + 8;
+    gba->cpuPrefetch[0] = block->insns[i + 1].opcode;
+    gba->cpuPrefetch[1] = block->insns[i + 2].opcode;
+    gba->cpuTotalTicks = ticks;
+    if (flags)
+        CPUStoreFlags(gba, N, Z, C, V);
+    gba->clockTicks = 0;
+
+    (*block->insns[i].handler)(gba, opcode);
+
+    if (gba->clockTicks < 0)
+        return 0;
+    if (gba->clockTicks == 0)
+        gba->clockTicks = 1 + codeTicksAccessSeq32(gba, pc);
+    gba->cpuTotalTicks += gba->clockTicks;
+
+#ifdef GSFOPT
+    if (i >= covered)
+        CPUMarkMemoryAsRead(gba, pc, 4);
+    if (CPUIsIdleLoopJump(gba, pc))
+      CPUCheckIdleLoop(gba);
+#endif
+
+    // the block is left on a jump, or after a write to its code
+    if (++i == block->count || gba->armNextPC != pc + 4 || !CPUIsCodeBlockValid(gba, block))
+        return 1;
+    if (gba->cpuTotalTicks >= gba->cpuNextEvent || !gba->armState || gba->holdState || gba->SWITicks)
+        return 1;
+
+    pc += 4;
+    ticks = gba->cpuTotalTicks;
+    nextEvent = gba->cpuNextEvent;
+    flags = false;
+    goto next;
+}
+#else
+// Runs the instructions of a block that starts at armNextPC, in the same way
+// as the loop below, for as long as they are executed in sequence
+static int armInterpretBlock(GBASystem *gba, CodeBlock *block)
+{
+    for (int i = 0; ; ) {
+        if ((gba->armNextPC & 0x0803FFFF) == 0x08020000)
+          gba->busPrefetchCount = 0x100;
+
+        u32 opcode = block->insns[i].opcode;
+        gba->cpuPrefetch[0] = gba->cpuPrefetch[1];
+
+        gba->busPrefetch = false;
+        if (gba->busPrefetchCount & 0xFFFFFE00)
+            gba->busPrefetchCount = 0x100 | (gba->busPrefetchCount & 0xFF);
+
+        gba->clockTicks = 0;
+        int oldArmNextPC = gba->armNextPC;
+
+        gba->armNextPC = gba->reg[15].I;
+        gba->reg[15].I += 4;
+        gba->cpuPrefetch[1] = block->insns[i + 2].opcode;
+
+        if (armCheckCondition(gba, opcode))
+            (*block->insns[i].handler)(gba, opcode);
+        if (gba->clockTicks < 0)
+            return 0;
+        if (gba->clockTicks == 0)
+            gba->clockTicks = 1 + codeTicksAccessSeq32(gba, oldArmNextPC);
+        gba->cpuTotalTicks += gba->clockTicks;
+
+#ifdef GSFOPT
+        if (i >= block->covered)
+            CPUMarkMemoryAsRead(gba, oldArmNextPC, 4);
+        if (CPUIsIdleLoopJump(gba, oldArmNextPC))
+          CPUCheckIdleLoop(gba);
+#endif
+
+        // the block is left on a jump, or after a write to its code
+        if (++i == block->count || gba->armNextPC != (u32)oldArmNextPC + 4 || !CPUIsCodeBlockValid(gba, block))
+            return 1;
+        if (gba->cpuTotalTicks >= gba->cpuNextEvent || !gba->armState || gba->holdState || gba->SWITicks)
+            return 1;
+    }
+}
+#endif
+
+// Runs a block, from its translation once it is hot
+static int armExecuteBlock(GBASystem *gba, CodeBlock *block)
+{
+#ifdef GSFOPT
+    while (block->covered < block->count &&
+           CPUIsMemoryMarked(gba, block->address + block->covered * 4, 4))
+        block->covered++;
+#endif
+
+#ifdef CODE_JIT
+    if (block->code == NULL && ++block->runs == CodeBlock::HOT_RUNS)
+        block->code = CPUTranslateCodeBlock(gba, block, armCheckCondition);
+    if (block->code != NULL)
+        return CPURunCodeBlock(gba, block, armInterpretBlock);
+#endif
+
+    return armInterpretBlock(gba, block);
+}
+
 int armExecute(GBASystem *gba)
 {
     do {
+        CodeBlock *block = CPUGetCodeBlock(gba, false, armDecode);
+        if (block != NULL) {
+            if (!armExecuteBlock(gba, block))
+                return 0;
+            continue;
+        }
+
         if ((gba->armNextPC & 0x0803FFFF) == 0x08020000)
           gba->busPrefetchCount = 0x100;
 
@@ -2209,64 +2582,7 @@ int armExecute(GBASystem *gba)
         gba->reg[15].I += 4;
         ARM_PREFETCH_NEXT;
 
-        int cond = opcode >> 28;
-        bool cond_res = true;
-        if (UNLIKELY(cond != 0x0E)) {  // most opcodes are AL (always)
-            switch(cond) {
-              case 0x00: // EQ
-                cond_res = gba->Z_FLAG;
-                break;
-              case 0x01: // NE
-                cond_res = !gba->Z_FLAG;
-                break;
-              case 0x02: // CS
-                cond_res = gba->C_FLAG;
-                break;
-              case 0x03: // CC
-                cond_res = !gba->C_FLAG;
-                break;
-              case 0x04: // MI
-                cond_res = gba->N_FLAG;
-                break;
-              case 0x05: // PL
-                cond_res = !gba->N_FLAG;
-                break;
-              case 0x06: // VS
-                cond_res = gba->V_FLAG;
-                break;
-              case 0x07: // VC
-                cond_res = !gba->V_FLAG;
-                break;
-              case 0x08: // HI
-                cond_res = gba->C_FLAG && !gba->Z_FLAG;
-                break;
-              case 0x09: // LS
-                cond_res = !gba->C_FLAG || gba->Z_FLAG;
-                break;
-              case 0x0A: // GE
-                cond_res = gba->N_FLAG == gba->V_FLAG;
-                break;
-              case 0x0B: // LT
-                cond_res = gba->N_FLAG != gba->V_FLAG;
-                break;
-              case 0x0C: // GT
-                cond_res = !gba->Z_FLAG &&(gba->N_FLAG == gba->V_FLAG);
-                break;
-              case 0x0D: // LE
-                cond_res = gba->Z_FLAG || (gba->N_FLAG != gba->V_FLAG);
-                break;
-              case 0x0E: // AL (impossible, checked above)
-                cond_res = true;
-                break;
-              case 0x0F:
-              default:
-                // ???
-                cond_res = false;
-                break;
-            }
-        }
-
-        if (cond_res)
+        if (armCheckCondition(gba, opcode))
             (*armInsnTable[((opcode>>16)&0xFF0) | ((opcode>>4)&0x0F)])(gba, opcode);
         if (gba->clockTicks < 0)
             return 0;
@@ -2276,6 +2592,8 @@ int armExecute(GBASystem *gba)
 
 #ifdef GSFOPT
         CPUMarkMemoryAsRead(gba, oldArmNextPC, 4);
+        if (CPUIsIdleLoopJump(gba, oldArmNextPC))
+          CPUCheckIdleLoop(gba);
 #endif
 
     } while (gba->cpuTotalTicks<gba->cpuNextEvent && gba->armState && !gba->holdState && !gba->SWITicks);
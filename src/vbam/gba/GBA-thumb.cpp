@@ -33,28 +33,6 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
 #define POS(i) ((~(i)) >> 31)
 
 // C core
-#ifndef ADDCARRY
- #define ADDCARRY(a, b, c) \
-  gba->C_FLAG = ((NEG(a) & NEG(b)) |\
-            (NEG(a) & POS(c)) |\
-            (NEG(b) & POS(c))) ? true : false;
-#endif
-#ifndef ADDOVERFLOW
- #define ADDOVERFLOW(a, b, c) \
-  gba->V_FLAG = ((NEG(a) & NEG(b) & POS(c)) |\
-            (POS(a) & POS(b) & NEG(c))) ? true : false;
-#endif
-#ifndef SUBCARRY
- #define SUBCARRY(a, b, c) \
-  gba->C_FLAG = ((NEG(a) & POS(b)) |\
-            (NEG(a) & POS(c)) |\
-            (POS(b) & POS(c))) ? true : false;
-#endif
-#ifndef SUBOVERFLOW
- #define SUBOVERFLOW(a, b, c)\
-  gba->V_FLAG = ((NEG(a) & POS(b) & POS(c)) |\
-            (POS(a) & NEG(b) & NEG(c))) ? true : false;
-#endif
 #ifndef ADD_RD_RS_RN
  #define ADD_RD_RS_RN(N) \
    {\
@@ -64,8 +42,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      gba->reg[dest].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     ADDCARRY(lhs, rhs, res);\
-     ADDOVERFLOW(lhs, rhs, res);\
+     CPUDeferAddFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef ADD_RD_RS_O3
@@ -77,8 +54,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      gba->reg[dest].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     ADDCARRY(lhs, rhs, res);\
-     ADDOVERFLOW(lhs, rhs, res);\
+     CPUDeferAddFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef ADD_RD_RS_O3_0
@@ -93,8 +69,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      gba->reg[(d)].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     ADDCARRY(lhs, rhs, res);\
-     ADDOVERFLOW(lhs, rhs, res);\
+     CPUDeferAddFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef CMN_RD_RS
@@ -105,8 +80,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      u32 res = lhs + rhs;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     ADDCARRY(lhs, rhs, res);\
-     ADDOVERFLOW(lhs, rhs, res);\
+     CPUDeferAddFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef ADC_RD_RS
@@ -114,12 +88,11 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
    {\
      u32 lhs = gba->reg[dest].I;\
      u32 rhs = value;\
-     u32 res = lhs + rhs + (u32)gba->C_FLAG;\
+     u32 res = lhs + rhs + (u32)CPUGetCFlag(gba);\
      gba->reg[dest].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     ADDCARRY(lhs, rhs, res);\
-     ADDOVERFLOW(lhs, rhs, res);\
+     CPUDeferAddFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef SUB_RD_RS_RN
@@ -131,8 +104,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      gba->reg[dest].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     SUBCARRY(lhs, rhs, res);\
-     SUBOVERFLOW(lhs, rhs, res);\
+     CPUDeferSubFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef SUB_RD_RS_O3
@@ -144,8 +116,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      gba->reg[dest].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     SUBCARRY(lhs, rhs, res);\
-     SUBOVERFLOW(lhs, rhs, res);\
+     CPUDeferSubFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef SUB_RD_RS_O3_0
@@ -160,8 +131,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      gba->reg[(d)].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     SUBCARRY(lhs, rhs, res);\
-     SUBOVERFLOW(lhs, rhs, res);\
+     CPUDeferSubFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef MOV_RN_O8
@@ -180,8 +150,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      u32 res = lhs - rhs;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     SUBCARRY(lhs, rhs, res);\
-     SUBOVERFLOW(lhs, rhs, res);\
+     CPUDeferSubFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef SBC_RD_RS
@@ -189,60 +158,59 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
    {\
      u32 lhs = gba->reg[dest].I;\
      u32 rhs = value;\
-     u32 res = lhs - rhs - !((u32)gba->C_FLAG);\
+     u32 res = lhs - rhs - !((u32)CPUGetCFlag(gba));\
      gba->reg[dest].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     SUBCARRY(lhs, rhs, res);\
-     SUBOVERFLOW(lhs, rhs, res);\
+     CPUDeferSubFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef LSL_RD_RM_I5
  #define LSL_RD_RM_I5 \
    {\
-     gba->C_FLAG = (gba->reg[source].I >> (32 - shift)) & 1 ? true : false;\
+     CPUSetCFlag(gba, (gba->reg[source].I >> (32 - shift)) & 1 ? true : false);\
      value = gba->reg[source].I << shift;\
    }
 #endif
 #ifndef LSL_RD_RS
  #define LSL_RD_RS \
    {\
-     gba->C_FLAG = (gba->reg[dest].I >> (32 - value)) & 1 ? true : false;\
+     CPUSetCFlag(gba, (gba->reg[dest].I >> (32 - value)) & 1 ? true : false);\
      value = gba->reg[dest].I << value;\
    }
 #endif
 #ifndef LSR_RD_RM_I5
  #define LSR_RD_RM_I5 \
    {\
-     gba->C_FLAG = (gba->reg[source].I >> (shift - 1)) & 1 ? true : false;\
+     CPUSetCFlag(gba, (gba->reg[source].I >> (shift - 1)) & 1 ? true : false);\
      value = gba->reg[source].I >> shift;\
    }
 #endif
 #ifndef LSR_RD_RS
  #define LSR_RD_RS \
    {\
-     gba->C_FLAG = (gba->reg[dest].I >> (value - 1)) & 1 ? true : false;\
+     CPUSetCFlag(gba, (gba->reg[dest].I >> (value - 1)) & 1 ? true : false);\
      value = gba->reg[dest].I >> value;\
    }
 #endif
 #ifndef ASR_RD_RM_I5
  #define ASR_RD_RM_I5 \
    {\
-     gba->C_FLAG = ((s32)gba->reg[source].I >> (int)(shift - 1)) & 1 ? true : false;\
+     CPUSetCFlag(gba, ((s32)gba->reg[source].I >> (int)(shift - 1)) & 1 ? true : false);\
      value = (s32)gba->reg[source].I >> (int)shift;\
    }
 #endif
 #ifndef ASR_RD_RS
  #define ASR_RD_RS \
    {\
-     gba->C_FLAG = ((s32)gba->reg[dest].I >> (int)(value - 1)) & 1 ? true : false;\
+     CPUSetCFlag(gba, ((s32)gba->reg[dest].I >> (int)(value - 1)) & 1 ? true : false);\
      value = (s32)gba->reg[dest].I >> (int)value;\
    }
 #endif
 #ifndef ROR_RD_RS
  #define ROR_RD_RS \
    {\
-     gba->C_FLAG = (gba->reg[dest].I >> (value - 1)) & 1 ? true : false;\
+     CPUSetCFlag(gba, (gba->reg[dest].I >> (value - 1)) & 1 ? true : false);\
      value = ((gba->reg[dest].I << (32 - value)) |\
               (gba->reg[dest].I >> value));\
    }
@@ -256,8 +224,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      gba->reg[dest].I = res;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     SUBCARRY(rhs, lhs, res);\
-     SUBOVERFLOW(rhs, lhs, res);\
+     CPUDeferSubFlags(gba, rhs, lhs, res);\
    }
 #endif
 #ifndef CMP_RD_RS
@@ -268,8 +235,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
      u32 res = lhs - rhs;\
      gba->Z_FLAG = (res == 0) ? true : false;\
      gba->N_FLAG = NEG(res) ? true : false;\
-     SUBCARRY(lhs, rhs, res);\
-     SUBOVERFLOW(lhs, rhs, res);\
+     CPUDeferSubFlags(gba, lhs, rhs, res);\
    }
 #endif
 #ifndef IMM5_INSN
@@ -298,7 +264,7 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
   int shift = N;\
   LSR_RD_RM_I5;
  #define IMM5_LSR_0 \
-  gba->C_FLAG = gba->reg[source].I & 0x80000000 ? true : false;\
+  CPUSetCFlag(gba, gba->reg[source].I & 0x80000000 ? true : false);\
   value = 0;
  #define IMM5_ASR(N) \
   int shift = N;\
@@ -306,10 +272,10 @@ static INSN_REGPARM void thumbUnknownInsn(GBASystem *gba, u32 opcode)
  #define IMM5_ASR_0 \
   if(gba->reg[source].I & 0x80000000) {\
     value = 0xFFFFFFFF;\
-    gba->C_FLAG = true;\
+    CPUSetCFlag(gba, true);\
   } else {\
     value = 0;\
-    gba->C_FLAG = false;\
+    CPUSetCFlag(gba, false);\
   }
 #endif
 #ifndef THREEARG_INSN
@@ -492,12 +458,12 @@ static INSN_REGPARM void thumb40_2(GBASystem *gba, u32 opcode)
   if(value) {
     if(value == 32) {
       value = 0;
-      gba->C_FLAG = (gba->reg[dest].I & 1 ? true : false);
+      CPUSetCFlag(gba, (gba->reg[dest].I & 1 ? true : false));
     } else if(value < 32) {
       LSL_RD_RS;
     } else {
       value = 0;
-      gba->C_FLAG = false;
+      CPUSetCFlag(gba, false);
     }
     gba->reg[dest].I = value;
   }
@@ -514,12 +480,12 @@ static INSN_REGPARM void thumb40_3(GBASystem *gba, u32 opcode)
   if(value) {
     if(value == 32) {
       value = 0;
-      gba->C_FLAG = (gba->reg[dest].I & 0x80000000 ? true : false);
+      CPUSetCFlag(gba, (gba->reg[dest].I & 0x80000000 ? true : false));
     } else if(value < 32) {
       LSR_RD_RS;
     } else {
       value = 0;
-      gba->C_FLAG = false;
+      CPUSetCFlag(gba, false);
     }
     gba->reg[dest].I = value;
   }
@@ -540,10 +506,10 @@ static INSN_REGPARM void thumb41_0(GBASystem *gba, u32 opcode)
     } else {
       if(gba->reg[dest].I & 0x80000000){
         gba->reg[dest].I = 0xFFFFFFFF;
-        gba->C_FLAG = true;
+        CPUSetCFlag(gba, true);
       } else {
         gba->reg[dest].I = 0x00000000;
-        gba->C_FLAG = false;
+        CPUSetCFlag(gba, false);
       }
     }
   }
@@ -577,7 +543,7 @@ static INSN_REGPARM void thumb41_3(GBASystem *gba, u32 opcode)
   if(value) {
     value = value & 0x1f;
     if(value == 0) {
-      gba->C_FLAG = (gba->reg[dest].I & 0x80000000 ? true : false);
+      CPUSetCFlag(gba, (gba->reg[dest].I & 0x80000000 ? true : false));
     } else {
       ROR_RD_RS;
       gba->reg[dest].I = value;
@@ -1219,7 +1185,7 @@ static INSN_REGPARM void thumbD1(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbD2(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(gba->C_FLAG) {
+  if(CPUGetCFlag(gba)) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1234,7 +1200,7 @@ static INSN_REGPARM void thumbD2(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbD3(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(!gba->C_FLAG) {
+  if(!CPUGetCFlag(gba)) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1279,7 +1245,7 @@ static INSN_REGPARM void thumbD5(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbD6(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(gba->V_FLAG) {
+  if(CPUGetVFlag(gba)) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1294,7 +1260,7 @@ static INSN_REGPARM void thumbD6(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbD7(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(!gba->V_FLAG) {
+  if(!CPUGetVFlag(gba)) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1309,7 +1275,7 @@ static INSN_REGPARM void thumbD7(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbD8(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(gba->C_FLAG && !gba->Z_FLAG) {
+  if(CPUGetCFlag(gba) && !gba->Z_FLAG) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1324,7 +1290,7 @@ static INSN_REGPARM void thumbD8(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbD9(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(!gba->C_FLAG || gba->Z_FLAG) {
+  if(!CPUGetCFlag(gba) || gba->Z_FLAG) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1339,7 +1305,7 @@ static INSN_REGPARM void thumbD9(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbDA(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(gba->N_FLAG == gba->V_FLAG) {
+  if(gba->N_FLAG == CPUGetVFlag(gba)) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1354,7 +1320,7 @@ static INSN_REGPARM void thumbDA(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbDB(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(gba->N_FLAG != gba->V_FLAG) {
+  if(gba->N_FLAG != CPUGetVFlag(gba)) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1369,7 +1335,7 @@ static INSN_REGPARM void thumbDB(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbDC(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(!gba->Z_FLAG && (gba->N_FLAG == gba->V_FLAG)) {
+  if(!gba->Z_FLAG && (gba->N_FLAG == CPUGetVFlag(gba))) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1384,7 +1350,7 @@ static INSN_REGPARM void thumbDC(GBASystem *gba, u32 opcode)
 static INSN_REGPARM void thumbDD(GBASystem *gba, u32 opcode)
 {
   UPDATE_OLDREG;
-  if(gba->Z_FLAG || (gba->N_FLAG != gba->V_FLAG)) {
+  if(gba->Z_FLAG || (gba->N_FLAG != CPUGetVFlag(gba))) {
     gba->reg[15].I += ((s8)(opcode & 0xFF)) << 1;
     gba->armNextPC = gba->reg[15].I;
     gba->reg[15].I += 2;
@@ -1455,7 +1421,6 @@ static INSN_REGPARM void thumbF8(GBASystem *gba, u32 opcode)
 
 // Instruction table //////////////////////////////////////////////////////
 
-typedef INSN_REGPARM void (*insnfunc_t)(GBASystem *gba, u32 opcode);
 #define thumbUI thumbUnknownInsn
 #define thumbBP thumbUnknownInsn
 static insnfunc_t thumbInsnTable[1024] = {
@@ -1591,9 +1556,619 @@ static insnfunc_t thumbInsnTable[1024] = {
 
 // Wrapper routine (execution loop) ///////////////////////////////////////
 
+static insnfunc_t thumbDecode(u32 opcode, bool &jump)
+{
+  jump = (opcode & 0xF800) == 0xE000 || // B
+         (opcode & 0xFF00) == 0x4700 || // BX
+         (opcode & 0xFF00) == 0xBD00 || // POP {..., PC}
+         (opcode & 0xF800) == 0xF800 || // BL
+         (opcode & 0xFF00) == 0xDF00;   // SWI
+  return thumbInsnTable[opcode>>6];
+}
+
+#ifdef THREADED_DISPATCH
+// The instructions that the threaded block executor runs itself, in the
+// order of its labels. The other ones are called as usual (THUMB_CALL).
+enum {
+  THUMB_CALL,
+  THUMB_LSL_IMM, THUMB_LSR_IMM, THUMB_ASR_IMM,
+  THUMB_ADD_REG, THUMB_SUB_REG, THUMB_ADD_IMM3, THUMB_SUB_IMM3,
+  THUMB_MOV_IMM, THUMB_CMP_IMM, THUMB_ADD_IMM, THUMB_SUB_IMM,
+  THUMB_AND, THUMB_EOR, THUMB_LSL, THUMB_LSR, THUMB_ASR, THUMB_ADC, THUMB_SBC, THUMB_ROR,
+  THUMB_TST, THUMB_NEG, THUMB_CMP, THUMB_CMN, THUMB_ORR, THUMB_MUL, THUMB_BIC, THUMB_MVN,
+  THUMB_ADD_PC, THUMB_ADD_SP, THUMB_ADD_SP_IMM,
+  THUMB_BCOND
+};
+
+static int thumbThreadedInsn(u32 opcode)
+{
+  switch (opcode >> 11) {
+  case 0x00: return THUMB_LSL_IMM;
+  case 0x01: return THUMB_LSR_IMM;
+  case 0x02: return THUMB_ASR_IMM;
+  case 0x03: return THUMB_ADD_REG + ((opcode >> 9) & 3);
+  case 0x04: return THUMB_MOV_IMM;
+  case 0x05: return THUMB_CMP_IMM;
+  case 0x06: return THUMB_ADD_IMM;
+  case 0x07: return THUMB_SUB_IMM;
+  case 0x08: return (opcode & 0x0400) ? (int)THUMB_CALL : THUMB_AND + ((opcode >> 6) & 15);
+  case 0x14: return THUMB_ADD_PC;
+  case 0x15: return THUMB_ADD_SP;
+  case 0x16: return (opcode & 0xFF00) == 0xB000 ? THUMB_ADD_SP_IMM : THUMB_CALL;
+  case 0x1A:
+  case 0x1B: return ((opcode >> 8) & 15) < 14 ? THUMB_BCOND : THUMB_CALL;
+  default:   return THUMB_CALL;
+  }
+}
+
+// Runs the instructions of a block that starts at armNextPC, as the loop
+// below does, by jumping to a label for each of them. The ALU instructions
+// and the conditional branches that are not taken run at their labels, with
+// the PC, the ticks and the flags in locals. Those are stored for the other
+// instructions, which are called at the label "call", and when the block is
+// left.
+static int thumbInterpretBlock(GBASystem *gba, CodeBlock *block)
+{
+  static const void *const labels[] = {
+    &&call,
+    &&lsl_imm, &&lsr_imm, &&asr_imm,
+    &&add_reg, &&sub_reg, &&add_imm3, &&sub_imm3,
+    &&mov_imm, &&cmp_imm, &&add_imm, &&sub_imm,
+    &&and_, &&eor, &&lsl, &&lsr, &&asr, &&adc, &&sbc, &&ror,
+    &&tst, &&neg, &&cmp, &&cmn, &&orr, &&call, &&bic, &&mvn,
+    &&add_pc, &&add_sp, &&add_sp_imm,
+    &&bcond,
+  };
+  if (!block->labelled) {
+    for (int k = 0; k < block->count; k++)
+      block->insns[k].label = (u8)thumbThreadedInsn(block->insns[k].opcode);
+    block->labelled = true;
+  }
+
+  u32 pc = block->address; // of the instruction i
+  int ticks = gba->cpuTotalTicks;
+  int nextEvent = gba->cpuNextEvent;
+  int clockTicks = 0;
+  bool N = false, Z = false, C = false, V = false;
+  bool flags = false; // whether they are in the locals
+#ifdef GSFOPT
+  int covered = block->covered;
+#endif
+  int i = 0;
+  u32 opcode;
+
+next:
+  opcode = block->insns[i].opcode;
+  gba->busPrefetch = false;
+  if (gba->busPrefetchCount & 0xFFFFFF00)
+    gba->busPrefetchCount = 0x100 | (gba->busPrefetchCount & 0xFF);
+  goto *labels[block->insns[i].label];
+
+  // LSL Rd, Rm, #Imm 5
+lsl_imm: {
+    CPU_THREADED_FLAGS(gba)
+    u32 source = gba->reg[(opcode >> 3) & 7].I;
+    int shift = (opcode >> 6) & 31;
+    u32 value = source;
+    if (shift) {
+      C = (source >> (32 - shift)) & 1;
+      value = source << shift;
+    }
+    gba->reg[opcode & 7].I = value;
+    N = value >> 31;
+    Z = value == 0;
+  }
+  goto sequential;
+
+  // LSR Rd, Rm, #Imm 5
+lsr_imm: {
+    CPU_THREADED_FLAGS(gba)
+    u32 source = gba->reg[(opcode >> 3) & 7].I;
+    int shift = (opcode >> 6) & 31;
+    u32 value = 0;
+    if (shift) {
+      C = (source >> (shift - 1)) & 1;
+      value = source >> shift;
+    } else {
+      C = source >> 31;
+    }
+    gba->reg[opcode & 7].I = value;
+    N = value >> 31;
+    Z = value == 0;
+  }
+  goto sequential;
+
+  // ASR Rd, Rm, #Imm 5
+asr_imm: {
+    CPU_THREADED_FLAGS(gba)
+    s32 source = (s32)gba->reg[(opcode >> 3) & 7].I;
+    int shift = (opcode >> 6) & 31;
+    u32 value;
+    if (shift) {
+      C = (source >> (shift - 1)) & 1;
+      value = source >> shift;
+    } else {
+      C = source < 0;
+      value = source < 0 ? 0xFFFFFFFF : 0;
+    }
+    gba->reg[opcode & 7].I = value;
+    N = value >> 31;
+    Z = value == 0;
+  }
+  goto sequential;
+
+  // ADD Rd, Rs, Rn
+add_reg: {
+    u32 lhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 rhs = gba->reg[(opcode >> 6) & 7].I;
+    u32 res = lhs + rhs;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUAddCFlag(lhs, rhs, res);
+    V = CPUAddVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // SUB Rd, Rs, Rn
+sub_reg: {
+    u32 lhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 rhs = gba->reg[(opcode >> 6) & 7].I;
+    u32 res = lhs - rhs;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUSubCFlag(lhs, rhs, res);
+    V = CPUSubVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // ADD Rd, Rs, #Offset3
+add_imm3: {
+    u32 lhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 rhs = (opcode >> 6) & 7;
+    u32 res = lhs + rhs;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUAddCFlag(lhs, rhs, res);
+    V = CPUAddVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // SUB Rd, Rs, #Offset3
+sub_imm3: {
+    u32 lhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 rhs = (opcode >> 6) & 7;
+    u32 res = lhs - rhs;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUSubCFlag(lhs, rhs, res);
+    V = CPUSubVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // MOV Rn, #Offset8
+mov_imm:
+  CPU_THREADED_FLAGS(gba)
+  gba->reg[(opcode >> 8) & 7].I = opcode & 255;
+  N = false;
+  Z = (opcode & 255) == 0;
+  goto sequential;
+
+  // CMP Rn, #Offset8
+cmp_imm: {
+    u32 lhs = gba->reg[(opcode >> 8) & 7].I;
+    u32 rhs = opcode & 255;
+    u32 res = lhs - rhs;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUSubCFlag(lhs, rhs, res);
+    V = CPUSubVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // ADD Rn, #Offset8
+add_imm: {
+    u32 lhs = gba->reg[(opcode >> 8) & 7].I;
+    u32 rhs = opcode & 255;
+    u32 res = lhs + rhs;
+    gba->reg[(opcode >> 8) & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUAddCFlag(lhs, rhs, res);
+    V = CPUAddVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // SUB Rn, #Offset8
+sub_imm: {
+    u32 lhs = gba->reg[(opcode >> 8) & 7].I;
+    u32 rhs = opcode & 255;
+    u32 res = lhs - rhs;
+    gba->reg[(opcode >> 8) & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUSubCFlag(lhs, rhs, res);
+    V = CPUSubVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // AND Rd, Rs
+and_: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I & gba->reg[(opcode >> 3) & 7].I;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+  }
+  goto sequential;
+
+  // EOR Rd, Rs
+eor: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I ^ gba->reg[(opcode >> 3) & 7].I;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+  }
+  goto sequential;
+
+  // LSL Rd, Rs
+lsl: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I;
+    u32 shift = gba->reg[(opcode >> 3) & 7].B.B0;
+    if (shift) {
+      if (shift < 32)
+        C = (res >> (32 - shift)) & 1;
+      else
+        C = shift == 32 && (res & 1);
+      res = shift < 32 ? res << shift : 0;
+      gba->reg[opcode & 7].I = res;
+    }
+    N = res >> 31;
+    Z = res == 0;
+  }
+  clockTicks = codeTicksAccess16(gba, pc + 2) + 2;
+  goto counted;
+
+  // LSR Rd, Rs
+lsr: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I;
+    u32 shift = gba->reg[(opcode >> 3) & 7].B.B0;
+    if (shift) {
+      if (shift < 32)
+        C = (res >> (shift - 1)) & 1;
+      else
+        C = shift == 32 && (res >> 31);
+      res = shift < 32 ? res >> shift : 0;
+      gba->reg[opcode & 7].I = res;
+    }
+    N = res >> 31;
+    Z = res == 0;
+  }
+  clockTicks = codeTicksAccess16(gba, pc + 2) + 2;
+  goto counted;
+
+  // ASR Rd, Rs
+asr: {
+    CPU_THREADED_FLAGS(gba)
+    s32 res = (s32)gba->reg[opcode & 7].I;
+    u32 shift = gba->reg[(opcode >> 3) & 7].B.B0;
+    if (shift) {
+      if (shift < 32) {
+        C = (res >> (shift - 1)) & 1;
+        res >>= shift;
+      } else {
+        C = res < 0;
+        res = res < 0 ? -1 : 0;
+      }
+      gba->reg[opcode & 7].I = (u32)res;
+    }
+    N = res < 0;
+    Z = res == 0;
+  }
+  clockTicks = codeTicksAccess16(gba, pc + 2) + 2;
+  goto counted;
+
+  // ADC Rd, Rs
+adc: {
+    CPU_THREADED_FLAGS(gba)
+    u32 lhs = gba->reg[opcode & 7].I;
+    u32 rhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 res = lhs + rhs + (u32)C;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUAddCFlag(lhs, rhs, res);
+    V = CPUAddVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // SBC Rd, Rs
+sbc: {
+    CPU_THREADED_FLAGS(gba)
+    u32 lhs = gba->reg[opcode & 7].I;
+    u32 rhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 res = lhs - rhs - !C;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUSubCFlag(lhs, rhs, res);
+    V = CPUSubVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // ROR Rd, Rs
+ror: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I;
+    u32 shift = gba->reg[(opcode >> 3) & 7].B.B0;
+    if (shift) {
+      shift &= 0x1f;
+      if (shift) {
+        C = (res >> (shift - 1)) & 1;
+        res = (res << (32 - shift)) | (res >> shift);
+        gba->reg[opcode & 7].I = res;
+      } else {
+        C = res >> 31;
+      }
+    }
+    N = res >> 31;
+    Z = res == 0;
+  }
+  clockTicks = codeTicksAccess16(gba, pc + 2) + 2;
+  goto counted;
+
+  // TST Rd, Rs
+tst: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I & gba->reg[(opcode >> 3) & 7].I;
+    N = res >> 31;
+    Z = res == 0;
+  }
+  goto sequential;
+
+  // NEG Rd, Rs
+neg: {
+    u32 rhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 res = 0 - rhs;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUSubCFlag(0, rhs, res);
+    V = CPUSubVFlag(0, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // CMP Rd, Rs
+cmp: {
+    u32 lhs = gba->reg[opcode & 7].I;
+    u32 rhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 res = lhs - rhs;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUSubCFlag(lhs, rhs, res);
+    V = CPUSubVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // CMN Rd, Rs
+cmn: {
+    u32 lhs = gba->reg[opcode & 7].I;
+    u32 rhs = gba->reg[(opcode >> 3) & 7].I;
+    u32 res = lhs + rhs;
+    N = res >> 31;
+    Z = res == 0;
+    C = CPUAddCFlag(lhs, rhs, res);
+    V = CPUAddVFlag(lhs, rhs, res);
+    flags = true;
+  }
+  goto sequential;
+
+  // ORR Rd, Rs
+orr: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I | gba->reg[(opcode >> 3) & 7].I;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+  }
+  goto sequential;
+
+  // BIC Rd, Rs
+bic: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = gba->reg[opcode & 7].I & ~gba->reg[(opcode >> 3) & 7].I;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+  }
+  goto sequential;
+
+  // MVN Rd, Rs
+mvn: {
+    CPU_THREADED_FLAGS(gba)
+    u32 res = ~gba->reg[(opcode >> 3) & 7].I;
+    gba->reg[opcode & 7].I = res;
+    N = res >> 31;
+    Z = res == 0;
+  }
+  goto sequential;
+
+  // ADD Rd, PC, #Imm
+add_pc:
+  gba->reg[(opcode >> 8) & 7].I = ((pc + 4) & 0xFFFFFFFC) + ((opcode & 255) << 2);
+  goto sequential;
+
+  // ADD Rd, SP, #Imm
+add_sp:
+  gba->reg[(opcode >> 8) & 7].I = gba->reg[13].I + ((opcode & 255) << 2);
+  goto sequential;
+
+  // ADD SP, #Imm
+add_sp_imm:
+  if (opcode & 0x80)
+    gba->reg[13].I -= (opcode & 127) << 2;
+  else
+    gba->reg[13].I += (opcode & 127) << 2;
+  goto sequential;
+
+  // Bcond offset, called when it is taken
+bcond:
+  CPU_THREADED_FLAGS(gba)
+  if (CPUCheckCondition((opcode >> 8) & 15, N, Z, C, V))
+    goto call;
+  goto sequential;
+
+sequential:
+  clockTicks = codeTicksAccessSeq16(gba, pc) + 1;
+counted:
+  ticks += clockTicks;
+#ifdef GSFOPT
+  if (i >= covered) {
+    gba->cpuTotalTicks = ticks;
+    CPUMarkMemoryAsRead(gba, pc, 2);
+  }
+#endif
+  pc += 2;
+  if (++i < block->count && ticks < nextEvent)
+    goto next;
+
+  // left after the last instruction, or for an event
+  gba->armNextPC = pc;
+  gba->reg[15].I = pc + 2;
+  gba->cpuPrefetch[0] = block->insns[i].opcode;
+  gba->cpuPrefetch[1] = block->insns[i + 1].opcode;
+  gba->clockTicks = clockTicks;
+  gba->cpuTotalTicks = ticks;
+  if (flags)
+    CPUStoreFlags(gba, N, Z, C, V);
+  return 1;
+
+call:
+  gba->armNextPC = pc + 2;
+  gba->reg[15].I = pc + 4;
+  gba->cpuPrefetch[0] = block->insns[i + 1].opcode;
+  gba->cpuPrefetch[1] = block->insns[i + 2].opcode;
+  gba->cpuTotalTicks = ticks;
+  if (flags)
+    CPUStoreFlags(gba, N, Z, C, V);
+  gba->clockTicks = 0;
+
+  (*block->insns[i].handler)(gba, opcode);
+
+  if (gba->clockTicks < 0)
+    return 0;
+  if (gba->clockTicks == 0)
+    gba->clockTicks = codeTicksAccessSeq16(gba, pc) + 1;
+  gba->cpuTotalTicks += gba->clockTicks;
+
+#ifdef GSFOPT
+  if (i >= covered)
+    CPUMarkMemoryAsRead(gba, pc, 2);
+  if (CPUIsIdleLoopJump(gba, pc))
+    CPUCheckIdleLoop(gba);
+#endif
+
+  // the block is left on a jump, or after a write to its code
+  if (++i == block->count || gba->armNextPC != pc + 2 || !CPUIsCodeBlockValid(gba, block))
+    return 1;
+  if (gba->cpuTotalTicks >= gba->cpuNextEvent || gba->armState || gba->holdState || gba->SWITicks)
+    return 1;
+
+  pc += 2;
+  ticks = gba->cpuTotalTicks;
+  nextEvent = gba->cpuNextEvent;
+  flags = false;
+  goto next;
+}
+#else
+// Runs the instructions of a block that starts at armNextPC, in the same way
+// as the loop below, for as long as they are executed in sequence
+static int thumbInterpretBlock(GBASystem *gba, CodeBlock *block)
+{
+  for (int i = 0; ; ) {
+    u32 opcode = block->insns[i].opcode;
+    gba->cpuPrefetch[0] = gba->cpuPrefetch[1];
+
+    gba->busPrefetch = false;
+    if (gba->busPrefetchCount & 0xFFFFFF00)
+      gba->busPrefetchCount = 0x100 | (gba->busPrefetchCount & 0xFF);
+    gba->clockTicks = 0;
+    u32 oldArmNextPC = gba->armNextPC;
+
+    gba->armNextPC = gba->reg[15].I;
+    gba->reg[15].I += 2;
+    gba->cpuPrefetch[1] = block->insns[i + 2].opcode;
+
+    (*block->insns[i].handler)(gba, opcode);
+
+    if (gba->clockTicks < 0)
+      return 0;
+    if (gba->clockTicks==0)
+      gba->clockTicks = codeTicksAccessSeq16(gba, oldArmNextPC) + 1;
+    gba->cpuTotalTicks += gba->clockTicks;
+
+#ifdef GSFOPT
+    if (i >= block->covered)
+      CPUMarkMemoryAsRead(gba, oldArmNextPC, 2);
+    if (CPUIsIdleLoopJump(gba, oldArmNextPC))
+      CPUCheckIdleLoop(gba);
+#endif
+
+    // the block is left on a jump, or after a write to its code
+    if (++i == block->count || gba->armNextPC != oldArmNextPC + 2 || !CPUIsCodeBlockValid(gba, block))
+      return 1;
+    if (gba->cpuTotalTicks >= gba->cpuNextEvent || gba->armState || gba->holdState || gba->SWITicks)
+      return 1;
+  }
+}
+#endif
+
+// Runs a block, from its translation once it is hot
+static int thumbExecuteBlock(GBASystem *gba, CodeBlock *block)
+{
+#ifdef GSFOPT
+  while (block->covered < block->count &&
+         CPUIsMemoryMarked(gba, block->address + block->covered * 2, 2))
+    block->covered++;
+#endif
+
+#ifdef CODE_JIT
+  if (block->code == NULL && ++block->runs == CodeBlock::HOT_RUNS)
+    block->code = CPUTranslateCodeBlock(gba, block, NULL);
+  if (block->code != NULL)
+    return CPURunCodeBlock(gba, block, thumbInterpretBlock);
+#endif
+
+  return thumbInterpretBlock(gba, block);
+}
+
 int thumbExecute(GBASystem *gba)
 {
   do {
+    CodeBlock *block = CPUGetCodeBlock(gba, true, thumbDecode);
+    if (block != NULL) {
+      if (!thumbExecuteBlock(gba, block))
+        return 0;
+      continue;
+    }
+
     //if ((armNextPC & 0x0803FFFF) == 0x08020000)
     //    gba->busPrefetchCount=0x100;
 
@@ -1620,6 +2195,8 @@ int thumbExecute(GBASystem *gba)
 
 #ifdef GSFOPT
     CPUMarkMemoryAsRead(gba, oldArmNextPC, 2);
+    if (CPUIsIdleLoopJump(gba, oldArmNextPC))
+      CPUCheckIdleLoop(gba);
 #endif
 
   } while (gba->cpuTotalTicks < gba->cpuNextEvent && !gba->armState && !gba->holdState && !gba->SWITicks);
@@ -17,6 +17,9 @@ GBASystem::GBASystem()
     C_FLAG = false;
     Z_FLAG = false;
     V_FLAG = false;
+    cFlagOp = FLAG_OP_NONE;
+    vFlagOp = FLAG_OP_NONE;
+    flagLhs = flagRhs = flagRes = 0;
     armState = true;
     armIrqEnable = true;
     armNextPC = 0x00000000;
@@ -49,6 +52,16 @@ GBASystem::GBASystem()
     oam = 0;
     ioMem = 0;
 
+    codeBlocks = 0;
+#ifdef CODE_JIT
+    codeBuffer = 0;
+    codeBufferUsed = 0;
+#endif
+    for (int i = 0; i < CODE_PAGE_COUNT; i++)
+      codePageUsed[i] = false;
+    for (int i = 0; i <= CODE_PAGE_COUNT; i++)
+      codePageVersion[i] = 0;
+
     customBackdropColor = -1;
 
     DISPCNT  = 0x0080;
@@ -134,7 +147,7 @@ GBASystem::GBASystem()
     eepromInUse = 0;
 
     SWITicks = 0;
-    IRQTicks = 0;
+    irqTime = 0;
 
     mastercode = 0;
     layerEnableDelay = 0;
@@ -155,33 +168,43 @@ GBASystem::GBASystem()
     stopState = false;
     holdState = false;
     holdType = 0;
+    intrWaiting = false;
+    intrWaitFlags = 0;
+    intrWaitPC = 0;
     cpuSramEnabled = true;
     cpuFlashEnabled = true;
     cpuEEPROMEnabled = true;
     cpuEEPROMSensorEnabled = false;
 
     cpuTotalTicks = 0;
+    cpuElapsedTicks = 0;
+    cpuEventPasses = 0;
 
-    lcdTicks = (useBios && !skipBios) ? 1008 : 208;
+    lcdTime = (useBios && !skipBios) ? 1008 : 208;
+    lcdEvent = lcdTime;
     timerOnOffDelay = 0;
     timer0Value = 0;
     timer0On = false;
-    timer0Ticks = 0;
+    timer0Time = 0;
+    timer0Pass = 0;
     timer0Reload = 0;
     timer0ClockReload  = 0;
     timer1Value = 0;
     timer1On = false;
-    timer1Ticks = 0;
+    timer1Time = 0;
+    timer1Pass = 0;
     timer1Reload = 0;
     timer1ClockReload  = 0;
     timer2Value = 0;
     timer2On = false;
-    timer2Ticks = 0;
+    timer2Time = 0;
+    timer2Pass = 0;
     timer2Reload = 0;
     timer2ClockReload  = 0;
     timer3Value = 0;
     timer3On = false;
-    timer3Ticks = 0;
+    timer3Time = 0;
+    timer3Pass = 0;
     timer3Reload = 0;
     timer3ClockReload  = 0;
     dma0Source = 0;
@@ -220,6 +243,22 @@ GBASystem::GBASystem()
     #endif
 
     romSize = 0x2000000;
+    romOpenBusStart = 0;
+
+    paletteReadWarned = false;
+    paletteWriteWarned = false;
+    vramReadWarned = false;
+    vramWriteWarned = false;
+    oamReadWarned = false;
+    oamWriteWarned = false;
+    eepromReadWarned = false;
+    eepromWriteWarned = false;
+    flashReadWarned = false;
+    rtcReadWarned = false;
+    rtcWriteWarned = false;
+    sensorXReadWarned = false;
+    sensorYReadWarned = false;
+    agbPrintWriteWarned = false;
 
     soundDeclicking = true;
 
@@ -228,10 +267,15 @@ GBASystem::GBASystem()
     soundPaused        = true;
     soundFiltering     = 0.5f;
     SOUND_CLOCK_TICKS  = SOUND_CLOCK_TICKS_;
-    soundTicks         = SOUND_CLOCK_TICKS_;
+    soundTime          = SOUND_CLOCK_TICKS_;
 
     soundVolume     = 1.0f;
     soundEnableFlag   = 0x3ff; // emulator channels enabled
+    soundSynthesis  = true;
+    soundSilenceSkipping = false;
+    soundSuspended  = false;
+    soundActive     = false;
+    soundQuietTicks = 0;
     soundFiltering_ = -1;
     soundVolume_    = -1;
 
@@ -239,8 +283,24 @@ GBASystem::GBASystem()
     stereo_buffer = 0;
 
 #ifdef GSFOPT
-    rom_refs = NULL;
+    romRefsCounted = true;
+    rom_refs_bits = NULL;
     bytes_used = 0;
+    newDataTicks = 0;
+
+    stateHashEnabled = false;
+    for (int i = 0; i < RAM_PAGE_COUNT; i++) {
+      ramPageDirty[i] = true;
+      ramPageHash[i] = 0;
+    }
+
+    memset(&idleLoopState, 0, sizeof(idleLoopState));
+    idleLoopCaptured = false;
+    idleLoopStart = 0;
+    idleLoopStartTicks = 0;
+    idleLoopTainted = true;
+    idleLoopRecording = false;
+    idleLoopMarkCount = 0;
 #endif
 }
 
@@ -437,37 +497,34 @@ const u32 myROM[] = {
 0x03007FE0
 };
 
+// Cycles from the last event boundary to the next scheduled event
 inline int CPUUpdateTicks(GBASystem * gba)
 {
-  int cpuLoopTicks = gba->lcdTicks;
+  u64 nextTime = gba->lcdEvent;
 
-  if(gba->soundTicks < cpuLoopTicks)
-    cpuLoopTicks = gba->soundTicks;
+  if(gba->soundTime < nextTime)
+    nextTime = gba->soundTime;
 
-  if(gba->timer0On && (gba->timer0Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = gba->timer0Ticks;
+  if(gba->timer0On && (gba->timer0Time < nextTime)) {
+    nextTime = gba->timer0Time;
   }
-  if(gba->timer1On && !(gba->TM1CNT & 4) && (gba->timer1Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = gba->timer1Ticks;
+  if(gba->timer1On && !(gba->TM1CNT & 4) && (gba->timer1Time < nextTime)) {
+    nextTime = gba->timer1Time;
   }
-  if(gba->timer2On && !(gba->TM2CNT & 4) && (gba->timer2Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = gba->timer2Ticks;
+  if(gba->timer2On && !(gba->TM2CNT & 4) && (gba->timer2Time < nextTime)) {
+    nextTime = gba->timer2Time;
   }
-  if(gba->timer3On && !(gba->TM3CNT & 4) && (gba->timer3Ticks < cpuLoopTicks)) {
-    cpuLoopTicks = gba->timer3Ticks;
+  if(gba->timer3On && !(gba->TM3CNT & 4) && (gba->timer3Time < nextTime)) {
+    nextTime = gba->timer3Time;
   }
 
-  if (gba->SWITicks) {
-    if (gba->SWITicks < cpuLoopTicks)
-        cpuLoopTicks = gba->SWITicks;
+  // the IRQ delay is pending until its time has come
+  if (gba->irqTime > gba->cpuElapsedTicks) {
+    if (gba->irqTime < nextTime)
+        nextTime = gba->irqTime;
   }
 
-  if (gba->IRQTicks) {
-    if (gba->IRQTicks < cpuLoopTicks)
-        cpuLoopTicks = gba->IRQTicks;
-  }
-
-  return cpuLoopTicks;
+  return CPUTicksUntil(gba, nextTime);
 }
 
 void CPUCleanUp(GBASystem * gba)
@@ -478,9 +535,11 @@ void CPUCleanUp(GBASystem * gba)
   }
 
 #ifdef GSFOPT
-  if(gba->rom_refs != NULL) {
-    free(gba->rom_refs);
-    gba->rom_refs = NULL;
+  gba->rom_refs.clear();
+
+  if(gba->rom_refs_bits != NULL) {
+    free(gba->rom_refs_bits);
+    gba->rom_refs_bits = NULL;
   }
 #endif
 
@@ -518,89 +577,131 @@ void CPUCleanUp(GBASystem * gba)
     free(gba->ioMem);
     gba->ioMem = NULL;
   }
-}
 
-int CPULoadRom(GBASystem *gba, const void *rom, u32 size)
-{
-  gba->romSize = 0x2000000;
-  if(gba->rom != NULL) {
-    CPUCleanUp(gba);
+  if(gba->codeBlocks != NULL) {
+    free(gba->codeBlocks);
+    gba->codeBlocks = NULL;
   }
 
+#ifdef CODE_JIT
+  CPUFreeCodeBuffer(gba);
+#endif
+}
+
+static bool CPUAllocateMemory(GBASystem *gba)
+{
   gba->rom = (u8 *)malloc(0x2000000);
   if(gba->rom == NULL) {
-    return 0;
+    return false;
   }
   gba->workRAM = (u8 *)calloc(1, 0x40000);
   if(gba->workRAM == NULL) {
-    return 0;
+    return false;
   }
 
 #ifdef GSFOPT
-  if (gba->cpuIsMultiBoot)
-  {
-    gba->rom_refs = (u8 *)malloc(0x40000);
-  }
-  else
-  {
-    gba->rom_refs = (u8 *)malloc(0x2000000);
+  // large enough for either mode, CPUReset clears the part in use
+  gba->rom_refs_bits = (u8 *)malloc(0x2000000 / 8);
+  if(gba->rom_refs_bits == NULL) {
+    return false;
   }
 #endif
 
-  if (gba->cpuIsMultiBoot)
-  {
-      if ( size > 0x40000 ) size = 0x40000;
-      memcpy( gba->workRAM, rom, size );
-      gba->romSize = size;
-  }
-  else
-  {
-      if ( size > 0x2000000 ) size = 0x2000000;
-      memcpy( gba->rom, rom, size );
-      gba->romSize = size;
-  }
-
-  u16 *temp = (u16 *)(gba->rom+((gba->romSize+1)&~1));
-  int i;
-  for(i = (gba->romSize+1)&~1; i < 0x2000000; i+=2) {
-    WRITE16LE(temp, (i >> 1) & 0xFFFF);
-    temp++;
-  }
-
   gba->bios = (u8 *)calloc(1,0x4000);
   if(gba->bios == NULL) {
-    CPUCleanUp(gba);
-    return 0;
+    return false;
   }
   gba->internalRAM = (u8 *)calloc(1,0x8000);
   if(gba->internalRAM == NULL) {
-    CPUCleanUp(gba);
-    return 0;
+    return false;
   }
   gba->paletteRAM = (u8 *)calloc(1,0x400);
   if(gba->paletteRAM == NULL) {
-    CPUCleanUp(gba);
-    return 0;
+    return false;
   }
   gba->vram = (u8 *)calloc(1, 0x20000);
   if(gba->vram == NULL) {
-    CPUCleanUp(gba);
-    return 0;
+    return false;
   }
   gba->oam = (u8 *)calloc(1, 0x400);
   if(gba->oam == NULL) {
-    CPUCleanUp(gba);
-    return 0;
+    return false;
   }
   gba->ioMem = (u8 *)calloc(1, 0x400);
   if(gba->ioMem == NULL) {
-    CPUCleanUp(gba);
-    return 0;
+    return false;
+  }
+  gba->codeBlocks = (CodeBlock *)malloc(GBASystem::CODE_BLOCK_COUNT * sizeof(CodeBlock));
+  if(gba->codeBlocks == NULL) {
+    return false;
+  }
+#ifdef CODE_JIT
+  // the blocks are interpreted without it
+  CPUAllocateCodeBuffer(gba);
+#endif
+  return true;
+}
+
+int CPULoadRom(GBASystem *gba, const void *rom, u32 size)
+{
+  // The memory is allocated by the first load and reused by the later ones
+  if(gba->rom == NULL) {
+    if(!CPUAllocateMemory(gba)) {
+      CPUCleanUp(gba);
+      return 0;
+    }
+  } else {
+    memset(gba->workRAM, 0, 0x40000);
+    memset(gba->bios, 0, 0x4000);
+    memset(gba->internalRAM, 0, 0x8000);
+    memset(gba->paletteRAM, 0, 0x400);
+    memset(gba->vram, 0, 0x20000);
+    memset(gba->oam, 0, 0x400);
+    memset(gba->ioMem, 0, 0x400);
+  }
+
+  if (gba->cpuIsMultiBoot)
+  {
+      if ( size > 0x40000 ) size = 0x40000;
+      memcpy( gba->workRAM, rom, size );
+      gba->romSize = size;
+
+      // no cartridge, the ROM space below romSize reads as zero
+      memset( gba->rom, 0, (size + 1) & ~1 );
+  }
+  else
+  {
+      if ( size > 0x2000000 ) size = 0x2000000;
+      memcpy( gba->rom, rom, size );
+      gba->romSize = size;
+
+      // pad the last halfword of an odd sized image
+      if ( size & 1 ) gba->rom[size] = 0;
   }
 
+  // Only the image is written, the open bus pattern past its end is not
+  // filled in, so that the load time does not depend on the 32 MB space
+  gba->romOpenBusStart = (gba->romSize + 1) & ~1;
+
+  CPUFlushCodeCache(gba);
   return gba->romSize;
 }
 
+// Makes the ROM buffer hold the ROM space up to size, so that it can be
+// patched beyond the loaded image. The new area keeps reading as open bus.
+void CPUExpandRom(GBASystem *gba, u32 size)
+{
+  u32 end = (size > 0x2000000) ? 0x2000000 : ((size + 1) & ~1);
+  if(end <= gba->romOpenBusStart)
+    return;
+
+  u32 i;
+  for(i = gba->romOpenBusStart; i < end; i++) {
+    gba->rom[i] = CPUReadRomOpenBusByte(gba, i);
+  }
+  gba->romOpenBusStart = end;
+}
+
 void doMirroring (GBASystem *gba, bool b)
 {
   u32 mirroredRomSize = (((gba->romSize)>>20) & 0x3F)<<20;
@@ -625,9 +726,9 @@ void CPUUpdateCPSR(GBASystem *gba)
     CPSR |= 0x80000000;
   if(gba->Z_FLAG)
     CPSR |= 0x40000000;
-  if(gba->C_FLAG)
+  if(CPUGetCFlag(gba))
     CPSR |= 0x20000000;
-  if(gba->V_FLAG)
+  if(CPUGetVFlag(gba))
     CPSR |= 0x10000000;
   if(!gba->armState)
     CPSR |= 0x00000020;
@@ -645,6 +746,7 @@ void CPUUpdateFlags(GBASystem *gba, bool breakLoop)
   gba->Z_FLAG = (CPSR & 0x40000000) ? true: false;
   gba->C_FLAG = (CPSR & 0x20000000) ? true: false;
   gba->V_FLAG = (CPSR & 0x10000000) ? true: false;
+  gba->cFlagOp = gba->vFlagOp = GBASystem::FLAG_OP_NONE;
   gba->armState = (CPSR & 0x20) ? false : true;
   gba->armIrqEnable = (CPSR & 0x80) ? false : true;
   if(breakLoop) {
@@ -679,6 +781,11 @@ void CPUSwitchMode(GBASystem *gba, int mode, bool saveState, bool breakLoop)
   //  if(armMode == mode)
   //    return;
 
+#ifdef GSFOPT
+  // the banked registers are not compared by the idle loop detector
+  CPUTaintIdleLoop(gba);
+#endif
+
   CPUUpdateCPSR(gba);
 
   switch(gba->armMode) {
@@ -822,6 +929,9 @@ void CPUSoftwareInterrupt(GBASystem *gba)
 
 void CPUSoftwareInterrupt(GBASystem *gba, int comment)
 {
+#ifdef GSFOPT
+  CPUTaintIdleLoop(gba);
+#endif
   if(gba->armState) comment >>= 16;
   if(comment == 0xfa) {
     return;
@@ -850,10 +960,10 @@ void CPUSoftwareInterrupt(GBASystem *gba, int comment)
     gba->cpuNextEvent = gba->cpuTotalTicks;
     break;
   case 0x04:
-    CPUSoftwareInterrupt(gba);
+    BIOS_IntrWait(gba);
     break;
   case 0x05:
-    CPUSoftwareInterrupt(gba);
+    BIOS_VBlankIntrWait(gba);
     break;
   case 0x06:
     CPUSoftwareInterrupt(gba);
@@ -1326,6 +1436,201 @@ void CPUCheckDMA(GBASystem *gba, int reason, int dmamask)
   }
 }
 
+#ifdef GSFOPT
+static u64 CPUHashBytes(u64 hash, const void *data, u32 size)
+{
+  const u8 *p = (const u8 *)data;
+  for(u32 i = 0; i < size; i += 8) {
+    u64 word;
+    memcpy(&word, p + i, 8);
+    hash = (hash ^ word) * 0x100000001b3ULL;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+// Hash of the state that a sound driver repeats when the song loops: RAM,
+// the sound registers with wave RAM, and the timer settings. Timer counters,
+// FIFO contents and the CPU registers depend on the moment the state is
+// taken in, not on the song position, so they are left out.
+static u64 CPUHashSoundState(GBASystem *gba)
+{
+  for(int i = 0; i < GBASystem::RAM_PAGE_COUNT; i++) {
+    if(gba->ramPageDirty[i]) {
+      const u8 *page = (i < 0x40) ? &gba->workRAM[i << 12] : &gba->internalRAM[(i - 0x40) << 12];
+      gba->ramPageHash[i] = CPUHashBytes(0xcbf29ce484222325ULL, page, 0x1000);
+      gba->ramPageDirty[i] = false;
+    }
+  }
+
+  u64 hash = CPUHashBytes(0xcbf29ce484222325ULL, gba->ramPageHash, sizeof(gba->ramPageHash));
+  hash = CPUHashBytes(hash, &gba->ioMem[0x60], 0xa0 - 0x60);
+
+  u32 timers[8] = {
+    gba->TM0CNT, (u32)gba->timer0Reload, gba->TM1CNT, (u32)gba->timer1Reload,
+    gba->TM2CNT, (u32)gba->timer2Reload, gba->TM3CNT, (u32)gba->timer3Reload
+  };
+  return CPUHashBytes(hash, timers, sizeof(timers));
+}
+#endif
+
+// Moves the LCD to its next state, at lcdTime
+static void CPUStepLcd(GBASystem *gba)
+{
+  if(gba->DISPSTAT & 1) { // V-BLANK
+    // if in V-Blank mode, keep computing...
+    if(gba->DISPSTAT & 2) {
+      gba->lcdTime += 1008;
+      gba->VCOUNT++;
+      UPDATE_REG(0x06, gba->VCOUNT);
+      gba->DISPSTAT &= 0xFFFD;
+      UPDATE_REG(0x04, gba->DISPSTAT);
+      CPUCompareVCOUNT(gba);
+    } else {
+      gba->lcdTime += 224;
+      gba->DISPSTAT |= 2;
+      UPDATE_REG(0x04, gba->DISPSTAT);
+      if(gba->DISPSTAT & 16) {
+        gba->IF |= 2;
+        UPDATE_REG(0x202, gba->IF);
+      }
+    }
+
+    if(gba->VCOUNT >= 228) { //Reaching last line
+      gba->DISPSTAT &= 0xFFFC;
+      UPDATE_REG(0x04, gba->DISPSTAT);
+      gba->VCOUNT = 0;
+      UPDATE_REG(0x06, gba->VCOUNT);
+      CPUCompareVCOUNT(gba);
+    }
+  } else {
+    if(gba->DISPSTAT & 2) {
+      // if in H-Blank, leave it and move to drawing mode
+      gba->VCOUNT++;
+      UPDATE_REG(0x06, gba->VCOUNT);
+
+      gba->lcdTime += 1008;
+      gba->DISPSTAT &= 0xFFFD;
+      if(gba->VCOUNT == 160) {
+        gba->count++;
+        if(gba->count == 60) {
+          gba->count = 0;
+        }
+
+        gba->DISPSTAT |= 1;
+        gba->DISPSTAT &= 0xFFFD;
+        UPDATE_REG(0x04, gba->DISPSTAT);
+        if(gba->DISPSTAT & 0x0008) {
+          gba->IF |= 1;
+          UPDATE_REG(0x202, gba->IF);
+        }
+        CPUCheckDMA(gba, 1, 0x0f);
+        gba->frameCount++;
+#ifdef GSFOPT
+        if(gba->stateHashEnabled)
+        {
+          GBASystem::StateHash entry = { CPUGetTicks(gba), CPUHashSoundState(gba) };
+          gba->stateHashes.push_back(entry);
+        }
+#endif
+      }
+
+      UPDATE_REG(0x04, gba->DISPSTAT);
+      CPUCompareVCOUNT(gba);
+
+    } else {
+      // entering H-Blank
+      gba->DISPSTAT |= 2;
+      UPDATE_REG(0x04, gba->DISPSTAT);
+      gba->lcdTime += 224;
+      CPUCheckDMA(gba, 2, 0x0f);
+      if(gba->DISPSTAT & 16) {
+        gba->IF |= 2;
+        UPDATE_REG(0x202, gba->IF);
+      }
+    }
+  }
+}
+
+// Brings VCOUNT and DISPSTAT up to the current cycle. The changes in between
+// have no effect, the ones that do are handled as events (see CPUScheduleLcd).
+static void CPUUpdateLcd(GBASystem *gba)
+{
+  u64 now = CPUGetTicks(gba);
+  while(gba->lcdTime <= now)
+    CPUStepLcd(gba);
+}
+
+// Start of the first line numbered target, from the line that starts at lineTime
+static inline u64 CPULcdLineTime(u64 lineTime, int line, int target)
+{
+  return lineTime + (u64)((target - line + 228) % 228) * 1232;
+}
+
+// Finds the next change of the LCD state that raises an interrupt flag,
+// starts a DMA or records a state hash, and makes it the LCD event.
+// The LCD must be up to date.
+static void CPUScheduleLcd(GBASystem *gba)
+{
+  // the next line starts after the current H-Blank
+  bool hblank = (gba->DISPSTAT & 2) != 0;
+  u64 lineTime = hblank ? gba->lcdTime : gba->lcdTime + 224;
+  int line = (gba->VCOUNT + 1) % 228;
+  int hblankLine = hblank ? line : gba->VCOUNT;
+  u64 hblankTime = hblank ? gba->lcdTime + 1008 : gba->lcdTime;
+  u64 eventTime = ~(u64)0;
+
+  if(gba->DISPSTAT & 16) {
+    eventTime = hblankTime;
+  } else if(((gba->DM0CNT_H & 0xB000) == 0xA000) || ((gba->DM1CNT_H & 0xB000) == 0xA000) ||
+            ((gba->DM2CNT_H & 0xB000) == 0xA000) || ((gba->DM3CNT_H & 0xB000) == 0xA000)) {
+    // H-Blank DMAs only start outside of the V-Blank
+    eventTime = (hblankLine < 160) ? hblankTime : CPULcdLineTime(lineTime, line, 0) + 1008;
+  }
+
+  bool vblankEvent = (gba->DISPSTAT & 8) ||
+    ((gba->DM0CNT_H & 0xB000) == 0x9000) || ((gba->DM1CNT_H & 0xB000) == 0x9000) ||
+    ((gba->DM2CNT_H & 0xB000) == 0x9000) || ((gba->DM3CNT_H & 0xB000) == 0x9000);
+#ifdef GSFOPT
+  vblankEvent = vblankEvent || gba->stateHashEnabled;
+#endif
+  if(vblankEvent) {
+    u64 vblankTime = CPULcdLineTime(lineTime, line, 160);
+    if(vblankTime < eventTime)
+      eventTime = vblankTime;
+  }
+
+  // VCOUNT is compared as 228 right before it returns to 0
+  int lyc = gba->DISPSTAT >> 8;
+  if((gba->DISPSTAT & 0x20) && lyc <= 228) {
+    u64 matchTime = CPULcdLineTime(lineTime, line, lyc % 228);
+    if(matchTime < eventTime)
+      eventTime = matchTime;
+  }
+
+  gba->lcdEvent = eventTime;
+}
+
+// Makes the LCD event follow the new settings, within an instruction
+static void CPURescheduleLcd(GBASystem *gba)
+{
+  CPUScheduleLcd(gba);
+  if(gba->lcdEvent < gba->cpuElapsedTicks + gba->cpuNextEvent)
+    gba->cpuNextEvent = CPUTicksUntil(gba, gba->lcdEvent);
+}
+
+// Brings VCOUNT and DISPSTAT in ioMem up to date for a read, and makes
+// the next change an event, so that a loop polling them sees it in time.
+void CPUUpdateLcdRegisters(GBASystem *gba)
+{
+  CPUUpdateLcd(gba);
+  if(gba->lcdEvent > gba->lcdTime) {
+    gba->lcdEvent = gba->lcdTime;
+    if(gba->lcdEvent < gba->cpuElapsedTicks + gba->cpuNextEvent)
+      gba->cpuNextEvent = CPUTicksUntil(gba, gba->lcdEvent);
+  }
+}
+
 void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
 {
   switch(address)
@@ -1353,13 +1658,16 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
 
       gba->windowOn = (gba->layerEnable & 0x6000) ? true : false;
       if(change && !((value & 0x80))) {
+        CPUUpdateLcd(gba);
         if(!(gba->DISPSTAT & 1)) {
-          gba->lcdTicks = 1008;
+          // the line starts over
+          gba->lcdTime = CPUGetTicks(gba) + 1008;
           //      VCOUNT = 0;
           //      UPDATE_REG(0x06, VCOUNT);
           gba->DISPSTAT &= 0xFFFC;
           UPDATE_REG(0x04, gba->DISPSTAT);
           CPUCompareVCOUNT(gba);
+          CPURescheduleLcd(gba);
         }
         //        (*renderLine)();
       }
@@ -1369,8 +1677,10 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
       break;
     }
   case 0x04:
+    CPUUpdateLcd(gba);
     gba->DISPSTAT = (value & 0xFF38) | (gba->DISPSTAT & 7);
     UPDATE_REG(0x04, gba->DISPSTAT);
+    CPURescheduleLcd(gba);
     break;
   case 0x06:
     // not writable
@@ -1589,6 +1899,8 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
     break;
   case 0xBA:
     {
+      // the LCD may have to start an H-Blank or V-Blank DMA from now on
+      CPUUpdateLcd(gba);
       bool start = ((gba->DM0CNT_H ^ value) & 0x8000) ? true : false;
       value &= 0xF7E0;
 
@@ -1600,6 +1912,7 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
         gba->dma0Dest = gba->DM0DAD_L | (gba->DM0DAD_H << 16);
         CPUCheckDMA(gba, 0, 1);
       }
+      CPURescheduleLcd(gba);
     }
     break;
   case 0xBC:
@@ -1624,6 +1937,7 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
     break;
   case 0xC6:
     {
+      CPUUpdateLcd(gba);
       bool start = ((gba->DM1CNT_H ^ value) & 0x8000) ? true : false;
       value &= 0xF7E0;
 
@@ -1635,6 +1949,7 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
         gba->dma1Dest = gba->DM1DAD_L | (gba->DM1DAD_H << 16);
         CPUCheckDMA(gba, 0, 2);
       }
+      CPURescheduleLcd(gba);
     }
     break;
   case 0xC8:
@@ -1659,6 +1974,7 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
     break;
   case 0xD2:
     {
+      CPUUpdateLcd(gba);
       bool start = ((gba->DM2CNT_H ^ value) & 0x8000) ? true : false;
 
       value &= 0xF7E0;
@@ -1672,6 +1988,7 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
 
         CPUCheckDMA(gba, 0, 4);
       }
+      CPURescheduleLcd(gba);
     }
     break;
   case 0xD4:
@@ -1696,6 +2013,7 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
     break;
   case 0xDE:
     {
+      CPUUpdateLcd(gba);
       bool start = ((gba->DM3CNT_H ^ value) & 0x8000) ? true : false;
 
       value &= 0xFFE0;
@@ -1708,6 +2026,7 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
         gba->dma3Dest = gba->DM3DAD_L | (gba->DM3DAD_H << 16);
         CPUCheckDMA(gba, 0, 8);
       }
+      CPURescheduleLcd(gba);
     }
     break;
   case 0x100:
@@ -1824,17 +2143,47 @@ void CPUUpdateRegister(GBASystem *gba, u32 address, u16 value)
   }
 }
 
+// Writes TMxD of the timers that have counted since the last time, as of the
+// last event boundary. The 16-bit reads compute the counters by themselves.
+void CPUUpdateTimerRegisters(GBASystem *gba)
+{
+  if(gba->timer0On && gba->timer0Pass != gba->cpuEventPasses) {
+    gba->TM0D = 0xFFFF - (CPUTicksUntil(gba, gba->timer0Time) >> gba->timer0ClockReload);
+    UPDATE_REG(0x100, gba->TM0D);
+    gba->timer0Pass = gba->cpuEventPasses;
+  }
+  if(gba->timer1On && !(gba->TM1CNT & 4) && gba->timer1Pass != gba->cpuEventPasses) {
+    gba->TM1D = 0xFFFF - (CPUTicksUntil(gba, gba->timer1Time) >> gba->timer1ClockReload);
+    UPDATE_REG(0x104, gba->TM1D);
+    gba->timer1Pass = gba->cpuEventPasses;
+  }
+  if(gba->timer2On && !(gba->TM2CNT & 4) && gba->timer2Pass != gba->cpuEventPasses) {
+    gba->TM2D = 0xFFFF - (CPUTicksUntil(gba, gba->timer2Time) >> gba->timer2ClockReload);
+    UPDATE_REG(0x108, gba->TM2D);
+    gba->timer2Pass = gba->cpuEventPasses;
+  }
+  if(gba->timer3On && !(gba->TM3CNT & 4) && gba->timer3Pass != gba->cpuEventPasses) {
+    gba->TM3D = 0xFFFF - (CPUTicksUntil(gba, gba->timer3Time) >> gba->timer3ClockReload);
+    UPDATE_REG(0x10C, gba->TM3D);
+    gba->timer3Pass = gba->cpuEventPasses;
+  }
+}
+
 void applyTimer (GBASystem *gba)
 {
+  // the registers keep the values of the old settings until the next event
+  CPUUpdateTimerRegisters(gba);
+
   if (gba->timerOnOffDelay & 1)
   {
     gba->timer0ClockReload = TIMER_TICKS[gba->timer0Value & 3];
     if(!gba->timer0On && (gba->timer0Value & 0x80)) {
       // reload the counter
       gba->TM0D = gba->timer0Reload;
-      gba->timer0Ticks = (0x10000 - gba->TM0D) << gba->timer0ClockReload;
+      gba->timer0Time = gba->cpuElapsedTicks + ((0x10000 - gba->TM0D) << gba->timer0ClockReload);
       UPDATE_REG(0x100, gba->TM0D);
     }
+    gba->timer0Pass = gba->cpuEventPasses;
     gba->timer0On = gba->timer0Value & 0x80 ? true : false;
     gba->TM0CNT = gba->timer0Value & 0xC7;
     UPDATE_REG(0x102, gba->TM0CNT);
@@ -1846,9 +2195,10 @@ void applyTimer (GBASystem *gba)
     if(!gba->timer1On && (gba->timer1Value & 0x80)) {
       // reload the counter
       gba->TM1D = gba->timer1Reload;
-      gba->timer1Ticks = (0x10000 - gba->TM1D) << gba->timer1ClockReload;
+      gba->timer1Time = gba->cpuElapsedTicks + ((0x10000 - gba->TM1D) << gba->timer1ClockReload);
       UPDATE_REG(0x104, gba->TM1D);
     }
+    gba->timer1Pass = gba->cpuEventPasses;
     gba->timer1On = gba->timer1Value & 0x80 ? true : false;
     gba->TM1CNT = gba->timer1Value & 0xC7;
     UPDATE_REG(0x106, gba->TM1CNT);
@@ -1859,9 +2209,10 @@ void applyTimer (GBASystem *gba)
     if(!gba->timer2On && (gba->timer2Value & 0x80)) {
       // reload the counter
       gba->TM2D = gba->timer2Reload;
-      gba->timer2Ticks = (0x10000 - gba->TM2D) << gba->timer2ClockReload;
+      gba->timer2Time = gba->cpuElapsedTicks + ((0x10000 - gba->TM2D) << gba->timer2ClockReload);
       UPDATE_REG(0x108, gba->TM2D);
     }
+    gba->timer2Pass = gba->cpuEventPasses;
     gba->timer2On = gba->timer2Value & 0x80 ? true : false;
     gba->TM2CNT = gba->timer2Value & 0xC7;
     UPDATE_REG(0x10A, gba->TM2CNT);
@@ -1872,9 +2223,10 @@ void applyTimer (GBASystem *gba)
     if(!gba->timer3On && (gba->timer3Value & 0x80)) {
       // reload the counter
       gba->TM3D = gba->timer3Reload;
-      gba->timer3Ticks = (0x10000 - gba->TM3D) << gba->timer3ClockReload;
+      gba->timer3Time = gba->cpuElapsedTicks + ((0x10000 - gba->TM3D) << gba->timer3ClockReload);
       UPDATE_REG(0x10C, gba->TM3D);
     }
+    gba->timer3Pass = gba->cpuEventPasses;
     gba->timer3On = gba->timer3Value & 0x80 ? true : false;
     gba->TM3CNT = gba->timer3Value & 0xC7;
     UPDATE_REG(0x10E, gba->TM3CNT);
@@ -1970,19 +2322,24 @@ void CPUReset(GBASystem *gba)
   // clean io memory
   memset(gba->ioMem, 0, 0x400);
 
+  CPUFlushCodeCache(gba);
+
 #ifdef GSFOPT
   memset(gba->rom_refs_histogram, 0, sizeof(gba->rom_refs_histogram));
-  if (gba->cpuIsMultiBoot)
+  if (gba->romRefsCounted)
   {
-    memset(gba->rom_refs, 0, 0x40000);
-    gba->rom_refs_histogram[0] = 0x40000;
+    gba->rom_refs.clear();
+    gba->rom_refs_histogram[0] = CPURomRefsSize(gba);
   }
   else
   {
-    memset(gba->rom_refs, 0, 0x2000000);
-	gba->rom_refs_histogram[0] = 0x2000000;
+    memset(gba->rom_refs_bits, 0, CPURomRefsSize(gba) / 8);
   }
   gba->bytes_used = 0;
+  gba->newDataTicks = 0;
+
+  CPUMarkRamDirty(gba);
+  gba->stateHashes.clear();
 #endif
 
   gba->DISPCNT  = 0x0080;
@@ -2088,6 +2445,7 @@ void CPUReset(GBASystem *gba)
   }
   gba->armState = true;
   gba->C_FLAG = gba->V_FLAG = gba->N_FLAG = gba->Z_FLAG = false;
+  gba->cFlagOp = gba->vFlagOp = GBASystem::FLAG_OP_NONE;
   UPDATE_REG(0x00, gba->DISPCNT);
   UPDATE_REG(0x06, gba->VCOUNT);
   UPDATE_REG(0x20, gba->BG2PA);
@@ -2108,27 +2466,50 @@ void CPUReset(GBASystem *gba)
   // reset internal state
   gba->holdState = false;
   gba->holdType = 0;
+  gba->intrWaiting = false;
+  gba->intrWaitFlags = 0;
+  gba->intrWaitPC = 0;
+  gba->intState = false;
+  gba->stopState = false;
+  gba->irqTime = 0;
+  gba->layerEnableDelay = 0;
+  gba->busPrefetch = false;
+  gba->busPrefetchCount = 0;
+  gba->cpuDmaTicksToUpdate = 0;
+  gba->cpuDmaCount = 0;
+  gba->cpuDmaLast = 0;
+  gba->cpuBreakLoop = false;
 
   gba->biosProtected[0] = 0x00;
   gba->biosProtected[1] = 0xf0;
   gba->biosProtected[2] = 0x29;
   gba->biosProtected[3] = 0xe1;
 
-  gba->lcdTicks = (gba->useBios && !gba->skipBios) ? 1008 : 208;
+  gba->lcdTime = (gba->useBios && !gba->skipBios) ? 1008 : 208;
+  gba->lcdEvent = gba->lcdTime;
+  gba->timerOnOffDelay = 0;
+  gba->timer0Value = 0;
   gba->timer0On = false;
-  gba->timer0Ticks = 0;
+  gba->timer0Time = 0;
+  gba->timer0Pass = 0;
   gba->timer0Reload = 0;
   gba->timer0ClockReload  = 0;
+  gba->timer1Value = 0;
   gba->timer1On = false;
-  gba->timer1Ticks = 0;
+  gba->timer1Time = 0;
+  gba->timer1Pass = 0;
   gba->timer1Reload = 0;
   gba->timer1ClockReload  = 0;
+  gba->timer2Value = 0;
   gba->timer2On = false;
-  gba->timer2Ticks = 0;
+  gba->timer2Time = 0;
+  gba->timer2Pass = 0;
   gba->timer2Reload = 0;
   gba->timer2ClockReload  = 0;
+  gba->timer3Value = 0;
   gba->timer3On = false;
-  gba->timer3Ticks = 0;
+  gba->timer3Time = 0;
+  gba->timer3Pass = 0;
   gba->timer3Reload = 0;
   gba->timer3ClockReload  = 0;
   gba->dma0Source = 0;
@@ -2142,6 +2523,8 @@ void CPUReset(GBASystem *gba)
   gba->fxOn = false;
   gba->windowOn = false;
   gba->frameCount = 0;
+  gba->cpuElapsedTicks = 0;
+  gba->cpuEventPasses = 0;
   gba->saveType = 0;
   gba->layerEnable = gba->DISPCNT & gba->layerSettings;
 
@@ -2192,6 +2575,367 @@ void CPUReset(GBASystem *gba)
   gba->SWITicks = 0;
 }
 
+static void CPUSyncState(GBASystem *gba, StateStream &state)
+{
+  // the timer counters are written to ioMem when they are read
+  if(state.saving())
+    CPUUpdateTimerRegisters(gba);
+
+  // registers
+  state.sync(gba->reg, sizeof(gba->reg));
+  // the deferred flags are stored as they would be read
+  CPUResolveFlags(gba);
+  state.sync(gba->N_FLAG);
+  state.sync(gba->C_FLAG);
+  state.sync(gba->Z_FLAG);
+  state.sync(gba->V_FLAG);
+  state.sync(gba->armState);
+  state.sync(gba->armIrqEnable);
+  state.sync(gba->armNextPC);
+  state.sync(gba->armMode);
+  state.sync(gba->cpuPrefetch, sizeof(gba->cpuPrefetch));
+
+  // memory
+  state.sync(gba->internalRAM, 0x8000);
+  state.sync(gba->workRAM, 0x40000);
+  state.sync(gba->paletteRAM, 0x400);
+  state.sync(gba->vram, 0x20000);
+  state.sync(gba->oam, 0x400);
+  state.sync(gba->ioMem, 0x400);
+
+  // io registers, in the order of GBASystem
+  state.sync(&gba->DISPCNT, (u8 *)(&gba->IME + 1) - (u8 *)&gba->DISPCNT);
+
+  // internal state
+  state.sync(gba->layerEnable);
+  state.sync(gba->eepromInUse);
+  state.sync(gba->SWITicks);
+  state.sync(gba->irqTime);
+  state.sync(gba->layerEnableDelay);
+  state.sync(gba->busPrefetch);
+  state.sync(gba->busPrefetchEnable);
+  state.sync(gba->busPrefetchCount);
+  state.sync(gba->cpuDmaTicksToUpdate);
+  state.sync(gba->cpuDmaCount);
+  state.sync(gba->cpuDmaHack);
+  state.sync(gba->cpuDmaLast);
+  state.sync(gba->dummyAddress);
+  state.sync(gba->cpuBreakLoop);
+  state.sync(gba->cpuNextEvent);
+  state.sync(gba->intState);
+  state.sync(gba->stopState);
+  state.sync(gba->holdState);
+  state.sync(gba->holdType);
+  state.sync(gba->intrWaiting);
+  state.sync(gba->intrWaitFlags);
+  state.sync(gba->intrWaitPC);
+  state.sync(gba->cpuTotalTicks);
+  state.sync(gba->cpuElapsedTicks);
+  state.sync(gba->cpuEventPasses);
+  state.sync(gba->lcdTime);
+  state.sync(gba->lcdEvent);
+  state.sync(gba->saveType);
+  state.sync(gba->biosProtected, sizeof(gba->biosProtected));
+  state.sync(gba->memoryWait, sizeof(gba->memoryWait));
+  state.sync(gba->memoryWait32, sizeof(gba->memoryWait32));
+  state.sync(gba->memoryWaitSeq, sizeof(gba->memoryWaitSeq));
+  state.sync(gba->memoryWaitSeq32, sizeof(gba->memoryWaitSeq32));
+
+  // timers
+  state.sync(gba->timerOnOffDelay);
+  state.sync(gba->timer0Value);
+  state.sync(gba->timer0On);
+  state.sync(gba->timer0Time);
+  state.sync(gba->timer0Pass);
+  state.sync(gba->timer0Reload);
+  state.sync(gba->timer0ClockReload);
+  state.sync(gba->timer1Value);
+  state.sync(gba->timer1On);
+  state.sync(gba->timer1Time);
+  state.sync(gba->timer1Pass);
+  state.sync(gba->timer1Reload);
+  state.sync(gba->timer1ClockReload);
+  state.sync(gba->timer2Value);
+  state.sync(gba->timer2On);
+  state.sync(gba->timer2Time);
+  state.sync(gba->timer2Pass);
+  state.sync(gba->timer2Reload);
+  state.sync(gba->timer2ClockReload);
+  state.sync(gba->timer3Value);
+  state.sync(gba->timer3On);
+  state.sync(gba->timer3Time);
+  state.sync(gba->timer3Pass);
+  state.sync(gba->timer3Reload);
+  state.sync(gba->timer3ClockReload);
+
+  // dma
+  state.sync(gba->dma0Source);
+  state.sync(gba->dma0Dest);
+  state.sync(gba->dma1Source);
+  state.sync(gba->dma1Dest);
+  state.sync(gba->dma2Source);
+  state.sync(gba->dma2Dest);
+  state.sync(gba->dma3Source);
+  state.sync(gba->dma3Dest);
+
+  // lcd
+  state.sync(gba->fxOn);
+  state.sync(gba->windowOn);
+  state.sync(gba->frameCount);
+
+#ifdef GSFOPT
+  if(gba->romRefsCounted) {
+    gba->rom_refs.sync(state, CPURomRefsSize(gba));
+    state.sync(gba->rom_refs_histogram, sizeof(gba->rom_refs_histogram));
+  } else {
+    state.sync(gba->rom_refs_bits, CPURomRefsSize(gba) / 8);
+  }
+  state.sync(gba->bytes_used);
+
+  if(!state.saving())
+    CPUMarkRamDirty(gba);
+#endif
+
+  // the memory and the coverage the blocks have been decoded with are gone
+  if(!state.saving())
+    CPUFlushCodeCache(gba);
+}
+
+// Saves the complete emulation state, except for the ROM and the BIOS.
+void CPUWriteState(GBASystem *gba, StateStream &state)
+{
+  bool multiBoot = gba->cpuIsMultiBoot;
+  state.sync(multiBoot);
+  state.sync(gba->romSize);
+#ifdef GSFOPT
+  bool romRefsCounted = gba->romRefsCounted;
+  state.sync(romRefsCounted);
+#endif
+
+  CPUSyncState(gba, state);
+  soundWriteState(gba, state);
+}
+
+// Restores the state saved by CPUWriteState. The same ROM must have been loaded
+// and reset already, the state does not carry the ROM contents.
+bool CPUReadState(GBASystem *gba, StateStream &state)
+{
+  bool multiBoot = false;
+  int romSize = 0;
+  state.sync(multiBoot);
+  state.sync(romSize);
+  if(!state.ok() || multiBoot != gba->cpuIsMultiBoot || romSize != gba->romSize)
+    return false;
+#ifdef GSFOPT
+  bool romRefsCounted = false;
+  state.sync(romRefsCounted);
+  if(!state.ok() || romRefsCounted != gba->romRefsCounted)
+    return false;
+#endif
+
+  CPUSyncState(gba, state);
+  if(!state.ok())
+    return false;
+
+  return soundReadState(gba, state);
+}
+
+#ifdef GSFOPT
+// Makes the next state hash rehash all of RAM
+void CPUMarkRamDirty(GBASystem *gba)
+{
+  for(int i = 0; i < GBASystem::RAM_PAGE_COUNT; i++)
+    gba->ramPageDirty[i] = true;
+}
+
+static void CPUGetIdleLoopState(GBASystem *gba, GBASystem::IdleLoopState &state)
+{
+  memset(&state, 0, sizeof(state));
+  for(int i = 0; i < 16; i++)
+    state.reg[i] = gba->reg[i].I;
+  state.armNextPC = gba->armNextPC;
+  state.cpuPrefetch[0] = gba->cpuPrefetch[0];
+  state.cpuPrefetch[1] = gba->cpuPrefetch[1];
+  state.busPrefetchCount = gba->busPrefetchCount;
+  state.armMode = gba->armMode;
+  state.N_FLAG = gba->N_FLAG;
+  state.C_FLAG = CPUGetCFlag(gba);
+  state.Z_FLAG = gba->Z_FLAG;
+  state.V_FLAG = CPUGetVFlag(gba);
+  state.armState = gba->armState;
+  state.armIrqEnable = gba->armIrqEnable;
+  state.busPrefetch = gba->busPrefetch;
+  memcpy(state.biosProtected, gba->biosProtected, sizeof(state.biosProtected));
+}
+
+// Called after a short backward jump (see CPUIsIdleLoopJump). If the pass
+// from the previous call has come back to the same state without a side
+// effect, every following pass is the same, and the passes that end before
+// the next event are skipped. Their ROM reads are already marked, only the
+// reference counts have to be raised as if they had been emulated.
+// The state is only captured after a pass without side effects, so that
+// busy loops that write memory cost no more than a few stores per pass.
+void CPUCheckIdleLoop(GBASystem *gba)
+{
+  bool clean = !gba->idleLoopTainted && gba->idleLoopStart == gba->armNextPC &&
+    (!gba->idleLoopRecording || gba->idleLoopMarkCount <= GBASystem::IDLE_LOOP_MAX_MARKS);
+  if(!clean) {
+    gba->idleLoopCaptured = false;
+  } else {
+    GBASystem::IdleLoopState state;
+    CPUGetIdleLoopState(gba, state);
+    if(!gba->idleLoopCaptured || memcmp(&state, &gba->idleLoopState, sizeof(state)) != 0) {
+      gba->idleLoopState = state;
+      gba->idleLoopCaptured = true;
+    } else {
+      int passTicks = gba->cpuTotalTicks - gba->idleLoopStartTicks;
+      if(passTicks > 0 && gba->cpuTotalTicks < gba->cpuNextEvent) {
+        int passes = (gba->cpuNextEvent - 1 - gba->cpuTotalTicks) / passTicks;
+        if(passes > 0) {
+          // the counts saturate at 255
+          gba->idleLoopRecording = false;
+          if(gba->romRefsCounted) {
+            int replays = (passes < 255) ? passes : 255;
+            for(int pass = 0; pass < replays; pass++) {
+              for(u32 i = 0; i < gba->idleLoopMarkCount; i++)
+                CPUMarkMemoryAsRead(gba, gba->idleLoopMarks[i].address, gba->idleLoopMarks[i].size);
+            }
+          }
+          gba->cpuTotalTicks += passes * passTicks;
+        }
+      }
+    }
+  }
+
+  // the next pass starts here
+  gba->idleLoopStart = gba->armNextPC;
+  gba->idleLoopStartTicks = gba->cpuTotalTicks;
+  gba->idleLoopTainted = false;
+  gba->idleLoopRecording = gba->romRefsCounted;
+  gba->idleLoopMarkCount = 0;
+}
+
+// True if the byte at offset into the coverage tracked space has been read
+bool CPUIsRomRefd(GBASystem *gba, u32 offset)
+{
+  if (gba->romRefsCounted)
+    return gba->rom_refs[offset] != 0;
+  return ((gba->rom_refs_bits[offset >> 3] >> (offset & 7)) & 1) != 0;
+}
+#endif
+
+// Reloads the prefetched opcodes, needed when the memory they were
+// read from has been modified by something other than the CPU.
+void CPUFlushPrefetch(GBASystem *gba)
+{
+  if(gba->armState) {
+    ARM_PREFETCH;
+  } else {
+    THUMB_PREFETCH;
+  }
+}
+
+// Decodes the block at armNextPC into its slot of the cache. A block ends at
+// an opcode that always jumps, at the end of its code page, or after
+// CodeBlock::MAX_INSNS instructions. Code outside of the BIOS, RAM and ROM is
+// not cached, and NULL is returned.
+CodeBlock *CPUDecodeCodeBlock(GBASystem *gba, bool thumb, CodeDecoder decode)
+{
+  u32 address = gba->armNextPC;
+  u32 size = thumb ? 2 : 4;
+  u32 end;
+  int page;
+
+  switch(address >> 24) {
+  case 0x00:
+    if(address >= 0x4000)
+      return NULL;
+    end = 0x4000;
+    page = GBASystem::CODE_PAGE_COUNT;
+    break;
+  case 0x02:
+    page = (address & 0x3FFFF) >> GBASystem::CODE_PAGE_BITS;
+    end = (address | ((1 << GBASystem::CODE_PAGE_BITS) - 1)) + 1;
+    break;
+  case 0x03:
+    page = (0x40000 + (address & 0x7FFF)) >> GBASystem::CODE_PAGE_BITS;
+    end = (address | ((1 << GBASystem::CODE_PAGE_BITS) - 1)) + 1;
+    break;
+  case 0x08:
+  case 0x09:
+  case 0x0A:
+  case 0x0B:
+  case 0x0C:
+  case 0x0D:
+    end = 0x0E000000;
+    page = GBASystem::CODE_PAGE_COUNT;
+    break;
+  default:
+    return NULL;
+  }
+
+  // the prefetch reads two opcodes past the last instruction
+  int count = (end - address) / size - 2;
+  if(count <= 0)
+    return NULL;
+  if(count > CodeBlock::MAX_INSNS)
+    count = CodeBlock::MAX_INSNS;
+
+  CodeBlock *block = &gba->codeBlocks[(address >> 1) & (GBASystem::CODE_BLOCK_COUNT - 1)];
+  for(int i = 0; i < count + 2; i++) {
+    u32 pc = address + i * size;
+#ifdef GSFOPT
+    block->insns[i].opcode = thumb ? CPUReadHalfWordQuickNoMark(gba, pc) : CPUReadMemoryQuickNoMark(gba, pc);
+#else
+    block->insns[i].opcode = thumb ? CPUReadHalfWordQuick(gba, pc) : CPUReadMemoryQuick(gba, pc);
+#endif
+    if(i < count) {
+      bool jump = false;
+      block->insns[i].handler = decode(block->insns[i].opcode, jump);
+      if(jump)
+        count = i + 1;
+    } else {
+      block->insns[i].handler = NULL;
+    }
+  }
+
+  block->address = address;
+  block->thumb = thumb;
+  block->page = page;
+  block->version = gba->codePageVersion[page];
+  block->count = count;
+#ifdef GSFOPT
+  block->covered = 0;
+#endif
+#ifdef THREADED_DISPATCH
+  block->labelled = false;
+#endif
+#ifdef CODE_JIT
+  block->code = NULL;
+  block->runs = 0;
+#endif
+  if(page < GBASystem::CODE_PAGE_COUNT)
+    gba->codePageUsed[page] = true;
+  return block;
+}
+
+// Makes the blocks decoded from RAM invalid, needed when RAM is written
+// other than by the memory writers
+void CPUInvalidateRamCode(GBASystem *gba)
+{
+  for(int i = 0; i < GBASystem::CODE_PAGE_COUNT; i++)
+    CPUMarkCodePageWritten(gba, i);
+}
+
+// Empties the cache of decoded blocks, needed when the memory or the
+// coverage they have been decoded with has been replaced
+void CPUFlushCodeCache(GBASystem *gba)
+{
+  for(int i = 0; i < GBASystem::CODE_BLOCK_COUNT; i++)
+    gba->codeBlocks[i].address = 1;
+  CPUInvalidateRamCode(gba);
+}
+
 void CPUInterrupt(GBASystem *gba)
 {
   u32 PC = gba->reg[15].I;
@@ -2221,8 +2965,14 @@ void CPULoop(GBASystem *gba, int ticks)
   int timerOverflow = 0;
   // variable used by the CPU core
   gba->cpuTotalTicks = 0;
+#ifdef GSFOPT
+  CPUTaintIdleLoop(gba);
+#endif
 
   gba->cpuBreakLoop = false;
+  // the settings of the LCD events may have been changed from outside
+  CPUUpdateLcd(gba);
+  CPUScheduleLcd(gba);
   gba->cpuNextEvent = CPUUpdateTicks(gba);
   if(gba->cpuNextEvent > ticks)
     gba->cpuNextEvent = ticks;
@@ -2238,8 +2988,21 @@ void CPULoop(GBASystem *gba, int ticks)
           return;
       }
       clockTicks = 0;
-    } else
+    } else {
+      // the CPU waits from the current cycle, up to the next event, the
+      // end of the slice or the end of the BIOS call
       clockTicks = CPUUpdateTicks(gba);
+      if(clockTicks > gba->cpuNextEvent)
+        clockTicks = gba->cpuNextEvent;
+      clockTicks -= gba->cpuTotalTicks;
+      if(clockTicks < 0)
+        clockTicks = 0;
+      if(gba->SWITicks) {
+        if(gba->SWITicks < clockTicks)
+          clockTicks = gba->SWITicks;
+        gba->SWITicks -= clockTicks;
+      }
+    }
 
     gba->cpuTotalTicks += clockTicks;
 
@@ -2247,112 +3010,44 @@ void CPULoop(GBASystem *gba, int ticks)
     if(gba->cpuTotalTicks >= gba->cpuNextEvent) {
       int remainingTicks = gba->cpuTotalTicks - gba->cpuNextEvent;
 
-      if (gba->SWITicks)
-      {
-        gba->SWITicks-=clockTicks;
-        if (gba->SWITicks<0)
-          gba->SWITicks = 0;
-      }
-
       clockTicks = gba->cpuNextEvent;
       gba->cpuTotalTicks = 0;
       gba->cpuDmaHack = false;
+#ifdef GSFOPT
+      // the event may change what an idle loop reads
+      CPUTaintIdleLoop(gba);
+#endif
 
     updateLoop:
 
-      if (gba->IRQTicks)
-      {
-          gba->IRQTicks -= clockTicks;
-        if (gba->IRQTicks<0)
-          gba->IRQTicks = 0;
-      }
-
-      gba->lcdTicks -= clockTicks;
-
-
-      if(gba->lcdTicks <= 0) {
-        if(gba->DISPSTAT & 1) { // V-BLANK
-          // if in V-Blank mode, keep computing...
-          if(gba->DISPSTAT & 2) {
-            gba->lcdTicks += 1008;
-            gba->VCOUNT++;
-            UPDATE_REG(0x06, gba->VCOUNT);
-            gba->DISPSTAT &= 0xFFFD;
-            UPDATE_REG(0x04, gba->DISPSTAT);
-            CPUCompareVCOUNT(gba);
-          } else {
-            gba->lcdTicks += 224;
-            gba->DISPSTAT |= 2;
-            UPDATE_REG(0x04, gba->DISPSTAT);
-            if(gba->DISPSTAT & 16) {
-              gba->IF |= 2;
-              UPDATE_REG(0x202, gba->IF);
-            }
-          }
-
-          if(gba->VCOUNT >= 228) { //Reaching last line
-            gba->DISPSTAT &= 0xFFFC;
-            UPDATE_REG(0x04, gba->DISPSTAT);
-            gba->VCOUNT = 0;
-            UPDATE_REG(0x06, gba->VCOUNT);
-            CPUCompareVCOUNT(gba);
-          }
-        } else {
-          if(gba->DISPSTAT & 2) {
-            // if in H-Blank, leave it and move to drawing mode
-            gba->VCOUNT++;
-            UPDATE_REG(0x06, gba->VCOUNT);
-
-            gba->lcdTicks += 1008;
-            gba->DISPSTAT &= 0xFFFD;
-            if(gba->VCOUNT == 160) {
-              gba->count++;
-              if(gba->count == 60) {
-                gba->count = 0;
-              }
-
-              gba->DISPSTAT |= 1;
-              gba->DISPSTAT &= 0xFFFD;
-              UPDATE_REG(0x04, gba->DISPSTAT);
-              if(gba->DISPSTAT & 0x0008) {
-                gba->IF |= 1;
-                UPDATE_REG(0x202, gba->IF);
-              }
-              CPUCheckDMA(gba, 1, 0x0f);
-              gba->frameCount++;
-            }
+      gba->cpuElapsedTicks += clockTicks;
 
-            UPDATE_REG(0x04, gba->DISPSTAT);
-            CPUCompareVCOUNT(gba);
-
-          } else {
-            // entering H-Blank
-            gba->DISPSTAT |= 2;
-            UPDATE_REG(0x04, gba->DISPSTAT);
-            gba->lcdTicks += 224;
-            CPUCheckDMA(gba, 2, 0x0f);
-            if(gba->DISPSTAT & 16) {
-              gba->IF |= 2;
-              UPDATE_REG(0x202, gba->IF);
-            }
-          }
-        }
+      if(gba->lcdEvent <= gba->cpuElapsedTicks) {
+        CPUUpdateLcd(gba);
+        CPUScheduleLcd(gba);
       }
 
 	    // we shouldn't be doing sound in stop state, but we loose synchronization
       // if sound is disabled, so in stop state, soundTick will just produce
       // mute sound
-      gba->soundTicks -= clockTicks;
-      if(gba->soundTicks <= 0) {
+      if(gba->soundTime <= gba->cpuElapsedTicks) {
         psoundTickfn(gba);
-        gba->soundTicks += gba->SOUND_CLOCK_TICKS;
+        gba->soundTime += gba->SOUND_CLOCK_TICKS;
       }
 
-      if(!gba->stopState) {
+      if(gba->stopState) {
+        // the timers do not count, and keep their remaining ticks
+        gba->timer0Time += clockTicks;
+        gba->timer1Time += clockTicks;
+        gba->timer2Time += clockTicks;
+        gba->timer3Time += clockTicks;
+      } else {
+        // TMxD is brought up to date when it is read
+        gba->cpuEventPasses++;
+
         if(gba->timer0On) {
-          gba->timer0Ticks -= clockTicks;
-          if(gba->timer0Ticks <= 0) {
-            gba->timer0Ticks += (0x10000 - gba->timer0Reload) << gba->timer0ClockReload;
+          if(gba->timer0Time <= gba->cpuElapsedTicks) {
+            gba->timer0Time += (0x10000 - gba->timer0Reload) << gba->timer0ClockReload;
             timerOverflow |= 1;
             soundTimerOverflow(gba, 0);
             if(gba->TM0CNT & 0x40) {
@@ -2360,12 +3055,11 @@ void CPULoop(GBASystem *gba, int ticks)
               UPDATE_REG(0x202, gba->IF);
             }
           }
-          gba->TM0D = 0xFFFF - (gba->timer0Ticks >> gba->timer0ClockReload);
-          UPDATE_REG(0x100, gba->TM0D);
         }
 
         if(gba->timer1On) {
           if(gba->TM1CNT & 4) {
+            gba->timer1Time += clockTicks;
             if(timerOverflow & 1) {
               gba->TM1D++;
               if(gba->TM1D == 0) {
@@ -2380,9 +3074,8 @@ void CPULoop(GBASystem *gba, int ticks)
               UPDATE_REG(0x104, gba->TM1D);
             }
           } else {
-            gba->timer1Ticks -= clockTicks;
-            if(gba->timer1Ticks <= 0) {
-              gba->timer1Ticks += (0x10000 - gba->timer1Reload) << gba->timer1ClockReload;
+            if(gba->timer1Time <= gba->cpuElapsedTicks) {
+              gba->timer1Time += (0x10000 - gba->timer1Reload) << gba->timer1ClockReload;
               timerOverflow |= 2;
               soundTimerOverflow(gba, 1);
               if(gba->TM1CNT & 0x40) {
@@ -2390,13 +3083,12 @@ void CPULoop(GBASystem *gba, int ticks)
                 UPDATE_REG(0x202, gba->IF);
               }
             }
-            gba->TM1D = 0xFFFF - (gba->timer1Ticks >> gba->timer1ClockReload);
-            UPDATE_REG(0x104, gba->TM1D);
           }
         }
 
         if(gba->timer2On) {
           if(gba->TM2CNT & 4) {
+            gba->timer2Time += clockTicks;
             if(timerOverflow & 2) {
               gba->TM2D++;
               if(gba->TM2D == 0) {
@@ -2410,22 +3102,20 @@ void CPULoop(GBASystem *gba, int ticks)
               UPDATE_REG(0x108, gba->TM2D);
             }
           } else {
-            gba->timer2Ticks -= clockTicks;
-            if(gba->timer2Ticks <= 0) {
-              gba->timer2Ticks += (0x10000 - gba->timer2Reload) << gba->timer2ClockReload;
+            if(gba->timer2Time <= gba->cpuElapsedTicks) {
+              gba->timer2Time += (0x10000 - gba->timer2Reload) << gba->timer2ClockReload;
               timerOverflow |= 4;
               if(gba->TM2CNT & 0x40) {
                 gba->IF |= 0x20;
                 UPDATE_REG(0x202, gba->IF);
               }
             }
-            gba->TM2D = 0xFFFF - (gba->timer2Ticks >> gba->timer2ClockReload);
-            UPDATE_REG(0x108, gba->TM2D);
           }
         }
 
         if(gba->timer3On) {
           if(gba->TM3CNT & 4) {
+            gba->timer3Time += clockTicks;
             if(timerOverflow & 4) {
               gba->TM3D++;
               if(gba->TM3D == 0) {
@@ -2438,16 +3128,13 @@ void CPULoop(GBASystem *gba, int ticks)
               UPDATE_REG(0x10C, gba->TM3D);
             }
           } else {
-              gba->timer3Ticks -= clockTicks;
-            if(gba->timer3Ticks <= 0) {
-              gba->timer3Ticks += (0x10000 - gba->timer3Reload) << gba->timer3ClockReload;
+            if(gba->timer3Time <= gba->cpuElapsedTicks) {
+              gba->timer3Time += (0x10000 - gba->timer3Reload) << gba->timer3ClockReload;
               if(gba->TM3CNT & 0x40) {
                 gba->IF |= 0x40;
                 UPDATE_REG(0x202, gba->IF);
               }
             }
-            gba->TM3D = 0xFFFF - (gba->timer3Ticks >> gba->timer3ClockReload);
-            UPDATE_REG(0x10C, gba->TM3D);
           }
         }
       }
@@ -2479,7 +3166,7 @@ void CPULoop(GBASystem *gba, int ticks)
         if(res) {
           if (gba->intState)
           {
-            if (!gba->IRQTicks)
+            if (gba->irqTime <= gba->cpuElapsedTicks)
             {
               CPUInterrupt(gba);
               gba->intState = false;
@@ -2493,9 +3180,9 @@ void CPULoop(GBASystem *gba, int ticks)
             if (!gba->holdState)
             {
               gba->intState = true;
-              gba->IRQTicks=7;
-              if (gba->cpuNextEvent> gba->IRQTicks)
-                gba->cpuNextEvent = gba->IRQTicks;
+              gba->irqTime = gba->cpuElapsedTicks + 7;
+              if (gba->cpuNextEvent > 7)
+                gba->cpuNextEvent = 7;
             }
             else
             {
@@ -2,6 +2,8 @@
 #define GBA_H
 
 #include "../common/Types.h"
+#include "../common/StateStream.h"
+#include "../common/RomRefs.h"
 
 #include "Sound.h"
 
@@ -56,6 +58,7 @@ typedef union {
 } reg_pair;
 
 struct GBASystem;
+struct CodeBlock;
 
 class Gba_Pcm {
 public:
@@ -63,6 +66,7 @@ public:
     void apply_control( int idx );
     void update( int dac );
     void end_frame( GBA::blip_time_t );
+    void syncState( StateStream & );
 
 private:
     GBASystem* gba;
@@ -81,6 +85,7 @@ public:
     void write_control( int data );
     void write_fifo( int data );
     void timer_overflowed( int which_timer );
+    void syncState( StateStream & );
 
     // public only so save state routines can access it
     GBASystem* gba;
@@ -101,6 +106,8 @@ struct GBASoundOut
     virtual ~GBASoundOut() { }
     // Receives signed 16-bit stereo audio and a byte count
     virtual void write(const void * samples, unsigned long bytes) = 0;
+    // Receives a count of silent samples that were not synthesized
+    virtual void skip(unsigned long samples) = 0;
 };
 
 struct GBASystem
@@ -113,6 +120,14 @@ struct GBASystem
     bool C_FLAG;
     bool Z_FLAG;
     bool V_FLAG;
+    // The carry and the overflow of the last flag-setting addition or
+    // subtraction are derived from its operands only when they are read (see
+    // CPUGetCFlag in GBAcpu.h). C_FLAG and V_FLAG hold them once their op is
+    // FLAG_OP_NONE.
+    enum { FLAG_OP_NONE, FLAG_OP_ADD, FLAG_OP_SUB };
+    u8 cFlagOp;
+    u8 vFlagOp;
+    u32 flagLhs, flagRhs, flagRes;
     bool armState;
     bool armIrqEnable;
     u32 armNextPC;
@@ -232,7 +247,7 @@ struct GBASystem
     int emulating;
 
     int SWITicks;
-    int IRQTicks;
+    u64 irqTime;
 
     u32 mastercode;
     int layerEnableDelay;
@@ -255,6 +270,9 @@ struct GBASystem
     bool stopState;
     bool holdState;
     int holdType;
+    bool intrWaiting;  // halted in IntrWait, the SWI at intrWaitPC is executed again after an IRQ
+    u16 intrWaitFlags; // BIOS interrupt flags IntrWait waits for
+    u32 intrWaitPC;
     bool cpuSramEnabled;
     bool cpuFlashEnabled;
     bool cpuEEPROMEnabled;
@@ -262,28 +280,54 @@ struct GBASystem
 
     u32 cpuPrefetch[2];
 
+    // Cache of decoded basic blocks (see CodeBlock in GBAcpu.h). RAM is
+    // divided into code pages (work RAM, then internal RAM), and a write to
+    // a page that blocks have been decoded from makes them invalid. The last
+    // version is that of the code outside of RAM, which is never written.
+    enum { CODE_BLOCK_COUNT = 1024 };
+    enum { CODE_PAGE_BITS = 8, CODE_PAGE_COUNT = (0x40000 + 0x8000) >> CODE_PAGE_BITS };
+    CodeBlock *codeBlocks;
+    bool codePageUsed[CODE_PAGE_COUNT];
+    u32 codePageVersion[CODE_PAGE_COUNT + 1];
+#ifdef CODE_JIT
+    // Executable memory the hot blocks are translated into, NULL if it
+    // could not be allocated. It is emptied when it is full.
+    enum { CODE_BUFFER_SIZE = 4 << 20 };
+    u8 *codeBuffer;
+    u32 codeBufferUsed;
+#endif
+
     int cpuTotalTicks;
+    u64 cpuElapsedTicks; // cycles of the events handled since reset
+    u64 cpuEventPasses;  // event boundaries at which the timers have counted
 
-    int lcdTicks;
+    // the events are scheduled at absolute times of cpuElapsedTicks,
+    // only the ones that are due are handled at an event boundary
+    u64 lcdTime;  // next change of VCOUNT and DISPSTAT, which are updated on demand
+    u64 lcdEvent; // next change that has to be handled as an event
     u8 timerOnOffDelay;
     u16 timer0Value;
     bool timer0On;
-    int timer0Ticks;
+    u64 timer0Time;
+    u64 timer0Pass; // cpuEventPasses when TM0D was last brought up to date
     int timer0Reload;
     int timer0ClockReload;
     u16 timer1Value;
     bool timer1On;
-    int timer1Ticks;
+    u64 timer1Time;
+    u64 timer1Pass; // cpuEventPasses when TM1D was last brought up to date
     int timer1Reload;
     int timer1ClockReload;
     u16 timer2Value;
     bool timer2On;
-    int timer2Ticks;
+    u64 timer2Time;
+    u64 timer2Pass; // cpuEventPasses when TM2D was last brought up to date
     int timer2Reload;
     int timer2ClockReload;
     u16 timer3Value;
     bool timer3On;
-    int timer3Ticks;
+    u64 timer3Time;
+    u64 timer3Pass; // cpuEventPasses when TM3D was last brought up to date
     int timer3Reload;
     int timer3ClockReload;
     u32 dma0Source;
@@ -320,10 +364,29 @@ struct GBASystem
     #endif
 
     int romSize;
+    // rom holds the image below this offset, the rest of the ROM space is
+    // open bus and is synthesized by the memory readers (see GBAinline.h)
+    u32 romOpenBusStart;
 
     u8 cpuBitsSet[256];
     u8 cpuLowestBitSet[256];
 
+    // Unsupported accesses are reported only once per emulator
+    bool paletteReadWarned;
+    bool paletteWriteWarned;
+    bool vramReadWarned;
+    bool vramWriteWarned;
+    bool oamReadWarned;
+    bool oamWriteWarned;
+    bool eepromReadWarned;
+    bool eepromWriteWarned;
+    bool flashReadWarned;
+    bool rtcReadWarned;
+    bool rtcWriteWarned;
+    bool sensorXReadWarned;
+    bool sensorYReadWarned;
+    bool agbPrintWriteWarned;
+
     // Sound settings
     bool soundDeclicking;
     bool soundInterpolation; // 1 if PCM should have low-pass filtering
@@ -336,10 +399,15 @@ struct GBASystem
     enum { SOUND_CLOCK_TICKS_ = 167772 }; // 1/100 second
 
     int   SOUND_CLOCK_TICKS;
-    int   soundTicks;
+    u64   soundTime;
 
     float soundVolume;
     int soundEnableFlag;
+    bool soundSynthesis; // false runs the sound hardware without making samples, from soundReset()
+    bool soundSilenceSkipping; // suspends synthesis while the hardware can not make sound
+    bool soundSuspended;
+    bool soundActive;    // a sound may have been made during the current tick
+    int  soundQuietTicks;
     float soundFiltering_;
     float soundVolume_;
 
@@ -349,12 +417,64 @@ struct GBASystem
     GBA::Gb_Apu*        gb_apu;
     GBA::Stereo_Buffer* stereo_buffer;
 
+#ifdef GSFOPT
+    // the sound is only analyzed, not listened to
+    GBA::Blip_Synth<GBA::blip_low_quality,1> pcm_synth [3]; // 32 kHz, 16 kHz, 8 kHz
+#else
     GBA::Blip_Synth<GBA::blip_best_quality,1> pcm_synth [3]; // 32 kHz, 16 kHz, 8 kHz
+#endif
 
 #ifdef GSFOPT
-    u8 * rom_refs;
+    // ROM coverage policy. The counted policy keeps a saturating reference
+    // count per byte and a histogram of the counts, for the loop detector.
+    // Otherwise only whether a byte has been read is kept, one bit per byte.
+    bool romRefsCounted;
+    RomRefs rom_refs;
     u32 rom_refs_histogram[256];
+    u8 * rom_refs_bits;
     u32 bytes_used;
+    u64 newDataTicks; // CPUGetTicks() when bytes_used last increased
+
+    // Hash of the sound driver state taken at every V-Blank, for the state
+    // loop detector. RAM is hashed in 4 KB pages (work RAM, then internal
+    // RAM), and a page is hashed again only after it has been written.
+    enum { RAM_PAGE_COUNT = (0x40000 + 0x8000) >> 12 };
+    bool stateHashEnabled;
+    struct StateHash {
+      u64 ticks; // CPUGetTicks() at the start of the V-Blank
+      u64 hash;
+    };
+    std::vector<StateHash> stateHashes; // one per V-Blank, until the user clears it
+    bool ramPageDirty[RAM_PAGE_COUNT];
+    u64 ramPageHash[RAM_PAGE_COUNT];
+
+    // Idle loop skipping (see CPUCheckIdleLoop). A pass of a short loop that
+    // ends in the CPU state it started with, without writing anything or
+    // reading anything that changes between events, repeats itself until the
+    // next event, so the passes up to the event are skipped.
+    enum { IDLE_LOOP_MAX_SIZE = 32, IDLE_LOOP_MAX_MARKS = 16 };
+    struct IdleLoopState {
+      u32 reg[16];
+      u32 armNextPC;
+      u32 cpuPrefetch[2];
+      u32 busPrefetchCount;
+      int armMode;
+      bool N_FLAG, C_FLAG, Z_FLAG, V_FLAG;
+      bool armState, armIrqEnable, busPrefetch;
+      u8 biosProtected[4];
+    };
+    struct IdleLoopMark {
+      u32 address;
+      u32 size;
+    };
+    IdleLoopState idleLoopState; // at the start of the pass, if captured
+    bool idleLoopCaptured;
+    u32 idleLoopStart;           // armNextPC at the start of the pass
+    int idleLoopStartTicks;      // cpuTotalTicks at the start of the pass
+    bool idleLoopTainted;        // the pass can not be repeated by skipping it
+    bool idleLoopRecording;      // the pass is recorded in idleLoopMarks
+    u32 idleLoopMarkCount;
+    IdleLoopMark idleLoopMarks[IDLE_LOOP_MAX_MARKS]; // counted ROM reads of the pass
 #endif
 
     GBASystem();
@@ -364,13 +484,34 @@ extern void CPUCleanUp(GBASystem *);
 extern void CPUUpdateRender(GBASystem *);
 extern void CPUUpdateRenderBuffers(GBASystem *, bool);
 extern int CPULoadRom(GBASystem *, const void *, u32);
+extern void CPUExpandRom(GBASystem *, u32);
+#ifdef GSFOPT
+extern bool CPUIsRomRefd(GBASystem *, u32);
+extern void CPUMarkRamDirty(GBASystem *);
+extern void CPUCheckIdleLoop(GBASystem *);
+#endif
 extern void doMirroring(GBASystem *, bool);
 extern void CPUUpdateRegister(GBASystem *, u32, u16);
 extern void applyTimer (GBASystem *);
+extern void CPUUpdateTimerRegisters(GBASystem *);
+extern void CPUUpdateLcdRegisters(GBASystem *);
 extern void CPUInit(GBASystem *);
 extern void CPUReset(GBASystem *);
 extern void CPULoop(GBASystem *, int);
 extern void CPUCheckDMA(GBASystem *, int,int);
+extern void CPUWriteState(GBASystem *, StateStream &);
+extern bool CPUReadState(GBASystem *, StateStream &);
+extern void CPUFlushPrefetch(GBASystem *);
+extern void CPUFlushCodeCache(GBASystem *);
+extern void CPUInvalidateRamCode(GBASystem *);
+
+#define CPU_CLOCK_RATE 16777216
+
+// Cycles emulated since reset, up to the instruction being executed
+#define CPUGetTicks(gba) ((gba)->cpuElapsedTicks + (u64)(gba)->cpuTotalTicks)
+
+// Cycles from the last event boundary to a scheduled time, negative if overdue
+#define CPUTicksUntil(gba, time) ((int)((time) - (gba)->cpuElapsedTicks))
 
 #define R13_IRQ  18
 #define R14_IRQ  19
@@ -16,6 +16,218 @@ extern int thumbExecute(GBASystem *);
 # define UNLIKELY(x) (x)
 #endif
 
+typedef INSN_REGPARM void (*insnfunc_t)(GBASystem *, u32 opcode);
+
+// With THREADED_DISPATCH, GCC and Clang run the cached blocks by jumping to
+// labels with computed gotos (see thumbInterpretBlock and armInterpretBlock);
+// other compilers always call the handlers through the table.
+#if defined(THREADED_DISPATCH) && (!defined(__GNUC__) || defined(NO_CODE_CACHE))
+# undef THREADED_DISPATCH
+#endif
+
+struct CodeBlock;
+
+// Host code translated from a block (see CPUTranslateCodeBlock), returns
+// what the block executors return
+typedef int (*CodeBlockFunc)(GBASystem *, CodeBlock *);
+
+// A run of decoded instructions that starts at a branch target. The block is
+// run by the interpreter loop from the cached opcodes and handlers instead of
+// memory, one instruction at a time as usual, and is left as soon as the flow
+// leaves the sequence. The two opcodes after the last instruction are there
+// for the prefetch.
+struct CodeBlock
+{
+  enum { MAX_INSNS = 32 };
+
+  u32 address; // of the first instruction, odd while the slot is unused
+  bool thumb;
+  int page;    // code page (see GBASystem::codePageVersion)
+  u32 version; // of the page, when the block was decoded
+  int count;   // number of instructions
+#ifdef GSFOPT
+  int covered; // leading instructions whose ROM reads need no marking any more
+#endif
+#ifdef THREADED_DISPATCH
+  bool labelled; // whether the labels have been looked up, on the first run
+#endif
+#ifdef CODE_JIT
+  enum { HOT_RUNS = 16 };
+  CodeBlockFunc code; // translation of the block, NULL until it is hot
+  int runs;           // times the block has been run without a translation
+#endif
+  struct {
+    u32 opcode;
+#ifdef THREADED_DISPATCH
+    u8 label; // index of the label of the instruction in the block executor
+#endif
+    insnfunc_t handler;
+  } insns[MAX_INSNS + 2];
+};
+
+// Handler of an opcode, and whether the opcode always leaves the sequence
+typedef insnfunc_t (*CodeDecoder)(u32 opcode, bool &jump);
+
+extern CodeBlock *CPUDecodeCodeBlock(GBASystem *, bool thumb, CodeDecoder decode);
+
+#ifdef CODE_JIT
+// Whether the condition of an ARM opcode passes
+typedef bool (*CodeCondition)(GBASystem *, u32 opcode);
+
+extern CodeBlockFunc CPUTranslateCodeBlock(GBASystem *, CodeBlock *, CodeCondition condition);
+extern void CPUAllocateCodeBuffer(GBASystem *);
+extern void CPUFreeCodeBuffer(GBASystem *);
+
+// Runs a translated block. The lockstep build runs it with the interpreter
+// as well, and stops on a difference between the two.
+#ifdef CODE_JIT_LOCKSTEP
+extern int CPULockstepCodeBlock(GBASystem *, CodeBlock *, CodeBlockFunc interpret);
+#define CPURunCodeBlock(gba, block, interpret) CPULockstepCodeBlock(gba, block, interpret)
+#else
+#define CPURunCodeBlock(gba, block, interpret) ((block)->code(gba, block))
+#endif
+#endif
+
+#define CPUIsCodeBlockValid(gba, block) \
+  ((block)->version == (gba)->codePageVersion[(block)->page])
+
+// Block that starts at armNextPC and matches the prefetched opcodes, decoded
+// if necessary. NULL if the code there is not cached, or if the cache has
+// been left out of the build (NO_CODE_CACHE).
+static inline CodeBlock *CPUGetCodeBlock(GBASystem *gba, bool thumb, CodeDecoder decode)
+{
+#ifdef NO_CODE_CACHE
+  return NULL;
+#else
+  CodeBlock *block = &gba->codeBlocks[(gba->armNextPC >> 1) & (GBASystem::CODE_BLOCK_COUNT - 1)];
+  if (block->address != gba->armNextPC || block->thumb != thumb || !CPUIsCodeBlockValid(gba, block)) {
+    block = CPUDecodeCodeBlock(gba, thumb, decode);
+    if (block == NULL)
+      return NULL;
+  }
+
+  // the opcodes may have been prefetched before the memory was written
+  if (block->insns[0].opcode != gba->cpuPrefetch[0] || block->insns[1].opcode != gba->cpuPrefetch[1])
+    return NULL;
+  return block;
+#endif
+}
+
+// C and V of lhs + rhs (+ carry) = res, and of lhs - rhs (- borrow) = res
+static inline bool CPUAddCFlag(u32 a, u32 b, u32 c) { return ((a & b) | (a & ~c) | (b & ~c)) >> 31; }
+static inline bool CPUAddVFlag(u32 a, u32 b, u32 c) { return (~(a ^ b) & (a ^ c)) >> 31; }
+static inline bool CPUSubCFlag(u32 a, u32 b, u32 c) { return ((a & ~b) | (a & ~c) | (~b & ~c)) >> 31; }
+static inline bool CPUSubVFlag(u32 a, u32 b, u32 c) { return ((a ^ b) & (a ^ c)) >> 31; }
+
+// The carry and the overflow flags, derived from the operands of the last
+// addition or subtraction if it has set them
+static inline bool CPUGetCFlag(GBASystem *gba)
+{
+  switch (gba->cFlagOp) {
+  case GBASystem::FLAG_OP_ADD:
+    return CPUAddCFlag(gba->flagLhs, gba->flagRhs, gba->flagRes);
+  case GBASystem::FLAG_OP_SUB:
+    return CPUSubCFlag(gba->flagLhs, gba->flagRhs, gba->flagRes);
+  default:
+    return gba->C_FLAG;
+  }
+}
+
+static inline bool CPUGetVFlag(GBASystem *gba)
+{
+  switch (gba->vFlagOp) {
+  case GBASystem::FLAG_OP_ADD:
+    return CPUAddVFlag(gba->flagLhs, gba->flagRhs, gba->flagRes);
+  case GBASystem::FLAG_OP_SUB:
+    return CPUSubVFlag(gba->flagLhs, gba->flagRhs, gba->flagRes);
+  default:
+    return gba->V_FLAG;
+  }
+}
+
+static inline void CPUSetCFlag(GBASystem *gba, bool value)
+{
+  gba->C_FLAG = value;
+  gba->cFlagOp = GBASystem::FLAG_OP_NONE;
+}
+
+// C and V of lhs + rhs (+ carry) = res, computed when they are read
+static inline void CPUDeferAddFlags(GBASystem *gba, u32 lhs, u32 rhs, u32 res)
+{
+  gba->flagLhs = lhs;
+  gba->flagRhs = rhs;
+  gba->flagRes = res;
+  gba->cFlagOp = gba->vFlagOp = GBASystem::FLAG_OP_ADD;
+}
+
+// C and V of lhs - rhs (- borrow) = res, computed when they are read
+static inline void CPUDeferSubFlags(GBASystem *gba, u32 lhs, u32 rhs, u32 res)
+{
+  gba->flagLhs = lhs;
+  gba->flagRhs = rhs;
+  gba->flagRes = res;
+  gba->cFlagOp = gba->vFlagOp = GBASystem::FLAG_OP_SUB;
+}
+
+// Stores the deferred flags in C_FLAG and V_FLAG
+static inline void CPUResolveFlags(GBASystem *gba)
+{
+  gba->C_FLAG = CPUGetCFlag(gba);
+  gba->V_FLAG = CPUGetVFlag(gba);
+  gba->cFlagOp = gba->vFlagOp = GBASystem::FLAG_OP_NONE;
+}
+
+#ifdef THREADED_DISPATCH
+// The flags as the threaded block executors hold them in locals, resolved
+static inline void CPULoadFlags(GBASystem *gba, bool &N, bool &Z, bool &C, bool &V)
+{
+  N = gba->N_FLAG;
+  Z = gba->Z_FLAG;
+  C = CPUGetCFlag(gba);
+  V = CPUGetVFlag(gba);
+}
+
+static inline void CPUStoreFlags(GBASystem *gba, bool N, bool Z, bool C, bool V)
+{
+  gba->N_FLAG = N;
+  gba->Z_FLAG = Z;
+  gba->C_FLAG = C;
+  gba->V_FLAG = V;
+  gba->cFlagOp = gba->vFlagOp = GBASystem::FLAG_OP_NONE;
+}
+
+// The flags are only resolved into the locals once an instruction that runs
+// at its label needs them, and only stored back if they were
+#define CPU_THREADED_FLAGS(gba) \
+  if (!flags) {                                   \
+    CPULoadFlags(gba, N, Z, C, V);                \
+    flags = true;                                 \
+  }
+
+// Whether a condition field passes, as in armCheckCondition
+static inline bool CPUCheckCondition(int cond, bool N, bool Z, bool C, bool V)
+{
+  switch (cond) {
+  case 0x00: return Z;             // EQ
+  case 0x01: return !Z;            // NE
+  case 0x02: return C;             // CS
+  case 0x03: return !C;            // CC
+  case 0x04: return N;             // MI
+  case 0x05: return !N;            // PL
+  case 0x06: return V;             // VS
+  case 0x07: return !V;            // VC
+  case 0x08: return C && !Z;       // HI
+  case 0x09: return !C || Z;       // LS
+  case 0x0A: return N == V;        // GE
+  case 0x0B: return N != V;        // LT
+  case 0x0C: return !Z && N == V;  // GT
+  case 0x0D: return Z || N != V;   // LE
+  case 0x0E: return true;          // AL
+  default:   return false;
+  }
+}
+#endif
+
 #define UPDATE_REG(address, value)\
   {\
     WRITE16LE(((u16 *)&gba->ioMem[address]),value);\
@@ -8,13 +8,6 @@
 #include <stdio.h>
 #include <stdarg.h>
 
-static bool g_paletteReadWarned = false;
-static bool g_paletteWriteWarned = false;
-static bool g_vramReadWarned = false;
-static bool g_vramWriteWarned = false;
-static bool g_oamReadWarned = false;
-static bool g_oamWriteWarned = false;
-
 inline void trace(bool & warned, const char * format, ...) {
   if (warned)
     return;
@@ -29,116 +22,249 @@ inline void trace(bool & warned, const char * format, ...) {
   warned = true;
 }
 
-inline int eepromRead(u32 address) {
-  static bool warned = false;
-  trace(warned, "FATAL: EEPROM read from 0x%08X", address);
+inline int eepromRead(GBASystem *gba, u32 address) {
+  trace(gba->eepromReadWarned, "FATAL: EEPROM read from 0x%08X", address);
   return 0;
 }
 
-inline void eepromWrite(u32 address, u8 value) {
-  static bool warned = false;
-  trace(warned, "FATAL: EEPROM write to 0x%08X", address);
+inline void eepromWrite(GBASystem *gba, u32 address, u8 value) {
+  trace(gba->eepromWriteWarned, "FATAL: EEPROM write to 0x%08X", address);
 }
 
-inline u8 flashRead(u32 address) {
-  static bool warned = false;
-  trace(warned, "FATAL: Flash read from 0x%08X", address);
+inline u8 flashRead(GBASystem *gba, u32 address) {
+  trace(gba->flashReadWarned, "FATAL: Flash read from 0x%08X", address);
   return 0;
 }
 
-inline u16 rtcRead(u32 address) {
-  static bool warned = false;
-  trace(warned, "FATAL: RTC read from 0x%08X", address);
+inline u16 rtcRead(GBASystem *gba, u32 address) {
+  trace(gba->rtcReadWarned, "FATAL: RTC read from 0x%08X", address);
   return 0;
 }
 
-inline int systemGetSensorX() {
-  static bool warned = false;
-  trace(warned, "FATAL: Sensor X read");
+inline int systemGetSensorX(GBASystem *gba) {
+  trace(gba->sensorXReadWarned, "FATAL: Sensor X read");
   return 0;
 }
 
-inline int systemGetSensorY() {
-  static bool warned = false;
-  trace(warned, "FATAL: Sensor Y read");
+inline int systemGetSensorY(GBASystem *gba) {
+  trace(gba->sensorYReadWarned, "FATAL: Sensor Y read");
   return 0;
 }
 
-inline bool agbPrintWrite(u32 address, u16 value) {
-  static bool warned = false;
-  trace(warned, "FATAL: AGBPrint write to 0x%08X", address);
+inline bool agbPrintWrite(GBASystem *gba, u32 address, u16 value) {
+  trace(gba->agbPrintWriteWarned, "FATAL: AGBPrint write to 0x%08X", address);
   return true;
 }
 
-inline bool rtcWrite(u32 address, u16 value) {
-  static bool warned = false;
-  trace(warned, "FATAL: RTC write to 0x%08X", address);
+inline bool rtcWrite(GBASystem *gba, u32 address, u16 value) {
+  trace(gba->rtcWriteWarned, "FATAL: RTC write to 0x%08X", address);
   return true;
 }
 
 extern const u32 objTilesAddress[3];
 
+// The ROM space past the loaded image is open bus, where each halfword reads
+// back the lower 16 bits of its own halfword address. gba->rom only holds the
+// image, the pattern is synthesized here when a read reaches romOpenBusStart.
+static inline u8 CPUReadRomOpenBusByte(GBASystem *gba, u32 offset)
+{
+  // the AGBPrint stub installed by CPUInit lives in the open bus area
+  if(offset < gba->romOpenBusStart ||
+     ((offset & ~3) == 0x1fe209c && gba->romSize < 0x1fe2000))
+    return gba->rom[offset];
+  return (u8)((offset & 1) ? (offset >> 9) : (offset >> 1));
+}
+
+static inline u16 CPUReadRomOpenBusHalfWord(GBASystem *gba, u32 offset)
+{
+  return CPUReadRomOpenBusByte(gba, offset) |
+    (CPUReadRomOpenBusByte(gba, offset + 1) << 8);
+}
+
+static inline u32 CPUReadRomOpenBusMemory(GBASystem *gba, u32 offset)
+{
+  return CPUReadRomOpenBusHalfWord(gba, offset) |
+    (CPUReadRomOpenBusHalfWord(gba, offset + 2) << 16);
+}
+
+// True if size bytes at offset into the ROM space are not all in gba->rom
+#define CPURomIsOpenBus(gba, offset, size) \
+  ((offset) + (size) > (gba)->romOpenBusStart)
+
+// Same for a memory map read, which does not know the region in advance
+#define CPUMapIsRomOpenBus(gba, addr, size) \
+  ((gba)->map[(addr)>>24].address == (gba)->rom && \
+   CPURomIsOpenBus(gba, (addr) & 0x1FFFFFF, size))
+
 #ifdef GSFOPT
+// Number of coverage tracked bytes, the whole ROM space or the multiboot image
+static inline u32 CPURomRefsSize(GBASystem *gba)
+{
+  return gba->cpuIsMultiBoot ? 0x40000 : 0x2000000;
+}
+
+// The hashes of written RAM pages must be updated (see stateHashEnabled)
+#define CPUMarkWorkRamWritten(gba, offset) \
+  ((gba)->ramPageDirty[(offset) >> 12] = true)
+#define CPUMarkInternalRamWritten(gba, offset) \
+  ((gba)->ramPageDirty[(0x40000 + (offset)) >> 12] = true)
+
+// The current pass of an idle loop candidate has a side effect, or has read
+// a value that changes between events (see CPUCheckIdleLoop)
+#define CPUTaintIdleLoop(gba) \
+  ((gba)->idleLoopTainted = true)
+
+// A backward jump of the instruction at pc that may close an idle loop
+#define CPUIsIdleLoopJump(gba, pc) \
+  ((gba)->armNextPC <= (u32)(pc) && (u32)(pc) - (gba)->armNextPC < GBASystem::IDLE_LOOP_MAX_SIZE)
+
+// Accesses are aligned to their size, they never cross a region, a byte
+// of the bitset or a page of the reference counts.
 static inline void CPUMarkMemoryAsRead(GBASystem *gba, u32 address, u32 size)
 {
-  for (u32 addr = address; addr < address + size; addr++)
+  u32 offset;
+
+  if (gba->cpuIsMultiBoot)
   {
-    u32 offset;
+    if ((address >> 24) != 0x02)
+    {
+      return;
+    }
+    offset = address & 0x3FFFF;
+  }
+  else
+  {
+    if ((address >> 24) < 0x08 || (address >> 24) > 0x0D)
+    {
+      return;
+    }
+    offset = address & 0x1FFFFFF;
+  }
 
-    if (gba->cpuIsMultiBoot)
+  if (!gba->romRefsCounted)
+  {
+    u8 *bits = &gba->rom_refs_bits[offset >> 3];
+    u8 mask = (u8)(((1 << size) - 1) << (offset & 7));
+    if ((*bits & mask) != mask)
     {
-      if ((addr >> 24) == 0x02)
-      {
-        offset = addr & 0x3FFFF;
-      }
-      else
-      {
-        continue;
-      }
+      gba->bytes_used += gba->cpuBitsSet[mask & ~*bits];
+      gba->newDataTicks = CPUGetTicks(gba);
+      *bits |= mask;
     }
-    else
+    return;
+  }
+
+  if (gba->idleLoopRecording)
+  {
+    if (gba->idleLoopMarkCount < GBASystem::IDLE_LOOP_MAX_MARKS)
     {
-      if ((addr >> 24) >= 0x08 && (addr >> 24) <= 0x0D)
-      {
-        offset = addr & 0x1FFFFFF;
-      }
-      else
-      {
-        continue;
-      }
+      GBASystem::IdleLoopMark mark = { address, size };
+      gba->idleLoopMarks[gba->idleLoopMarkCount] = mark;
     }
+    gba->idleLoopMarkCount++;
+  }
 
-    if (gba->rom_refs[offset] == 0)
+  u8 *refs = gba->rom_refs.touch(offset);
+  for (u32 i = 0; i < size; i++)
+  {
+    if (refs[i] == 0)
     {
       gba->bytes_used++;
+      gba->newDataTicks = CPUGetTicks(gba);
     }
-    if (gba->rom_refs[offset] < 0xFF)
+    if (refs[i] < 0xFF)
     {
-      gba->rom_refs[offset]++;
-	  gba->rom_refs_histogram[gba->rom_refs[offset]]++;
+      refs[i]++;
+	  gba->rom_refs_histogram[refs[i]]++;
 	}
   }
 }
+
+// True if CPUMarkMemoryAsRead would change nothing for the same access,
+// because the bytes have been read already, or counted 255 times
+static inline bool CPUIsMemoryMarked(GBASystem *gba, u32 address, u32 size)
+{
+  u32 offset;
+
+  if (gba->cpuIsMultiBoot)
+  {
+    if ((address >> 24) != 0x02)
+    {
+      return true;
+    }
+    offset = address & 0x3FFFF;
+  }
+  else
+  {
+    if ((address >> 24) < 0x08 || (address >> 24) > 0x0D)
+    {
+      return true;
+    }
+    offset = address & 0x1FFFFFF;
+  }
+
+  if (!gba->romRefsCounted)
+  {
+    u8 mask = (u8)(((1 << size) - 1) << (offset & 7));
+    return (gba->rom_refs_bits[offset >> 3] & mask) == mask;
+  }
+
+  for (u32 i = 0; i < size; i++)
+  {
+    if (gba->rom_refs[offset + i] != 0xFF)
+    {
+      return false;
+    }
+  }
+  return true;
+}
 #endif
 
+// A write to RAM makes the blocks decoded from its code page invalid
+static inline void CPUMarkCodePageWritten(GBASystem *gba, u32 page)
+{
+  if (gba->codePageUsed[page])
+  {
+    gba->codePageUsed[page] = false;
+    gba->codePageVersion[page]++;
+  }
+}
+
+#define CPUMarkWorkRamCodeWritten(gba, offset) \
+  CPUMarkCodePageWritten(gba, (offset) >> GBASystem::CODE_PAGE_BITS)
+#define CPUMarkInternalRamCodeWritten(gba, offset) \
+  CPUMarkCodePageWritten(gba, (0x40000 + (offset)) >> GBASystem::CODE_PAGE_BITS)
+
 #ifndef GSFOPT
 #define CPUReadByteQuick(gba, addr) \
-  (gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask]
+  (CPUMapIsRomOpenBus(gba, addr, 1) ? \
+   CPUReadRomOpenBusByte((gba), (addr) & 0x1FFFFFF) : \
+   (gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask])
 
 #define CPUReadHalfWordQuick(gba, addr) \
-  READ16LE(((u16*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask]))
+  (CPUMapIsRomOpenBus(gba, addr, 2) ? \
+   CPUReadRomOpenBusHalfWord((gba), (addr) & 0x1FFFFFF) : \
+   READ16LE(((u16*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask])))
 
 #define CPUReadMemoryQuick(gba, addr) \
-  READ32LE(((u32*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask]))
+  (CPUMapIsRomOpenBus(gba, addr, 4) ? \
+   CPUReadRomOpenBusMemory((gba), (addr) & 0x1FFFFFF) : \
+   READ32LE(((u32*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask])))
 #else
 #define CPUReadByteQuickNoMark(gba, addr) \
-  (gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask]
+  (CPUMapIsRomOpenBus(gba, addr, 1) ? \
+   CPUReadRomOpenBusByte((gba), (addr) & 0x1FFFFFF) : \
+   (gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask])
 
 #define CPUReadHalfWordQuickNoMark(gba, addr) \
-  READ16LE(((u16*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask]))
+  (CPUMapIsRomOpenBus(gba, addr, 2) ? \
+   CPUReadRomOpenBusHalfWord((gba), (addr) & 0x1FFFFFF) : \
+   READ16LE(((u16*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask])))
 
 #define CPUReadMemoryQuickNoMark(gba, addr) \
-  READ32LE(((u32*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask]))
+  (CPUMapIsRomOpenBus(gba, addr, 4) ? \
+   CPUReadRomOpenBusMemory((gba), (addr) & 0x1FFFFFF) : \
+   READ32LE(((u32*)&(gba)->map[(addr)>>24].address[(addr) & (gba)->map[(addr)>>24].mask])))
 
 static inline u8 CPUReadByteQuick(GBASystem *gba, u32 address)
 {
@@ -187,6 +313,11 @@ static inline u32 CPUReadMemory(GBASystem *gba, u32 address)
     break;
   case 4:
       if((address < 0x4000400) && gba->ioReadable[address & 0x3fc]) {
+          // the timer counters and the LCD state are written to ioMem only when they are read
+          if((address & 0x3f0) == 0x100)
+              CPUUpdateTimerRegisters(gba);
+          else if((address & 0x3f8) == 0)
+              CPUUpdateLcdRegisters(gba);
           if(gba->ioReadable[(address & 0x3fc) + 2]) {
               value = READ32LE(((u32 *)&gba->ioMem[address & 0x3fC]));
 		  } else {
@@ -197,7 +328,7 @@ static inline u32 CPUReadMemory(GBASystem *gba, u32 address)
 		  goto unreadable;
 	  break;
   case 5:
-    trace(g_paletteReadWarned, "Info: Palette RAM read from 0x%08X", raw_address);
+    trace(gba->paletteReadWarned, "Info: Palette RAM read from 0x%08X", raw_address);
     value = READ32LE(((u32 *)&gba->paletteRAM[address & 0x3fC]));
     break;
   case 6:
@@ -209,11 +340,11 @@ static inline u32 CPUReadMemory(GBASystem *gba, u32 address)
     }
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
-    trace(g_vramReadWarned, "Info: VRAM read from 0x%08X", raw_address);
+    trace(gba->vramReadWarned, "Info: VRAM read from 0x%08X", raw_address);
     value = READ32LE(((u32 *)&gba->vram[address]));
     break;
   case 7:
-    trace(g_oamReadWarned, "Info: OAM read from 0x%08X", raw_address);
+    trace(gba->oamReadWarned, "Info: OAM read from 0x%08X", raw_address);
     value = READ32LE(((u32 *)&gba->oam[address & 0x3FC]));
     break;
   case 8:
@@ -227,17 +358,20 @@ static inline u32 CPUReadMemory(GBASystem *gba, u32 address)
       CPUMarkMemoryAsRead(gba, address & ~3, 4);
     }
 #endif
-    value = READ32LE(((u32 *)&gba->rom[address&0x1FFFFFC]));
+    if(CPURomIsOpenBus(gba, address & 0x1FFFFFC, 4))
+      value = CPUReadRomOpenBusMemory(gba, address & 0x1FFFFFC);
+    else
+      value = READ32LE(((u32 *)&gba->rom[address&0x1FFFFFC]));
     break;
   case 13:
     if(gba->cpuEEPROMEnabled)
       // no need to swap this
-      return eepromRead(address);
+      return eepromRead(gba, address);
     goto unreadable;
   case 14:
     if(gba->cpuFlashEnabled | gba->cpuSramEnabled)
       // no need to swap this
-      return flashRead(address);
+      return flashRead(gba, address);
     // default
   default:
 unreadable:
@@ -292,26 +426,31 @@ static inline u32 CPUReadHalfWord(GBASystem *gba, u32 address)
   case 4:
     if((address < 0x4000400) && gba->ioReadable[address & 0x3fe])
     {
+      if((address & 0x3fc) == 0x04)
+        CPUUpdateLcdRegisters(gba);
       value =  READ16LE(((u16 *)&gba->ioMem[address & 0x3fe]));
       if (((address & 0x3fe)>0xFF) && ((address & 0x3fe)<0x10E))
       {
+#ifdef GSFOPT
+        CPUTaintIdleLoop(gba);
+#endif
         if (((address & 0x3fe) == 0x100) && gba->timer0On)
-          value = 0xFFFF - ((gba->timer0Ticks-gba->cpuTotalTicks) >> gba->timer0ClockReload);
+          value = 0xFFFF - ((CPUTicksUntil(gba, gba->timer0Time)-gba->cpuTotalTicks) >> gba->timer0ClockReload);
         else
           if (((address & 0x3fe) == 0x104) && gba->timer1On && !(gba->TM1CNT & 4))
-            value = 0xFFFF - ((gba->timer1Ticks-gba->cpuTotalTicks) >> gba->timer1ClockReload);
+            value = 0xFFFF - ((CPUTicksUntil(gba, gba->timer1Time)-gba->cpuTotalTicks) >> gba->timer1ClockReload);
           else
             if (((address & 0x3fe) == 0x108) && gba->timer2On && !(gba->TM2CNT & 4))
-              value = 0xFFFF - ((gba->timer2Ticks-gba->cpuTotalTicks) >> gba->timer2ClockReload);
+              value = 0xFFFF - ((CPUTicksUntil(gba, gba->timer2Time)-gba->cpuTotalTicks) >> gba->timer2ClockReload);
             else
               if (((address & 0x3fe) == 0x10C) && gba->timer3On && !(gba->TM3CNT & 4))
-                value = 0xFFFF - ((gba->timer3Ticks-gba->cpuTotalTicks) >> gba->timer3ClockReload);
+                value = 0xFFFF - ((CPUTicksUntil(gba, gba->timer3Time)-gba->cpuTotalTicks) >> gba->timer3ClockReload);
       }
     }
     else goto unreadable;
     break;
   case 5:
-    trace(g_paletteReadWarned, "Info: Palette RAM read from 0x%08X", raw_address);
+    trace(gba->paletteReadWarned, "Info: Palette RAM read from 0x%08X", raw_address);
     value = READ16LE(((u16 *)&gba->paletteRAM[address & 0x3fe]));
     break;
   case 6:
@@ -323,11 +462,11 @@ static inline u32 CPUReadHalfWord(GBASystem *gba, u32 address)
     }
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
-    trace(g_vramReadWarned, "Info: VRAM read from 0x%08X", raw_address);
+    trace(gba->vramReadWarned, "Info: VRAM read from 0x%08X", raw_address);
     value = READ16LE(((u16 *)&gba->vram[address]));
     break;
   case 7:
-    trace(g_oamReadWarned, "Info: OAM read from 0x%08X", raw_address);
+    trace(gba->oamReadWarned, "Info: OAM read from 0x%08X", raw_address);
     value = READ16LE(((u16 *)&gba->oam[address & 0x3fe]));
     break;
   case 8:
@@ -336,7 +475,7 @@ static inline u32 CPUReadHalfWord(GBASystem *gba, u32 address)
   case 11:
   case 12:
     if(address == 0x80000c4 || address == 0x80000c6 || address == 0x80000c8)
-      value = rtcRead(address);
+      value = rtcRead(gba, address);
     else
     {
 #ifdef GSFOPT
@@ -345,18 +484,21 @@ static inline u32 CPUReadHalfWord(GBASystem *gba, u32 address)
         CPUMarkMemoryAsRead(gba, address & ~1, 2);
       }
 #endif
-      value = READ16LE(((u16 *)&gba->rom[address & 0x1FFFFFE]));
+      if(CPURomIsOpenBus(gba, address & 0x1FFFFFE, 2))
+        value = CPUReadRomOpenBusHalfWord(gba, address & 0x1FFFFFE);
+      else
+        value = READ16LE(((u16 *)&gba->rom[address & 0x1FFFFFE]));
     }
     break;
   case 13:
     if(gba->cpuEEPROMEnabled)
       // no need to swap this
-      return  eepromRead(address);
+      return  eepromRead(gba, address);
     goto unreadable;
   case 14:
     if(gba->cpuFlashEnabled | gba->cpuSramEnabled)
       // no need to swap this
-      return flashRead(address);
+      return flashRead(gba, address);
     // default
   default:
 unreadable:
@@ -409,11 +551,16 @@ static inline u8 CPUReadByte(GBASystem *gba, u32 address)
   case 3:
     return gba->internalRAM[address & 0x7fff];
   case 4:
-    if((address < 0x4000400) && gba->ioReadable[address & 0x3ff])
+    if((address < 0x4000400) && gba->ioReadable[address & 0x3ff]) {
+      if((address & 0x3f0) == 0x100)
+        CPUUpdateTimerRegisters(gba);
+      else if((address & 0x3fc) == 0x04)
+        CPUUpdateLcdRegisters(gba);
       return gba->ioMem[address & 0x3ff];
+    }
     else goto unreadable;
   case 5:
-    trace(g_paletteReadWarned, "Info: Palette RAM read from 0x%08X", raw_address);
+    trace(gba->paletteReadWarned, "Info: Palette RAM read from 0x%08X", raw_address);
     return gba->paletteRAM[address & 0x3ff];
   case 6:
     address = (address & 0x1ffff);
@@ -421,10 +568,10 @@ static inline u8 CPUReadByte(GBASystem *gba, u32 address)
       return 0;
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
-    trace(g_vramReadWarned, "Info: VRAM read from 0x%08X", raw_address);
+    trace(gba->vramReadWarned, "Info: VRAM read from 0x%08X", raw_address);
     return gba->vram[address];
   case 7:
-    trace(g_oamReadWarned, "Info: OAM read from 0x%08X", raw_address);
+    trace(gba->oamReadWarned, "Info: OAM read from 0x%08X", raw_address);
     return gba->oam[address & 0x3ff];
   case 8:
   case 9:
@@ -437,24 +584,26 @@ static inline u8 CPUReadByte(GBASystem *gba, u32 address)
       CPUMarkMemoryAsRead(gba, address, 1);
     }
 #endif
+    if(CPURomIsOpenBus(gba, address & 0x1FFFFFF, 1))
+      return CPUReadRomOpenBusByte(gba, address & 0x1FFFFFF);
     return gba->rom[address & 0x1FFFFFF];
   case 13:
     if(gba->cpuEEPROMEnabled)
-      return eepromRead(address);
+      return eepromRead(gba, address);
     goto unreadable;
   case 14:
     if(gba->cpuSramEnabled | gba->cpuFlashEnabled)
-      return flashRead(address);
+      return flashRead(gba, address);
     if(gba->cpuEEPROMSensorEnabled) {
       switch(address & 0x00008f00) {
   case 0x8200:
-    return systemGetSensorX() & 255;
+    return systemGetSensorX(gba) & 255;
   case 0x8300:
-    return (systemGetSensorX() >> 8)|0x80;
+    return (systemGetSensorX(gba) >> 8)|0x80;
   case 0x8400:
-    return systemGetSensorY() & 255;
+    return systemGetSensorY(gba) & 255;
   case 0x8500:
-    return systemGetSensorY() >> 8;
+    return systemGetSensorY(gba) >> 8;
       }
     }
     // default
@@ -476,11 +625,22 @@ unreadable:
 static inline void CPUWriteMemory(GBASystem *gba, u32 address, u32 value)
 {
   u32 raw_address = address;
+#ifdef GSFOPT
+  CPUTaintIdleLoop(gba);
+#endif
   switch(address >> 24) {
   case 0x02:
+#ifdef GSFOPT
+      CPUMarkWorkRamWritten(gba, address & 0x3FFFC);
+#endif
+      CPUMarkWorkRamCodeWritten(gba, address & 0x3FFFC);
       WRITE32LE(((u32 *)&gba->workRAM[address & 0x3FFFC]), value);
     break;
   case 0x03:
+#ifdef GSFOPT
+      CPUMarkInternalRamWritten(gba, address & 0x7ffC);
+#endif
+      CPUMarkInternalRamCodeWritten(gba, address & 0x7ffC);
       WRITE32LE(((u32 *)&gba->internalRAM[address & 0x7ffC]), value);
     break;
   case 0x04:
@@ -490,7 +650,7 @@ static inline void CPUWriteMemory(GBASystem *gba, u32 address, u32 value)
     } else goto unwritable;
     break;
   case 0x05:
-      trace(g_paletteWriteWarned, "Info: Palette RAM write to 0x%08X", raw_address);
+      trace(gba->paletteWriteWarned, "Info: Palette RAM write to 0x%08X", raw_address);
       WRITE32LE(((u32 *)&gba->paletteRAM[address & 0x3FC]), value);
     break;
   case 0x06:
@@ -500,16 +660,16 @@ static inline void CPUWriteMemory(GBASystem *gba, u32 address, u32 value)
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
 
-      trace(g_vramWriteWarned, "Info: VRAM write to 0x%08X", raw_address);
+      trace(gba->vramWriteWarned, "Info: VRAM write to 0x%08X", raw_address);
       WRITE32LE(((u32 *)&gba->vram[address]), value);
     break;
   case 0x07:
-      trace(g_oamWriteWarned, "Info: OAM write to 0x%08X", raw_address);
+      trace(gba->oamWriteWarned, "Info: OAM write to 0x%08X", raw_address);
       WRITE32LE(((u32 *)&gba->oam[address & 0x3fc]), value);
     break;
   case 0x0D:
     if(gba->cpuEEPROMEnabled) {
-      eepromWrite(address, value);
+      eepromWrite(gba, address, value);
       break;
     }
     goto unwritable;
@@ -524,11 +684,22 @@ unwritable:
 static inline void CPUWriteHalfWord(GBASystem *gba, u32 address, u16 value)
 {
   u32 raw_address = address;
+#ifdef GSFOPT
+  CPUTaintIdleLoop(gba);
+#endif
   switch(address >> 24) {
   case 2:
+#ifdef GSFOPT
+      CPUMarkWorkRamWritten(gba, address & 0x3FFFE);
+#endif
+      CPUMarkWorkRamCodeWritten(gba, address & 0x3FFFE);
       WRITE16LE(((u16 *)&gba->workRAM[address & 0x3FFFE]),value);
     break;
   case 3:
+#ifdef GSFOPT
+      CPUMarkInternalRamWritten(gba, address & 0x7ffe);
+#endif
+      CPUMarkInternalRamCodeWritten(gba, address & 0x7ffe);
       WRITE16LE(((u16 *)&gba->internalRAM[address & 0x7ffe]), value);
     break;
   case 4:
@@ -537,7 +708,7 @@ static inline void CPUWriteHalfWord(GBASystem *gba, u32 address, u16 value)
     else goto unwritable;
     break;
   case 5:
-      trace(g_paletteWriteWarned, "Info: Palette RAM write to 0x%08X", raw_address);
+      trace(gba->paletteWriteWarned, "Info: Palette RAM write to 0x%08X", raw_address);
       WRITE16LE(((u16 *)&gba->paletteRAM[address & 0x3fe]), value);
     break;
   case 6:
@@ -546,23 +717,23 @@ static inline void CPUWriteHalfWord(GBASystem *gba, u32 address, u16 value)
       return;
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
-      trace(g_vramWriteWarned, "Info: VRAM write to 0x%08X", raw_address);
+      trace(gba->vramWriteWarned, "Info: VRAM write to 0x%08X", raw_address);
       WRITE16LE(((u16 *)&gba->vram[address]), value);
     break;
   case 7:
-      trace(g_oamWriteWarned, "Info: OAM write to 0x%08X", raw_address);
+      trace(gba->oamWriteWarned, "Info: OAM write to 0x%08X", raw_address);
       WRITE16LE(((u16 *)&gba->oam[address & 0x3fe]), value);
     break;
   case 8:
   case 9:
     if(address == 0x80000c4 || address == 0x80000c6 || address == 0x80000c8) {
-      if(!rtcWrite(address, value))
+      if(!rtcWrite(gba, address, value))
         goto unwritable;
-    } else if(!agbPrintWrite(address, value)) goto unwritable;
+    } else if(!agbPrintWrite(gba, address, value)) goto unwritable;
     break;
   case 13:
     if(gba->cpuEEPROMEnabled) {
-      eepromWrite(address, (u8)value);
+      eepromWrite(gba, address, (u8)value);
       break;
     }
     goto unwritable;
@@ -577,11 +748,22 @@ unwritable:
 static inline void CPUWriteByte(GBASystem *gba, u32 address, u8 b)
 {
   u32 raw_address = address;
+#ifdef GSFOPT
+  CPUTaintIdleLoop(gba);
+#endif
   switch(address >> 24) {
   case 2:
+#ifdef GSFOPT
+      CPUMarkWorkRamWritten(gba, address & 0x3FFFF);
+#endif
+      CPUMarkWorkRamCodeWritten(gba, address & 0x3FFFF);
       gba->workRAM[address & 0x3FFFF] = b;
     break;
   case 3:
+#ifdef GSFOPT
+      CPUMarkInternalRamWritten(gba, address & 0x7fff);
+#endif
+      CPUMarkInternalRamCodeWritten(gba, address & 0x7fff);
       gba->internalRAM[address & 0x7fff] = b;
     break;
   case 4:
@@ -648,7 +830,7 @@ static inline void CPUWriteByte(GBASystem *gba, u32 address, u8 b)
     } else goto unwritable;
     break;
   case 5:
-    trace(g_paletteWriteWarned, "Info: Palette RAM write to 0x%08X", raw_address);
+    trace(gba->paletteWriteWarned, "Info: Palette RAM write to 0x%08X", raw_address);
 
     // no need to switch
     *((u16 *)&gba->paletteRAM[address & 0x3FE]) = (b << 8) | b;
@@ -660,7 +842,7 @@ static inline void CPUWriteByte(GBASystem *gba, u32 address, u8 b)
     if ((address & 0x18000) == 0x18000)
       address &= 0x17fff;
 
-    trace(g_vramWriteWarned, "Info: VRAM write to 0x%08X", raw_address);
+    trace(gba->vramWriteWarned, "Info: VRAM write to 0x%08X", raw_address);
 
     // no need to switch
     // byte writes to OBJ VRAM are ignored
@@ -670,14 +852,14 @@ static inline void CPUWriteByte(GBASystem *gba, u32 address, u8 b)
     }
     break;
   case 7:
-    trace(g_oamWriteWarned, "Info: OAM write to 0x%08X", raw_address);
+    trace(gba->oamWriteWarned, "Info: OAM write to 0x%08X", raw_address);
     // no need to switch
     // byte writes to OAM are ignored
     //    *((u16 *)&oam[address & 0x3FE]) = (b << 8) | b;
     break;
   case 13:
     if(gba->cpuEEPROMEnabled) {
-      eepromWrite(address, b);
+      eepromWrite(gba, address, b);
       break;
     }
     goto unwritable;
@@ -0,0 +1,815 @@
+#ifdef CODE_JIT
+
+#if !defined(__x86_64__) && !defined(_M_X64)
+#error The block translator emits x86-64 code, build without CODE_JIT
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#ifdef CODE_JIT_LOCKSTEP
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "GBA.h"
+#include "GBAcpu.h"
+#include "GBAinline.h"
+
+// Translation of the decoded blocks into host code. A translated block does
+// what the block executors in GBA-arm.cpp and GBA-thumb.cpp do, unrolled:
+// the bookkeeping around each instruction is emitted inline, with the
+// address of the instruction, its opcode and the state of the block as
+// constants. The moves, additions, subtractions, comparisons and logical
+// operations on registers are emitted too, the other instructions are
+// direct calls to their handlers. The interpreter stays the reference, and
+// runs the blocks until they are hot.
+
+#ifdef _WIN32
+enum { ARG0 = 1, ARG1 = 2, STACK_SPACE = 40 }; // rcx, rdx, and the shadow space
+#else
+enum { ARG0 = 7, ARG1 = 6, STACK_SPACE = 8 };  // rdi, rsi
+#endif
+
+enum { EAX = 0, ECX = 1, EDX = 2, EBX = 3 };
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+enum { SHIFT_ROR = 1, SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+enum { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_S = 0x8, CC_GE = 0xD, CC_G = 0xF };
+
+// Upper bound of the code emitted for an instruction, and for the entry and
+// exit code of a block, at most about 500 and 70 bytes
+enum { MAX_INSN_CODE = 640 };
+
+// Emits x86-64 code. The memory operands are relative to rbx, which holds
+// the GBASystem while a block runs.
+struct CodeEmitter
+{
+  u8 *p;
+
+  void byte(u32 value) { *p++ = (u8)value; }
+  void dword(u32 value) { memcpy(p, &value, 4); p += 4; }
+
+  // modrm of [rbx + disp32]
+  void mem(int reg, u32 disp) { byte(0x80 | (reg << 3) | EBX); dword(disp); }
+
+  void load(int reg, u32 disp) { byte(0x8B); mem(reg, disp); }
+  void loadByte(int reg, u32 disp) { byte(0x0F); byte(0xB6); mem(reg, disp); }
+  void store(u32 disp, int reg) { byte(0x89); mem(reg, disp); }
+  void storeImm(u32 disp, u32 value) { byte(0xC7); mem(0, disp); dword(value); }
+  void storeByteImm(u32 disp, u8 value) { byte(0xC6); mem(0, disp); byte(value); }
+  void addStore(u32 disp, int reg) { byte(0x01); mem(reg, disp); }
+  void cmpLoad(int reg, u32 disp) { byte(0x3B); mem(reg, disp); }
+  void cmpImm(u32 disp, u32 value) { byte(0x81); mem(ALU_CMP, disp); dword(value); }
+  void cmpByteImm(u32 disp, u8 value) { byte(0x80); mem(ALU_CMP, disp); byte(value); }
+
+  void storeByte(u32 disp, int reg) { byte(0x88); mem(reg, disp); }
+  void setcc(int cc, u32 disp) { byte(0x0F); byte(0x90 | cc); mem(0, disp); }
+
+  void alu(int op, int reg, u32 value) { byte(0x81); byte(0xC0 | (op << 3) | reg); dword(value); }
+  void aluReg(int op, int dst, int src) { byte((op << 3) | 1); byte(0xC0 | (src << 3) | dst); }
+  void movReg(int dst, int src) { byte(0x89); byte(0xC0 | (src << 3) | dst); }
+  void movImm(int reg, u32 value) { byte(0xB8 | reg); dword(value); }
+  void shift(int op, int reg, u8 count) { byte(0xC1); byte(0xC0 | (op << 3) | reg); byte(count); }
+  void shr(int reg, u8 count) { shift(SHIFT_SHR, reg, count); }
+  void notReg(int reg) { byte(0xF7); byte(0xD0 | reg); }
+  void testImm(int reg, u32 value) { byte(0xF7); byte(0xC0 | reg); dword(value); }
+  void testByte(int reg) { byte(0x84); byte(0xC0 | (reg << 3) | reg); }
+  void test(int reg) { byte(0x85); byte(0xC0 | (reg << 3) | reg); }
+  void clear(int reg) { byte(0x31); byte(0xC0 | (reg << 3) | reg); }
+
+  // func(gba, ...), the other arguments loaded beforehand
+  void call(const void *func)
+  {
+    u64 address = (u64)(size_t)func;
+    byte(0x48); byte(0x89); byte(0xC0 | (EBX << 3) | ARG0); // mov arg0, rbx
+    byte(0x48); byte(0xB8); dword((u32)address); dword((u32)(address >> 32)); // mov rax, func
+    byte(0xFF); byte(0xD0); // call rax
+  }
+
+  // The jumps are rel32. One to a later place returns the offset to bind.
+  u8 *jcc(int cc) { byte(0x0F); byte(0x80 | cc); dword(0); return p - 4; }
+  u8 *jmp(void) { byte(0xE9); dword(0); return p - 4; }
+  void jcc(int cc, const u8 *target) { bind(jcc(cc), target); }
+  void bind(u8 *rel, const u8 *target) { u32 value = (u32)(target - (rel + 4)); memcpy(rel, &value, 4); }
+  void bind(u8 *rel) { bind(rel, p); }
+};
+
+// Offset of a member of the system, the same for every instance
+#define GBA_OFFSET(gba, member) ((u32)((u8 *)&(gba)->member - (u8 *)(gba)))
+
+#ifdef GSFOPT
+static void jitLeaveBlock(GBASystem *gba, u32 pc)
+{
+  if (CPUIsIdleLoopJump(gba, pc))
+    CPUCheckIdleLoop(gba);
+}
+
+static void jitMarkHalfWordAsRead(GBASystem *gba, u32 address)
+{
+  CPUMarkMemoryAsRead(gba, address, 2);
+}
+
+static void jitMarkWordAsRead(GBASystem *gba, u32 address)
+{
+  CPUMarkMemoryAsRead(gba, address, 4);
+}
+#endif
+
+// Low byte of busPrefetchCount shifted right by count, the rest kept, from ecx
+static void jitEmitShiftPrefetch(CodeEmitter &e, u32 bpc, u8 count)
+{
+  e.movReg(EDX, ECX);
+  e.alu(ALU_AND, EDX, 0xFF);
+  e.shr(EDX, count);
+  e.alu(ALU_AND, ECX, 0xFFFFFF00);
+  e.aluReg(ALU_OR, ECX, EDX);
+  e.store(bpc, ECX);
+}
+
+// The clockTicks of an instruction that has not set them, into eax. They are
+// 1 + codeTicksAccessSeq16 or 1 + codeTicksAccessSeq32 of pc, with the
+// memory region resolved here.
+static void jitEmitSeqTicks(CodeEmitter &e, GBASystem *gba, u32 pc, bool thumb)
+{
+  u32 addr = (pc >> 24) & 15;
+  u32 bpc = GBA_OFFSET(gba, busPrefetchCount);
+  u32 nonSeq = thumb ? GBA_OFFSET(gba, memoryWait[addr]) : GBA_OFFSET(gba, memoryWait32[addr]);
+  u32 seq = thumb ? GBA_OFFSET(gba, memoryWaitSeq[addr]) : GBA_OFFSET(gba, memoryWaitSeq32[addr]);
+
+  if (addr < 0x08 || addr > 0x0D) {
+    if (thumb)
+      e.storeImm(bpc, 0);
+    e.loadByte(EAX, seq);
+    e.alu(ALU_ADD, EAX, 1);
+    return;
+  }
+
+  u8 *done[3];
+  e.load(ECX, bpc);
+  e.testImm(ECX, 0x1);
+  u8 *notPrefetched = e.jcc(CC_E);
+  if (thumb) {
+    jitEmitShiftPrefetch(e, bpc, 1);
+    e.clear(EAX);
+    done[0] = e.jmp();
+  } else {
+    e.testImm(ECX, 0x2);
+    u8 *halfPrefetched = e.jcc(CC_E);
+    jitEmitShiftPrefetch(e, bpc, 2);
+    e.clear(EAX);
+    done[0] = e.jmp();
+    e.bind(halfPrefetched);
+    jitEmitShiftPrefetch(e, bpc, 1);
+    e.loadByte(EAX, GBA_OFFSET(gba, memoryWaitSeq[addr]));
+    done[2] = e.jmp();
+  }
+  e.bind(notPrefetched);
+  e.alu(ALU_CMP, ECX, 0xFF);
+  u8 *sequential = e.jcc(CC_BE);
+  e.storeImm(bpc, 0);
+  e.loadByte(EAX, nonSeq);
+  done[1] = e.jmp();
+  e.bind(sequential);
+  e.loadByte(EAX, seq);
+
+  e.bind(done[0]);
+  e.bind(done[1]);
+  if (!thumb)
+    e.bind(done[2]);
+  e.alu(ALU_ADD, EAX, 1);
+}
+
+#define REG(n) GBA_OFFSET(gba, reg[n].I)
+
+// N and Z of the result in eax
+static void jitEmitSetNZ(CodeEmitter &e, GBASystem *gba)
+{
+  e.test(EAX);
+  e.setcc(CC_E, GBA_OFFSET(gba, Z_FLAG));
+  e.setcc(CC_S, GBA_OFFSET(gba, N_FLAG));
+}
+
+// CPUDeferAddFlags or CPUDeferSubFlags of ecx and edx into eax
+static void jitEmitDeferFlags(CodeEmitter &e, GBASystem *gba, u8 op)
+{
+  e.store(GBA_OFFSET(gba, flagLhs), ECX);
+  e.store(GBA_OFFSET(gba, flagRhs), EDX);
+  e.store(GBA_OFFSET(gba, flagRes), EAX);
+  e.storeByteImm(GBA_OFFSET(gba, cFlagOp), op);
+  e.storeByteImm(GBA_OFFSET(gba, vFlagOp), op);
+}
+
+// The ARM data processing instructions without a register shift, RRX or a
+// write to the PC, that set no flags or are SUBS, ADDS, CMP or CMN
+static bool jitIsNativeArmInsn(u32 opcode)
+{
+  if ((opcode & 0x0C000000) != 0 || ((opcode >> 12) & 15) == 15)
+    return false;
+  if (!(opcode & 0x02000000)) {
+    if (opcode & 0x10)
+      return false;
+    if (((opcode >> 5) & 3) == 3 && ((opcode >> 7) & 31) == 0)
+      return false;
+  }
+  int op = (opcode >> 21) & 15;
+  if (opcode & 0x00100000)
+    return op == 0x2 || op == 0x4 || op == 0xA || op == 0xB;
+  return op <= 0x4 || op >= 0xC;
+}
+
+// The code of ALU_INSN in GBA-arm.cpp for such an instruction, but the
+// clockTicks
+static void jitEmitArmInsn(CodeEmitter &e, GBASystem *gba, u32 opcode)
+{
+  // the second operand into edx
+  if (opcode & 0x02000000) {
+    u32 value = opcode & 0xFF;
+    int rotate = (opcode >> 7) & 0x1E;
+    if (rotate)
+      value = (value >> rotate) | (value << (32 - rotate));
+    e.movImm(EDX, value);
+  } else {
+    u8 shift = (opcode >> 7) & 31;
+    e.load(EDX, REG(opcode & 15));
+    switch ((opcode >> 5) & 3) {
+    case 0: // LSL
+      if (shift)
+        e.shift(SHIFT_SHL, EDX, shift);
+      break;
+    case 1: // LSR, #0 is #32
+      if (shift)
+        e.shift(SHIFT_SHR, EDX, shift);
+      else
+        e.clear(EDX);
+      break;
+    case 2: // ASR, #0 is #32
+      e.shift(SHIFT_SAR, EDX, shift ? shift : 31);
+      break;
+    case 3: // ROR
+      e.shift(SHIFT_ROR, EDX, shift);
+      break;
+    }
+  }
+
+  int op = (opcode >> 21) & 15;
+  if (op != 0xD && op != 0xF)
+    e.load(ECX, REG((opcode >> 16) & 15));
+  switch (op) {
+  case 0x0: e.movReg(EAX, ECX); e.aluReg(ALU_AND, EAX, EDX); break; // AND
+  case 0x1: e.movReg(EAX, ECX); e.aluReg(ALU_XOR, EAX, EDX); break; // EOR
+  case 0x2: case 0xA: e.movReg(EAX, ECX); e.aluReg(ALU_SUB, EAX, EDX); break; // SUB, CMP
+  case 0x3: e.movReg(EAX, EDX); e.aluReg(ALU_SUB, EAX, ECX); break; // RSB
+  case 0x4: case 0xB: e.movReg(EAX, ECX); e.aluReg(ALU_ADD, EAX, EDX); break; // ADD, CMN
+  case 0xC: e.movReg(EAX, ECX); e.aluReg(ALU_OR, EAX, EDX); break;  // ORR
+  case 0xD: e.movReg(EAX, EDX); break;                              // MOV
+  case 0xE: e.notReg(EDX); e.movReg(EAX, ECX); e.aluReg(ALU_AND, EAX, EDX); break; // BIC
+  case 0xF: e.movReg(EAX, EDX); e.notReg(EAX); break;               // MVN
+  }
+  if (op != 0xA && op != 0xB)
+    e.store(REG((opcode >> 12) & 15), EAX);
+  if (opcode & 0x00100000) {
+    jitEmitSetNZ(e, gba);
+    jitEmitDeferFlags(e, gba, (op == 0x4 || op == 0xB) ? GBASystem::FLAG_OP_ADD : GBASystem::FLAG_OP_SUB);
+  }
+}
+
+// The Thumb shifts by an immediate, additions, subtractions, moves,
+// comparisons and logical operations that leave the clockTicks to the
+// executor, without a write to the PC
+static bool jitIsNativeThumbInsn(u32 opcode)
+{
+  if (opcode < 0x4000)
+    return true;
+  if (opcode < 0x4400) {
+    int op = (opcode >> 6) & 15;
+    return op <= 0x1 || (op >= 0x8 && op <= 0xC) || op >= 0xE;
+  }
+  if (opcode < 0x4700) {
+    int op = (opcode >> 8) & 3;
+    int dest = (opcode & 7) | ((opcode >> 4) & 8);
+    return (opcode & 0xC0) != 0 && (op == 1 || dest != 15);
+  }
+  return false;
+}
+
+// The code of the handler of such an instruction
+static void jitEmitThumbInsn(CodeEmitter &e, GBASystem *gba, u32 opcode)
+{
+  if (opcode < 0x1800) {
+    // LSL, LSR, ASR Rd, Rs, #Imm5
+    u8 shift = (opcode >> 6) & 31;
+    int type = opcode >> 11;
+    e.load(EAX, REG((opcode >> 3) & 7));
+    if (type == 0 && shift == 0) {
+      // the carry is kept
+    } else if (shift == 0) {
+      // #0 is #32, the carry is bit 31
+      e.shift(type == 1 ? SHIFT_SHR : SHIFT_SAR, EAX, 31);
+      e.movReg(ECX, EAX);
+      e.alu(ALU_AND, ECX, 1);
+      e.storeByte(GBA_OFFSET(gba, C_FLAG), ECX);
+      if (type == 1)
+        e.clear(EAX);
+      e.storeByteImm(GBA_OFFSET(gba, cFlagOp), GBASystem::FLAG_OP_NONE);
+    } else {
+      e.shift(type == 0 ? SHIFT_SHL : (type == 1 ? SHIFT_SHR : SHIFT_SAR), EAX, shift);
+      e.setcc(CC_B, GBA_OFFSET(gba, C_FLAG));
+      e.storeByteImm(GBA_OFFSET(gba, cFlagOp), GBASystem::FLAG_OP_NONE);
+    }
+    e.store(REG(opcode & 7), EAX);
+    jitEmitSetNZ(e, gba);
+  } else if (opcode < 0x2000) {
+    // ADD, SUB Rd, Rs, Rn or #Imm3
+    int operand = (opcode >> 6) & 7;
+    e.load(ECX, REG((opcode >> 3) & 7));
+    if (opcode & 0x0400)
+      e.movImm(EDX, operand);
+    else
+      e.load(EDX, REG(operand));
+    e.movReg(EAX, ECX);
+    e.aluReg((opcode & 0x0200) ? ALU_SUB : ALU_ADD, EAX, EDX);
+    e.store(REG(opcode & 7), EAX);
+    jitEmitSetNZ(e, gba);
+    jitEmitDeferFlags(e, gba, (opcode & 0x0200) ? GBASystem::FLAG_OP_SUB : GBASystem::FLAG_OP_ADD);
+  } else if (opcode < 0x4000) {
+    // MOV, CMP, ADD, SUB Rd, #Offset8
+    int dest = (opcode >> 8) & 7;
+    u32 value = opcode & 255;
+    int op = (opcode >> 11) & 3;
+    if (op == 0) {
+      e.storeImm(REG(dest), value);
+      e.storeByteImm(GBA_OFFSET(gba, N_FLAG), 0);
+      e.storeByteImm(GBA_OFFSET(gba, Z_FLAG), value == 0);
+      return;
+    }
+    e.load(ECX, REG(dest));
+    e.movImm(EDX, value);
+    e.movReg(EAX, ECX);
+    e.aluReg(op == 2 ? ALU_ADD : ALU_SUB, EAX, EDX);
+    if (op != 1)
+      e.store(REG(dest), EAX);
+    jitEmitSetNZ(e, gba);
+    jitEmitDeferFlags(e, gba, op == 2 ? GBASystem::FLAG_OP_ADD : GBASystem::FLAG_OP_SUB);
+  } else if (opcode < 0x4400) {
+    // ALU operations
+    int dest = opcode & 7;
+    int op = (opcode >> 6) & 15;
+    e.load(ECX, REG(dest));
+    e.load(EDX, REG((opcode >> 3) & 7));
+    switch (op) {
+    case 0x0: case 0x8: e.movReg(EAX, ECX); e.aluReg(ALU_AND, EAX, EDX); break; // AND, TST
+    case 0x1: e.movReg(EAX, ECX); e.aluReg(ALU_XOR, EAX, EDX); break; // EOR
+    case 0x9: e.clear(ECX); e.movReg(EAX, ECX); e.aluReg(ALU_SUB, EAX, EDX); break; // NEG
+    case 0xA: e.movReg(EAX, ECX); e.aluReg(ALU_SUB, EAX, EDX); break; // CMP
+    case 0xB: e.movReg(EAX, ECX); e.aluReg(ALU_ADD, EAX, EDX); break; // CMN
+    case 0xC: e.movReg(EAX, ECX); e.aluReg(ALU_OR, EAX, EDX); break;  // ORR
+    case 0xE: e.notReg(EDX); e.movReg(EAX, ECX); e.aluReg(ALU_AND, EAX, EDX); break; // BIC
+    case 0xF: e.movReg(EAX, EDX); e.notReg(EAX); break;               // MVN
+    }
+    if (op != 0x8 && op != 0xA && op != 0xB)
+      e.store(REG(dest), EAX);
+    jitEmitSetNZ(e, gba);
+    if (op >= 0x9 && op <= 0xB)
+      jitEmitDeferFlags(e, gba, op == 0xB ? GBASystem::FLAG_OP_ADD : GBASystem::FLAG_OP_SUB);
+  } else {
+    // ADD, CMP, MOV with a high register
+    int dest = (opcode & 7) | ((opcode >> 4) & 8);
+    int op = (opcode >> 8) & 3;
+    e.load(EDX, REG(((opcode >> 3) & 7) | ((opcode >> 3) & 8)));
+    if (op == 2) {
+      e.store(REG(dest), EDX);
+      return;
+    }
+    e.load(ECX, REG(dest));
+    e.movReg(EAX, ECX);
+    e.aluReg(op == 0 ? ALU_ADD : ALU_SUB, EAX, EDX);
+    if (op == 0) {
+      e.store(REG(dest), EAX);
+      return;
+    }
+    jitEmitSetNZ(e, gba);
+    jitEmitDeferFlags(e, gba, GBASystem::FLAG_OP_SUB);
+  }
+}
+
+// Emits the translation of a block, which returns what the block executors
+// return. The code runs with rbx holding the GBASystem and r12 the block.
+static void jitEmitBlock(CodeEmitter &e, GBASystem *gba, CodeBlock *block, CodeCondition condition)
+{
+  bool thumb = block->thumb;
+  u32 size = thumb ? 2 : 4;
+
+  // entry, and the exits before the instructions, so that they are all
+  // jumped to backwards
+  e.byte(0x53);                          // push rbx
+  e.byte(0x41); e.byte(0x54);            // push r12
+  e.byte(0x48); e.byte(0x83); e.byte(0xEC); e.byte(STACK_SPACE); // sub rsp, STACK_SPACE
+  e.byte(0x48); e.byte(0x89); e.byte(0xC0 | (ARG0 << 3) | EBX);  // mov rbx, arg0
+  e.byte(0x49); e.byte(0x89); e.byte(0xC0 | (ARG1 << 3) | 4);    // mov r12, arg1
+  u8 *body = e.jmp();
+
+  // left with the pc of the last instruction in arg1
+  const u8 *leave = e.p;
+#ifdef GSFOPT
+  e.call((const void *)jitLeaveBlock);
+#endif
+  const u8 *exit1 = e.p;
+  e.movImm(EAX, 1);
+  u8 *epilogue = e.jmp();
+  const u8 *exit0 = e.p;
+  e.clear(EAX);
+  e.bind(epilogue);
+  e.byte(0x48); e.byte(0x83); e.byte(0xC4); e.byte(STACK_SPACE); // add rsp, STACK_SPACE
+  e.byte(0x41); e.byte(0x5C);            // pop r12
+  e.byte(0x5B);                          // pop rbx
+  e.byte(0xC3);                          // ret
+  e.bind(body);
+
+  u32 bpc = GBA_OFFSET(gba, busPrefetchCount);
+  u32 clockTicks = GBA_OFFSET(gba, clockTicks);
+  u32 armNextPC = GBA_OFFSET(gba, armNextPC);
+  for (int i = 0; i < block->count; i++) {
+    u32 pc = block->address + i * size;
+    u32 opcode = block->insns[i].opcode;
+    // the ticks of an emitted ARM instruction are those of the next one, in
+    // the same memory region but at its end
+    bool native = thumb ? jitIsNativeThumbInsn(opcode) :
+      jitIsNativeArmInsn(opcode) && ((pc + 4) >> 24) == (pc >> 24);
+
+    if (!thumb && (pc & 0x0803FFFF) == 0x08020000)
+      e.storeImm(bpc, 0x100);
+
+    e.load(EAX, GBA_OFFSET(gba, cpuPrefetch[1]));
+    e.store(GBA_OFFSET(gba, cpuPrefetch[0]), EAX);
+
+    e.storeByteImm(GBA_OFFSET(gba, busPrefetch), 0);
+    e.load(EAX, bpc);
+    e.testImm(EAX, thumb ? 0xFFFFFF00 : 0xFFFFFE00);
+    u8 *noBurst = e.jcc(CC_E);
+    e.alu(ALU_AND, EAX, 0xFF);
+    e.alu(ALU_OR, EAX, 0x100);
+    e.store(bpc, EAX);
+    e.bind(noBurst);
+    if (!native)
+      e.storeImm(clockTicks, 0);
+
+    e.load(EAX, GBA_OFFSET(gba, reg[15].I));
+    e.store(armNextPC, EAX);
+    e.alu(ALU_ADD, EAX, size);
+    e.store(GBA_OFFSET(gba, reg[15].I), EAX);
+    e.storeImm(GBA_OFFSET(gba, cpuPrefetch[1]), block->insns[i + 2].opcode);
+
+    // the flags that are kept as they are tested inline, the others by the interpreter
+    u8 *skipped = NULL;
+    if (!thumb && (opcode >> 28) != 0x0E) {
+      switch (opcode >> 28) {
+      case 0x00: // EQ
+      case 0x01: // NE
+        e.cmpByteImm(GBA_OFFSET(gba, Z_FLAG), 0);
+        skipped = e.jcc((opcode >> 28) == 0x00 ? CC_E : CC_NE);
+        break;
+      case 0x04: // MI
+      case 0x05: // PL
+        e.cmpByteImm(GBA_OFFSET(gba, N_FLAG), 0);
+        skipped = e.jcc((opcode >> 28) == 0x04 ? CC_E : CC_NE);
+        break;
+      default:
+        e.movImm(ARG1, opcode);
+        e.call((const void *)condition);
+        e.testByte(EAX);
+        skipped = e.jcc(CC_E);
+        break;
+      }
+    }
+
+    if (native) {
+      // the same ticks whether it is executed or skipped
+      if (thumb)
+        jitEmitThumbInsn(e, gba, opcode);
+      else
+        jitEmitArmInsn(e, gba, opcode);
+      if (skipped != NULL)
+        e.bind(skipped);
+      jitEmitSeqTicks(e, gba, thumb ? pc : pc + 4, thumb);
+      e.store(clockTicks, EAX);
+    } else {
+      e.movImm(ARG1, opcode);
+      e.call((const void *)block->insns[i].handler);
+      if (skipped != NULL)
+        e.bind(skipped);
+
+      e.load(EAX, clockTicks);
+      e.test(EAX);
+      e.jcc(CC_S, exit0);
+      u8 *counted = e.jcc(CC_NE);
+      jitEmitSeqTicks(e, gba, pc, thumb);
+      e.store(clockTicks, EAX);
+      e.bind(counted);
+    }
+    e.addStore(GBA_OFFSET(gba, cpuTotalTicks), EAX);
+
+#ifdef GSFOPT
+    // cmp dword [r12 + covered], i
+    e.byte(0x41); e.byte(0x81); e.byte(0xBC); e.byte(0x24);
+    e.dword((u32)((u8 *)&block->covered - (u8 *)block));
+    e.dword(i);
+    u8 *marked = e.jcc(CC_G);
+    e.movImm(ARG1, pc);
+    e.call(thumb ? (const void *)jitMarkHalfWordAsRead : (const void *)jitMarkWordAsRead);
+    e.bind(marked);
+#endif
+
+    // the block is left on a jump, or after a write to its code
+    e.movImm(ARG1, pc);
+    if (i == block->count - 1) {
+      u8 *last = e.jmp();
+      e.bind(last, leave);
+      break;
+    }
+
+    // an emitted instruction changes none of the state checked after the
+    // one before it, only the time
+    if (!native || i == 0) {
+      e.cmpImm(armNextPC, pc + size);
+      e.jcc(CC_NE, leave);
+      e.cmpImm(GBA_OFFSET(gba, codePageVersion[block->page]), block->version);
+      e.jcc(CC_NE, exit1);
+    }
+    e.load(EAX, GBA_OFFSET(gba, cpuTotalTicks));
+    e.cmpLoad(EAX, GBA_OFFSET(gba, cpuNextEvent));
+    e.jcc(CC_GE, exit1);
+    if (!native || i == 0) {
+      e.cmpByteImm(GBA_OFFSET(gba, armState), 0);
+      e.jcc(thumb ? CC_NE : CC_E, exit1);
+      e.cmpByteImm(GBA_OFFSET(gba, holdState), 0);
+      e.jcc(CC_NE, exit1);
+      e.cmpImm(GBA_OFFSET(gba, SWITicks), 0);
+      e.jcc(CC_NE, exit1);
+    }
+  }
+}
+
+// x86-64 pages, the unit in which the code buffer is made writable or
+// executable. It is never both, the pages that a translation is emitted to
+// are writable only while it is.
+enum { CODE_PAGE_SIZE = 4096 };
+
+static bool jitProtect(u8 *start, size_t size, bool writable)
+{
+#ifdef _WIN32
+  DWORD old;
+  if (!VirtualProtect(start, size, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old))
+    return false;
+  return writable || FlushInstructionCache(GetCurrentProcess(), start, size);
+#else
+  return mprotect(start, size, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+// Translates a block that is valid and decoded, NULL if there is no code
+// buffer. A full buffer is emptied, and the blocks in it are interpreted
+// until they are hot again.
+CodeBlockFunc CPUTranslateCodeBlock(GBASystem *gba, CodeBlock *block, CodeCondition condition)
+{
+  if (gba->codeBuffer == NULL)
+    return NULL;
+
+  u32 maxSize = (block->count + 1) * MAX_INSN_CODE;
+  if (gba->codeBufferUsed + maxSize > GBASystem::CODE_BUFFER_SIZE) {
+    for (int i = 0; i < GBASystem::CODE_BLOCK_COUNT; i++) {
+      gba->codeBlocks[i].code = NULL;
+      gba->codeBlocks[i].runs = 0;
+    }
+    gba->codeBufferUsed = 0;
+  }
+
+  // the buffer size is a multiple of the page size
+  u32 first = gba->codeBufferUsed & ~(CODE_PAGE_SIZE - 1);
+  u32 last = (gba->codeBufferUsed + maxSize + CODE_PAGE_SIZE - 1) & ~(CODE_PAGE_SIZE - 1);
+  if (!jitProtect(gba->codeBuffer + first, last - first, true))
+    return NULL;
+
+  CodeEmitter e;
+  u8 *start = gba->codeBuffer + gba->codeBufferUsed;
+  e.p = start;
+  jitEmitBlock(e, gba, block, condition);
+  gba->codeBufferUsed = (u32)((e.p - gba->codeBuffer + 15) & ~15);
+
+  if (!jitProtect(gba->codeBuffer + first, last - first, false)) {
+    // the translations on those pages can not run any more
+    for (int i = 0; i < GBASystem::CODE_BLOCK_COUNT; i++)
+      gba->codeBlocks[i].code = NULL;
+    CPUFreeCodeBuffer(gba);
+    return NULL;
+  }
+  return (CodeBlockFunc)start;
+}
+
+void CPUAllocateCodeBuffer(GBASystem *gba)
+{
+#ifdef _WIN32
+  void *buffer = VirtualAlloc(NULL, GBASystem::CODE_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+  void *buffer = mmap(NULL, GBASystem::CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED)
+    buffer = NULL;
+#endif
+  gba->codeBuffer = (u8 *)buffer;
+  gba->codeBufferUsed = 0;
+}
+
+void CPUFreeCodeBuffer(GBASystem *gba)
+{
+  if (gba->codeBuffer != NULL) {
+#ifdef _WIN32
+    VirtualFree(gba->codeBuffer, 0, MEM_RELEASE);
+#else
+    munmap(gba->codeBuffer, GBASystem::CODE_BUFFER_SIZE);
+#endif
+    gba->codeBuffer = NULL;
+  }
+}
+
+#ifdef CODE_JIT_LOCKSTEP
+// What a block changes apart from the emulation state: the code cache, which
+// CPUReadState empties, the bookkeeping of the coverage, and the clockTicks
+struct LockstepExtra
+{
+  u32 blockAddress[GBASystem::CODE_BLOCK_COUNT];
+  bool codePageUsed[GBASystem::CODE_PAGE_COUNT];
+  u32 codePageVersion[GBASystem::CODE_PAGE_COUNT + 1];
+  int clockTicks;
+#ifdef GSFOPT
+  u64 newDataTicks;
+  GBASystem::IdleLoopState idleLoopState;
+  bool idleLoopCaptured;
+  u32 idleLoopStart;
+  int idleLoopStartTicks;
+  bool idleLoopTainted;
+  bool idleLoopRecording;
+  u32 idleLoopMarkCount;
+  GBASystem::IdleLoopMark idleLoopMarks[GBASystem::IDLE_LOOP_MAX_MARKS];
+#endif
+};
+
+static void jitSaveExtra(GBASystem *gba, LockstepExtra &extra)
+{
+  memset(&extra, 0, sizeof(extra));
+  for (int i = 0; i < GBASystem::CODE_BLOCK_COUNT; i++)
+    extra.blockAddress[i] = gba->codeBlocks[i].address;
+  memcpy(extra.codePageUsed, gba->codePageUsed, sizeof(extra.codePageUsed));
+  memcpy(extra.codePageVersion, gba->codePageVersion, sizeof(extra.codePageVersion));
+  extra.clockTicks = gba->clockTicks;
+#ifdef GSFOPT
+  extra.newDataTicks = gba->newDataTicks;
+  memcpy(&extra.idleLoopState, &gba->idleLoopState, sizeof(extra.idleLoopState));
+  extra.idleLoopCaptured = gba->idleLoopCaptured;
+  extra.idleLoopStart = gba->idleLoopStart;
+  extra.idleLoopStartTicks = gba->idleLoopStartTicks;
+  extra.idleLoopTainted = gba->idleLoopTainted;
+  extra.idleLoopRecording = gba->idleLoopRecording;
+  extra.idleLoopMarkCount = gba->idleLoopMarkCount;
+  memcpy(extra.idleLoopMarks, gba->idleLoopMarks, sizeof(extra.idleLoopMarks));
+#endif
+}
+
+static void jitRestoreExtra(GBASystem *gba, const LockstepExtra &extra)
+{
+  for (int i = 0; i < GBASystem::CODE_BLOCK_COUNT; i++)
+    gba->codeBlocks[i].address = extra.blockAddress[i];
+  memcpy(gba->codePageUsed, extra.codePageUsed, sizeof(extra.codePageUsed));
+  memcpy(gba->codePageVersion, extra.codePageVersion, sizeof(extra.codePageVersion));
+  gba->clockTicks = extra.clockTicks;
+#ifdef GSFOPT
+  gba->newDataTicks = extra.newDataTicks;
+  memcpy(&gba->idleLoopState, &extra.idleLoopState, sizeof(extra.idleLoopState));
+  gba->idleLoopCaptured = extra.idleLoopCaptured;
+  gba->idleLoopStart = extra.idleLoopStart;
+  gba->idleLoopStartTicks = extra.idleLoopStartTicks;
+  gba->idleLoopTainted = extra.idleLoopTainted;
+  gba->idleLoopRecording = extra.idleLoopRecording;
+  gba->idleLoopMarkCount = extra.idleLoopMarkCount;
+  memcpy(gba->idleLoopMarks, extra.idleLoopMarks, sizeof(extra.idleLoopMarks));
+#endif
+}
+
+// The registers, ticks and coverage of a run, as reported on a difference
+struct LockstepSummary
+{
+  int result;
+  u32 reg[17];
+  bool N_FLAG, C_FLAG, Z_FLAG, V_FLAG;
+  u32 armNextPC;
+  int cpuTotalTicks;
+  int clockTicks;
+  int busPrefetchCount;
+#ifdef GSFOPT
+  u32 bytes_used;
+  u64 newDataTicks;
+#endif
+};
+
+// after CPUWriteState, which resolves the flags
+static void jitSummarize(GBASystem *gba, int result, LockstepSummary &summary)
+{
+  memset(&summary, 0, sizeof(summary));
+  summary.result = result;
+  for (int i = 0; i < 17; i++)
+    summary.reg[i] = gba->reg[i].I;
+  summary.N_FLAG = gba->N_FLAG;
+  summary.C_FLAG = gba->C_FLAG;
+  summary.Z_FLAG = gba->Z_FLAG;
+  summary.V_FLAG = gba->V_FLAG;
+  summary.armNextPC = gba->armNextPC;
+  summary.cpuTotalTicks = gba->cpuTotalTicks;
+  summary.clockTicks = gba->clockTicks;
+  summary.busPrefetchCount = gba->busPrefetchCount;
+#ifdef GSFOPT
+  summary.bytes_used = gba->bytes_used;
+  summary.newDataTicks = gba->newDataTicks;
+#endif
+}
+
+static void jitPrintSummary(const char *name, const LockstepSummary &summary)
+{
+  fprintf(stderr, "%-11s result %d, pc %08X, ticks %d (+%d), prefetch %X, flags %c%c%c%c\n", name,
+    summary.result, summary.armNextPC, summary.cpuTotalTicks, summary.clockTicks, summary.busPrefetchCount,
+    summary.N_FLAG ? 'N' : '-', summary.Z_FLAG ? 'Z' : '-', summary.C_FLAG ? 'C' : '-', summary.V_FLAG ? 'V' : '-');
+  for (int i = 0; i < 17; i++)
+    fprintf(stderr, "%s%s%08X", (i % 8) == 0 ? "           " : "", i == 16 ? "cpsr " : "", summary.reg[i]);
+  fprintf(stderr, "\n");
+#ifdef GSFOPT
+  fprintf(stderr, "           coverage %u bytes, new data at %llu\n", summary.bytes_used,
+    (unsigned long long)summary.newDataTicks);
+#endif
+}
+
+// Every block is checked on its first runs, then once in an interval, as a
+// check saves the whole state three times
+enum { LOCKSTEP_FIRST_RUNS = 4, LOCKSTEP_INTERVAL = 1024 };
+
+// Runs the block with the interpreter, then again from the same state with
+// its translation, which is what the emulation continues with. The saved
+// states, which hold the memory and the coverage too, must be the same.
+int CPULockstepCodeBlock(GBASystem *gba, CodeBlock *block, CodeBlockFunc interpret)
+{
+  // the runs go on counting once the block is translated
+  if (++block->runs > CodeBlock::HOT_RUNS + LOCKSTEP_FIRST_RUNS) {
+    if (block->runs < CodeBlock::HOT_RUNS + LOCKSTEP_FIRST_RUNS + LOCKSTEP_INTERVAL)
+      return block->code(gba, block);
+    block->runs = CodeBlock::HOT_RUNS + LOCKSTEP_FIRST_RUNS;
+  }
+
+  std::vector<u8> start, interpreted, translated;
+  LockstepExtra startExtra, interpretedExtra, translatedExtra;
+  LockstepSummary interpretedSummary, translatedSummary;
+
+  StateStream startStream(start);
+  CPUWriteState(gba, startStream);
+  jitSaveExtra(gba, startExtra);
+
+  int interpretedResult = interpret(gba, block);
+  StateStream interpretedStream(interpreted);
+  CPUWriteState(gba, interpretedStream);
+  jitSaveExtra(gba, interpretedExtra);
+  jitSummarize(gba, interpretedResult, interpretedSummary);
+
+  StateStream restoreStream(start.data(), start.size());
+  if (!CPUReadState(gba, restoreStream)) {
+    fprintf(stderr, "Lockstep: unable to restore the state before the block at %08X\n", block->address);
+    abort();
+  }
+  jitRestoreExtra(gba, startExtra);
+
+  int translatedResult = block->code(gba, block);
+  StateStream translatedStream(translated);
+  CPUWriteState(gba, translatedStream);
+  jitSaveExtra(gba, translatedExtra);
+  jitSummarize(gba, translatedResult, translatedSummary);
+
+  bool stateSame = interpreted == translated;
+  if (!stateSame || memcmp(&interpretedSummary, &translatedSummary, sizeof(interpretedSummary)) != 0 ||
+      memcmp(&interpretedExtra, &translatedExtra, sizeof(interpretedExtra)) != 0) {
+    fprintf(stderr, "Lockstep: the %s block at %08X of %d instructions differs from the interpreter\n",
+      block->thumb ? "Thumb" : "ARM", block->address, block->count);
+    if (!stateSame) {
+      size_t offset = 0;
+      while (offset < interpreted.size() && offset < translated.size() && interpreted[offset] == translated[offset])
+        offset++;
+      fprintf(stderr, "           the saved states differ from byte %u\n", (unsigned)offset);
+    }
+    jitPrintSummary("interpreter", interpretedSummary);
+    jitPrintSummary("translation", translatedSummary);
+    abort();
+  }
+  return translatedResult;
+}
+#endif
+
+#endif
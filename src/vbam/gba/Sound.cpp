@@ -34,7 +34,33 @@
 
 static inline GBA::blip_time_t blip_time(GBASystem *gba)
 {
-    return gba->SOUND_CLOCK_TICKS - gba->soundTicks;
+    return gba->SOUND_CLOCK_TICKS - (CPUTicksUntil(gba, gba->soundTime) - gba->cpuTotalTicks);
+}
+
+static inline bool synthesizing(GBASystem *gba)
+{
+    return gba->soundSynthesis && !gba->soundSuspended;
+}
+
+// Outputs a Direct Sound channel is sent to (1 = right, 2 = left, 3 = both)
+static int pcm_channel(GBASystem *gba, int idx)
+{
+    if ( (gba->soundEnableFlag >> idx & 0x100) && (gba->ioMem [NR52] & 0x80) )
+        return gba->ioMem [SGCNT0_H+1] >> (idx * 4) & 3;
+    return 0;
+}
+
+static void apply_muting(GBASystem *gba);
+
+// Resumes synthesis before the hardware makes a sound
+static void sound_activity(GBASystem *gba)
+{
+    gba->soundActive = true;
+    if ( gba->soundSuspended )
+    {
+        gba->soundSuspended = false;
+        apply_muting(gba);
+    }
 }
 
 void Gba_Pcm::init(GBASystem *gba)
@@ -51,8 +77,8 @@ void Gba_Pcm::apply_control( int idx )
     shift = ~gba->ioMem [SGCNT0_H] >> (2 + idx) & 1;
 
 	int ch = 0;
-    if ( (gba->soundEnableFlag >> idx & 0x100) && (gba->ioMem [NR52] & 0x80) )
-        ch = gba->ioMem [SGCNT0_H+1] >> (idx * 4) & 3;
+    if ( synthesizing(gba) )
+        ch = pcm_channel(gba, idx);
 
     GBA::Blip_Buffer* out = 0;
 	switch ( ch )
@@ -116,6 +142,30 @@ void Gba_Pcm::update( int dac )
 	}
 }
 
+void Gba_Pcm::syncState( StateStream &state )
+{
+    // output buffer is stored as the channel selected by apply_control()
+    int ch = 0;
+    if ( output == gba->stereo_buffer->right() )  ch = 1;
+    if ( output == gba->stereo_buffer->left() )   ch = 2;
+    if ( output == gba->stereo_buffer->center() ) ch = 3;
+    state.sync( ch );
+    if ( !state.saving() )
+    {
+        output = 0;
+        switch ( ch )
+        {
+        case 1: output = gba->stereo_buffer->right();  break;
+        case 2: output = gba->stereo_buffer->left();   break;
+        case 3: output = gba->stereo_buffer->center(); break;
+        }
+    }
+
+    state.sync( last_time );
+    state.sync( last_amp );
+    state.sync( shift );
+}
+
 void Gba_Pcm_Fifo::init(GBASystem *gba)
 {
     this->gba = gba;
@@ -148,8 +198,11 @@ void Gba_Pcm_Fifo::timer_overflowed( int which_timer )
 
 		// Read next sample from FIFO
 		count--;
+		int old_dac = dac;
 		dac = fifo [readIndex];
 		readIndex = (readIndex + 1) & 31;
+		if ( dac != old_dac && pcm_channel( gba, which ) )
+			sound_activity( gba );
 		pcm.update( dac );
 	}
 }
@@ -181,6 +234,18 @@ void Gba_Pcm_Fifo::write_fifo( int data )
 	writeIndex = (writeIndex + 2) & 31;
 }
 
+void Gba_Pcm_Fifo::syncState( StateStream &state )
+{
+    state.sync( readIndex );
+    state.sync( count );
+    state.sync( writeIndex );
+    state.sync( fifo, sizeof fifo );
+    state.sync( dac );
+    state.sync( timer );
+    state.sync( enabled );
+    pcm.syncState( state );
+}
+
 static void apply_control(GBASystem *gba)
 {
     gba->pcm [0].pcm.apply_control( 0 );
@@ -212,6 +277,8 @@ void soundEvent(GBASystem *gba, u32 address, u8 data)
 	{
         gba->ioMem[address] = data;
         gba->gb_apu->write_register( blip_time(gba), gb_addr, data );
+        if ( !gba->gb_apu->silent() )
+            sound_activity(gba);
 
 		if ( address == NR52 )
             apply_control(gba);
@@ -335,6 +402,23 @@ static void apply_filtering(GBASystem *gba)
 	}
 }
 
+// Suspends synthesis once the hardware has been unable to make a sound for
+// two ticks, which leaves time for the sound made before to fade out
+static void check_silence(GBASystem *gba)
+{
+    if ( !gba->soundActive && gba->gb_apu->silent() )
+        gba->soundQuietTicks++;
+    else
+        gba->soundQuietTicks = 0;
+    gba->soundActive = false;
+
+    if ( gba->soundQuietTicks >= 2 && !gba->soundSuspended )
+    {
+        gba->soundSuspended = true;
+        apply_muting(gba);
+    }
+}
+
 void psoundTickfn(GBASystem *gba)
 {
     if ( gba->gb_apu && gba->stereo_buffer )
@@ -342,7 +426,14 @@ void psoundTickfn(GBASystem *gba)
 		// Run sound hardware to present
         end_frame( gba, gba->SOUND_CLOCK_TICKS );
 
-        flush_samples( gba, gba->stereo_buffer );
+        // without synthesis nothing has been written to the buffer
+        if ( !synthesizing(gba) )
+            gba->output->skip( gba->stereo_buffer->remove_silence() );
+        else
+            flush_samples( gba, gba->stereo_buffer );
+
+        if ( gba->soundSilenceSkipping )
+            check_silence(gba);
 
         if ( gba->soundFiltering_ != gba->soundFiltering )
             apply_filtering(gba);
@@ -365,7 +456,7 @@ static void apply_muting(GBASystem *gba)
 		// APU
 		for ( int i = 0; i < 4; i++ )
 		{
-            if ( gba->soundEnableFlag >> i & 1 )
+            if ( synthesizing(gba) && (gba->soundEnableFlag >> i & 1) )
                 gba->gb_apu->set_output( gba->stereo_buffer->center(),
                         gba->stereo_buffer->left(), gba->stereo_buffer->right(), i );
 			else
@@ -385,7 +476,7 @@ static void reset_apu(GBASystem *gba)
     if ( gba->stereo_buffer )
         gba->stereo_buffer->clear();
 
-    gba->soundTicks = gba->SOUND_CLOCK_TICKS;
+    gba->soundTime = gba->cpuElapsedTicks + gba->SOUND_CLOCK_TICKS;
 }
 
 static void remake_stereo_buffer(GBASystem *gba)
@@ -475,16 +566,69 @@ int soundGetEnable(GBASystem *gba)
 
 void soundReset(GBASystem *gba)
 {
+    gba->soundSuspended = false;
+    gba->soundActive = false;
+    gba->soundQuietTicks = 0;
+
     remake_stereo_buffer(gba);
     reset_apu(gba);
 
     gba->soundPaused = true;
     gba->SOUND_CLOCK_TICKS = GBASystem::SOUND_CLOCK_TICKS_;
-    gba->soundTicks        = GBASystem::SOUND_CLOCK_TICKS_;
+    gba->soundTime         = gba->cpuElapsedTicks + GBASystem::SOUND_CLOCK_TICKS_;
 
     soundEvent( gba, NR52, (u8) 0x80 );
 }
 
+static void soundSyncState( GBASystem *gba, StateStream &state )
+{
+    gba->pcm [0].syncState( state );
+    gba->pcm [1].syncState( state );
+    gba->stereo_buffer->sync_state( state );
+
+    state.sync( gba->soundPaused );
+    state.sync( gba->soundSuspended );
+    state.sync( gba->soundActive );
+    state.sync( gba->soundQuietTicks );
+    state.sync( gba->SOUND_CLOCK_TICKS );
+    state.sync( gba->soundTime );
+}
+
+void soundWriteState( GBASystem *gba, StateStream &state )
+{
+    long sampleRate = gba->soundSampleRate;
+    state.sync( sampleRate );
+
+    // the custom state leaves the unused fields as they are
+    GBA::gb_apu_state_t apu_state;
+    memset( &apu_state, 0, sizeof apu_state );
+    gba->gb_apu->save_state( &apu_state );
+    state.sync( apu_state );
+
+    soundSyncState( gba, state );
+}
+
+bool soundReadState( GBASystem *gba, StateStream &state )
+{
+    long sampleRate = 0;
+    state.sync( sampleRate );
+    if ( !state.ok() || sampleRate != gba->soundSampleRate )
+        return false;
+
+    GBA::gb_apu_state_t apu_state;
+    state.sync( apu_state );
+    if ( !state.ok() || gba->gb_apu->load_state( apu_state ) )
+        return false;
+
+    soundSyncState( gba, state );
+    if ( !state.ok() )
+        return false;
+
+    // the outputs depend on whether synthesis was suspended
+    apply_muting( gba );
+    return true;
+}
+
 bool soundInit(GBASystem *gba, GBASoundOut *out)
 {
     gba->soundPaused = true;
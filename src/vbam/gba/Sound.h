@@ -9,6 +9,8 @@ struct GBASystem;
 
 struct GBASoundOut;
 
+class StateStream;
+
 // Initializes sound and returns true if successful. Sets sound quality to
 // current value in soundQuality global.
 bool soundInit(GBASystem *, GBASoundOut *);
@@ -66,6 +68,11 @@ void soundTimerOverflow( GBASystem *, int which );
 // Notifies emulator that SOUND_CLOCK_TICKS clocks have passed
 void psoundTickfn(GBASystem *);
 
+// Saves/restores the complete sound state, including samples not output yet.
+// State can only be restored with the same sample rate.
+void soundWriteState( GBASystem *, StateStream & );
+bool soundReadState( GBASystem *, StateStream & );
+
 namespace GBA { class Multi_Buffer; }
 
 void flush_samples(GBASystem *, GBA::Multi_Buffer * buffer);
@@ -538,6 +538,77 @@ void BIOS_HuffUnComp(GBASystem *gba)
   }
 }
 
+// Clears the BIOS interrupt flags (at 0x3007FF8) that have been waited for,
+// with IME disabled, and returns them, like the wait loop of the BIOS.
+static u16 BIOS_IntrWaitCheck(GBASystem *gba, u16 flags)
+{
+  CPUUpdateRegister(gba, 0x208, 0);
+
+  u16 biosIF = READ16LE(((u16 *)&gba->internalRAM[0x7ff8]));
+  u16 matched = biosIF & flags;
+  if(matched) {
+    biosIF ^= matched;
+#ifdef GSFOPT
+    CPUMarkInternalRamWritten(gba, 0x7ff8);
+#endif
+    CPUMarkInternalRamCodeWritten(gba, 0x7ff8);
+    WRITE16LE(((u16 *)&gba->internalRAM[0x7ff8]), biosIF);
+  }
+
+  CPUUpdateRegister(gba, 0x208, 1);
+
+  gba->reg[0].I = matched;
+  gba->reg[2].I = biosIF;
+  gba->reg[12].I = 0x04000000;
+  return matched;
+}
+
+// Halts until an interrupt whose flag is in r1 has been handled, without
+// running the BIOS code. The CPU is halted on the SWI itself, so that the
+// SWI is executed again once the IRQ handler returns, to check the flags.
+static void BIOS_IntrWait(GBASystem *gba, bool vblank)
+{
+  u32 address = gba->armNextPC - (gba->armState ? 4 : 2);
+  if(gba->intrWaiting && gba->intrWaitPC == address) {
+    if(BIOS_IntrWaitCheck(gba, gba->intrWaitFlags)) {
+      gba->intrWaiting = false;
+      gba->reg[3].I = 0;
+      return;
+    }
+  } else {
+    if(vblank) {
+      gba->reg[0].I = 1;
+      gba->reg[1].I = 1;
+    }
+
+    // r0 = 1 discards the flags that are already set
+    gba->intrWaitFlags = gba->reg[1].I & 0xFFFF;
+    if(gba->reg[0].I != 0)
+      BIOS_IntrWaitCheck(gba, gba->intrWaitFlags);
+  }
+
+  gba->reg[3].I = 0;
+  gba->intrWaiting = true;
+  gba->intrWaitPC = address;
+  gba->holdState = true;
+  gba->holdType = -1;
+  gba->cpuNextEvent = gba->cpuTotalTicks;
+
+  gba->armNextPC = address;
+  gba->reg[15].I = address + (gba->armState ? 4 : 2);
+  CPUFlushPrefetch(gba);
+}
+
+void BIOS_IntrWait(GBASystem *gba)
+{
+  BIOS_IntrWait(gba, false);
+}
+
+void BIOS_VBlankIntrWait(GBASystem *gba)
+{
+  BIOS_IntrWait(gba, true);
+}
+
 void BIOS_LZ77UnCompVram(GBASystem *gba)
 {
   u32 source = gba->reg[0].I;
@@ -712,6 +783,10 @@ void BIOS_RegisterRamReset(GBASystem *gba, u32 flags)
   CPUUpdateRegister(gba, 0x0, 0x80);
 
   if(flags) {
+#ifdef GSFOPT
+    CPUMarkRamDirty(gba);
+#endif
+    CPUInvalidateRamCode(gba);
     if(flags & 0x01) {
       // clear work RAM
       memset(gba->workRAM, 0, 0x40000);
@@ -889,6 +964,7 @@ void BIOS_SoftReset(GBASystem *gba)
   gba->armMode = 0x1F;
   gba->armIrqEnable = false;
   gba->C_FLAG = gba->V_FLAG = gba->N_FLAG = gba->Z_FLAG = false;
+  gba->cFlagOp = gba->vFlagOp = GBASystem::FLAG_OP_NONE;
   gba->reg[13].I = 0x03007F00;
   gba->reg[14].I = 0x00000000;
   gba->reg[16].I = 0x00000000;
@@ -901,6 +977,11 @@ void BIOS_SoftReset(GBASystem *gba)
   u8 b = gba->internalRAM[0x7ffa];
 
   memset(&gba->internalRAM[0x7e00], 0, 0x200);
+#ifdef GSFOPT
+  CPUMarkInternalRamWritten(gba, 0x7e00);
+#endif
+  CPUMarkInternalRamCodeWritten(gba, 0x7e00);
+  CPUMarkInternalRamCodeWritten(gba, 0x7f00);
 
   if(b) {
     gba->armNextPC = 0x02000000;
@@ -14,6 +14,8 @@ extern void BIOS_Diff16bitUnFilter(GBASystem *);
 extern void BIOS_Div(GBASystem *);
 extern void BIOS_DivARM(GBASystem *);
 extern void BIOS_HuffUnComp(GBASystem *);
+extern void BIOS_IntrWait(GBASystem *);
+extern void BIOS_VBlankIntrWait(GBASystem *);
 extern void BIOS_LZ77UnCompVram(GBASystem *);
 extern void BIOS_LZ77UnCompWram(GBASystem *);
 extern void BIOS_ObjAffineSet(GBASystem *);